@@ -49,6 +49,8 @@ enum rp2350_gpio
 
 #define RSTn_PIN        GPIO14
 
+#define SYNC_PIN        GPIO13      // Drives the shared DW1000 SYNC line (EXT_SYNC master)
+
 // #if (CONFIG_SPI_MASTER_MODE)
 #define SPI_INST        spi0
 // #define SPI_INST         spi_default // spi0
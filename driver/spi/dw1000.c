@@ -8,9 +8,11 @@
 
 #include "pico/stdlib.h"
 #include "pico/binary_info.h"
+#include "pico/rand.h"
 #include "spi.h"
 #include "led.h"
 #include "print.h"
+#include "sim_rand.h"
 #include "gpio.h"
 
 #include <stdio.h>
@@ -25,6 +27,9 @@ static struct dw1000_context m_dw1000_ctx = {0};
 uint64_t dx_time;
 #if (CONFIG_DW1000_ANCHOR)
 uint64_t t_poll_rx, t_resp_tx, t_final_rx;
+#if (CONFIG_DW1000_DX_RX_FINAL)
+static bool final_rx_armed;
+#endif
 #endif
 #if (CONFIG_DW1000_TAG)
 uint64_t t_poll_tx, t_resp_rx, t_final_dx;
@@ -236,6 +241,66 @@ uint8_t m_tx_buf[4096];
 uint8_t m_rx_buf[4096];
 uint8_t m_buf[256];
 
+/**
+ * @brief Transfer len bytes between buf and a register file, starting at ofs,
+ * in one SPI transaction.
+ *
+ * Unlike the indexed read / write functions, the data is not staged in
+ * m_tx_buf / m_rx_buf: the header is clocked out first and the data goes
+ * straight from or into buf while CSn is still asserted. This is how whole
+ * frames are moved in and out of the 1024 byte TX / RX buffers.
+ */
+static int dw1000_stream(const struct spi_config *spi_cfg, uint8_t reg_file_id,
+    uint16_t ofs, void *buf, size_t len, bool write)
+{
+    if ((buf == NULL) || (reg_file_id > 0x3F) || (ofs > 0x7FFF) || (len == 0))
+        goto err;
+
+    uint8_t header[sizeof(union dw1000_tran_header3)];
+    int header_size;
+    uint8_t op = write ? dw1000_SPI_WRITE : dw1000_SPI_READ;
+    if (ofs == 0) {
+        union dw1000_tran_header1 header1 = {.rid = reg_file_id, .op = op};
+        header_size = sizeof(header1);
+        memcpy(header, &header1.value, header_size);
+    } else if (ofs <= 0x7F) {
+        union dw1000_tran_header2 header2 = {.rid = reg_file_id, .si = 1, .op = op, .sub_addr = ofs};
+        header_size = sizeof(header2);
+        memcpy(header, header2.value, header_size);
+    } else {
+        union dw1000_tran_header3 header3 = {
+            .rid        = reg_file_id,
+            .si         = 1,
+            .op         = op,
+            .sub_addr_l = ofs & 0x7F,
+            .ext        = 1,
+            .sub_addr_h = ofs >> 7,
+        };
+        header_size = sizeof(header3);
+        memcpy(header, header3.value, header_size);
+    }
+
+    int num_bytes = header_size + len;
+    cs_select(spi_cfg->pin.csn);
+    int num_written = spi_write_blocking(spi_cfg->spi, header, header_size);
+    if (num_written == header_size) {
+        if (write)
+            num_written += spi_write_blocking(spi_cfg->spi, buf, len);
+        else
+            num_written += spi_read_blocking(spi_cfg->spi, 0, buf, len);
+    }
+    cs_deselect(spi_cfg->pin.csn);
+    if (num_written != num_bytes) {
+        dw1000_trace(INFO, "num_written (%d) != num_bytes (%d)\n", num_written, num_bytes);
+        goto err;
+    }
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
 int dw1000_non_indexed_read(const struct spi_config *spi_cfg, uint8_t reg_file_id,
     void *buf, size_t len, const char *msg)
 {
@@ -855,6 +920,141 @@ err:
     return -1;
 }
 
+/**
+ * @brief Airtime of a frame from the start of the preamble to the end of the
+ * payload, for the configured bit rate, PRF and preamble length.
+ *
+ * @param[in] len    Frame length including the 2 byte FCS.
+ * @param[in] shr    Include the synchronisation header (preamble and SFD).
+ *
+ * @return Airtime in ns.
+ */
+static inline uint32_t dw1000_frame_airtime_ns(uint16_t len, bool shr)
+{
+    uint32_t bits = 8u * len;
+    bits += DW1000_RS_PARITY_BITS * ((bits + DW1000_RS_BLOCK_BITS - 1) / DW1000_RS_BLOCK_BITS);
+    uint64_t ps = DW1000_PHR_BITS * DW1000_PHR_SYMBOL_PS(DW1000_BR) + bits * DW1000_DATA_SYMBOL_PS(DW1000_BR);
+    if (shr)
+        ps += (DW1000_PREAMBLE_SYMBOLS(DW1000_PSR) + DW1000_SFD_SYMBOLS(DW1000_BR)) * DW1000_PREAMBLE_SYMBOL_PS(DW1000_PRF);
+    return (uint32_t)(ps / 1000);
+}
+
+/**
+ * @brief Airtime of the frames of one ranging exchange: poll and response, and
+ * the final unless single-sided.
+ *
+ * @param[in] extra  Header bytes added to each frame, to compare against
+ *                   another frame format.
+ *
+ * @return Airtime in ns.
+ */
+static uint32_t dw1000_twr_exchange_airtime_ns(uint16_t extra)
+{
+    uint32_t ns = dw1000_frame_airtime_ns(sizeof(union dw1000_poll_msg) + extra + 2, true) +
+        dw1000_frame_airtime_ns(sizeof(union dw1000_resp_msg) + extra + 2, true);
+#if (!CONFIG_DW1000_SS_TWR)
+    ns += dw1000_frame_airtime_ns(sizeof(union dw1000_final_msg) + extra + 2, true);
+#endif
+    return ns;
+}
+
+/**
+ * @brief Write DRX_PRETOC unless it already holds @p pretoc.
+ *
+ * @param[in] pretoc     Preamble detection timeout in PACs, 0 turns it off.
+ */
+static int dw1000_set_pretoc(uint16_t pretoc)
+{
+    union DW1000_SUB_REG_DRX_PRETOC *drx_pretoc = &m_dw1000_ctx.drx_conf.drx_pretoc;
+    if (drx_pretoc->value == pretoc)
+        return 0;
+
+    drx_pretoc->value = pretoc;
+    if (dw1000_short_indexed_write(&m_dw1000_ctx.spi_cfg, DW1000_DRX_CONF, DW1000_DRX_PRETOC, drx_pretoc, sizeof(*drx_pretoc), NULL))
+        goto err;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Open the receive window for the reply to a frame sent with WAIT4RESP.
+ *
+ * The reply delay runs from RMARKER to RMARKER, so from the end of the sent
+ * frame the reply ends after the delay, less the PHR and payload of the sent
+ * frame, plus the PHR and payload of the reply. When the reply is scheduled,
+ * W4R_TIM keeps the receiver off until W4R_GUARD_US before its preamble, and
+ * RX_FWTO runs from there to the end of the reply plus RX_FWTO_MARGIN_US.
+ * If no preamble has been detected PRETOC_MARGIN_PACS after the expected end
+ * of the preamble, the preamble detection timeout ends the window with RXPTO
+ * long before RX_FWTO would.
+ *
+ * @param[in] reply_us    Delay from the RMARKER of the sent frame to the RMARKER of the reply.
+ * @param[in] scheduled   The reply is sent at a DX_TIME, otherwise reply_us is only a bound.
+ * @param[in] tx_len      Length of the sent frame including the FCS.
+ * @param[in] rx_len      Length of the reply including the FCS.
+ */
+static int dw1000_open_reply_window(uint32_t reply_us, bool scheduled, uint16_t tx_len, uint16_t rx_len)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    int64_t end_ns = (int64_t)reply_us * 1000 -
+        dw1000_frame_airtime_ns(tx_len, false) + dw1000_frame_airtime_ns(rx_len, false);
+
+    int64_t preamble_ns = end_ns - dw1000_frame_airtime_ns(rx_len, true);
+    int64_t w4r = 0;
+#if (CONFIG_DW1000_W4R_TIM)
+    if (scheduled) {
+        w4r = (preamble_ns - W4R_GUARD_US * 1000) * 1000 / (int64_t)DW1000_RX_FWTO_UNIT_PS;
+        w4r = w4r < 0 ? 0 : (w4r > 0xFFFFF ? 0xFFFFF : w4r);
+    }
+#endif
+    int64_t w4r_ns = w4r * (int64_t)DW1000_RX_FWTO_UNIT_PS / 1000;
+    int64_t on_ns  = end_ns - w4r_ns;
+    int64_t fwto = ((on_ns + RX_FWTO_MARGIN_US * 1000) * 1000 + DW1000_RX_FWTO_UNIT_PS - 1) / (int64_t)DW1000_RX_FWTO_UNIT_PS;
+    fwto = fwto < 1 ? 1 : (fwto > UINT16_MAX ? UINT16_MAX : fwto);
+
+    int64_t pretoc = 0;
+#if (CONFIG_DW1000_PRETOC)
+    if (scheduled) {
+        // The DW1000 counts one PAC more than programmed
+        int64_t pac_ns = (int64_t)m_dw1000_ctx.pac_size * DW1000_PREAMBLE_SYMBOL_PS(DW1000_PRF) / 1000;
+        int64_t shr_ns = (int64_t)DW1000_PREAMBLE_SYMBOLS(DW1000_PSR) * DW1000_PREAMBLE_SYMBOL_PS(DW1000_PRF) / 1000;
+        pretoc = (preamble_ns - w4r_ns + shr_ns + pac_ns - 1) / pac_ns + PRETOC_MARGIN_PACS - 1;
+        pretoc = pretoc < 1 ? 1 : (pretoc > UINT16_MAX ? UINT16_MAX : pretoc);
+    }
+#endif
+    if (dw1000_set_pretoc((uint16_t)pretoc))
+        goto err;
+
+    union DW1000_REG_ACK_RESP_T *ack_resp_t = &m_dw1000_ctx.ack_resp_t;
+    if (ack_resp_t->w4r_tim != (uint32_t)w4r) {
+        ack_resp_t->w4r_tim = (uint32_t)w4r;
+        if (dw1000_non_indexed_write(spi_cfg, DW1000_ACK_RESP_T, ack_resp_t, sizeof(*ack_resp_t), NULL))
+            goto err;
+    }
+
+    union DW1000_REG_RX_FWTO *rx_fwto = &m_dw1000_ctx.rx_fwto;
+    if (rx_fwto->rxfwto != (uint16_t)fwto) {
+        rx_fwto->rxfwto = (uint16_t)fwto;
+        if (dw1000_non_indexed_write(spi_cfg, DW1000_RX_FWTO, rx_fwto, sizeof(*rx_fwto), NULL))
+            goto err;
+    }
+
+    struct dw1000_rx_window *win = &m_dw1000_ctx.rx_window;
+    win->reply_us   = (uint32_t)(on_ns / 1000);
+    win->timeout_us = (uint32_t)(fwto * DW1000_RX_FWTO_UNIT_PS / 1000000);
+    win->pretoc_us  = (uint32_t)((pretoc + 1) * m_dw1000_ctx.pac_size * DW1000_PREAMBLE_SYMBOL_PS(DW1000_PRF) / 1000000);
+    win->delay_us   = (uint32_t)(w4r * DW1000_RX_FWTO_UNIT_PS / 1000000);
+    win->open       = true;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
 /**
  * @brief Perform a hardware reset on the DW1000 transceiver.
  *
@@ -900,6 +1100,157 @@ err:
     return -1;
 }
 
+/**
+ * @brief Configure how the DW1000 uses its SYNC input.
+ *
+ * - @ref DW1000_EXT_SYNC_OSTR resets the system time @p wait 38.4 MHz cycles
+ *   after the SYNC rising edge, on every edge.
+ * - @ref DW1000_EXT_SYNC_OSRS counts an external clock and captures the count
+ *   on the RMARKER of each received frame, see @ref dw1000_ext_sync_read_rx().
+ *
+ * GPIO7 is switched to its SYNC function. The PLL lock detect tune bit set by
+ * @ref dw1000_hard_reset() is kept.
+ *
+ * @retval 0  Configured.
+ * @retval -1 SPI access failed.
+ */
+int dw1000_ext_sync_config(enum dw1000_ext_sync_mode mode, uint8_t wait)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+
+    union DW1000_SUB_REG_GPIO_MODE *gpio_mode = &m_dw1000_ctx.gpio_mode;
+    gpio_mode->msgp7 = 0;
+    if (dw1000_short_indexed_write(spi_cfg, DW1000_GPIO_CTRL, DW1000_GPIO_MODE, gpio_mode, sizeof(*gpio_mode), NULL))
+        goto err;
+
+    union DW1000_SUB_REG_EC_CTRL *ec_ctrl = &m_dw1000_ctx.ec_ctrl;
+    ec_ctrl->ostsm = 0;
+    ec_ctrl->osrsm = (mode == DW1000_EXT_SYNC_OSRS);
+    ec_ctrl->ostrm = (mode == DW1000_EXT_SYNC_OSTR);
+    ec_ctrl->wait  = wait;
+    if (dw1000_short_indexed_write(spi_cfg, DW1000_EXT_SYNC, DW1000_EC_CTRL, ec_ctrl, sizeof(*ec_ctrl), NULL))
+        goto err;
+
+#if (CONFIG_DW1000_EXT_SYNC) && (CONFIG_DW1000_EXT_SYNC_MASTER)
+    gpio_init(SYNC_PIN);
+    gpio_set_dir(SYNC_PIN, GPIO_OUT);
+    gpio_put(SYNC_PIN, 0);
+#endif
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Accept only frames for this node in hardware.
+ *
+ * With FFEN set, the DW1000 checks the frame type against @p allow and,
+ * for frames with a destination address, the destination PAN ID and short
+ * address against PANADR. Broadcast PAN ID and address are accepted as
+ * well. Rejected frames raise AFFREJ, which is masked, and the receiver
+ * turns itself back on without waking the host. The event counters are
+ * enabled so that the accepted and rejected frames can be counted.
+ *
+ * @param[in] pan_id      PAN ID of the node.
+ * @param[in] short_addr  Short address of the node.
+ * @param[in] allow       Accepted frame types, DW1000_FF_*, 0 turns frame filtering off.
+ *
+ * @retval 0  Configured.
+ * @retval -1 SPI access failed.
+ */
+int dw1000_frame_filter_config(uint16_t pan_id, uint16_t short_addr, uint32_t allow)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+
+    union DW1000_REG_PANADR panadr = {.short_addr = short_addr, .pan_id = pan_id};
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_PANADR, &panadr, sizeof(panadr), NULL))
+        goto err;
+
+    union DW1000_REG_SYS_CFG *sys_cfg = &m_dw1000_ctx.sys_cfg;
+    sys_cfg->value &= ~DW1000_FF_MASK;
+    if (allow)
+        sys_cfg->value |= (allow & DW1000_FF_MASK) | 1;
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CFG, sys_cfg, sizeof(*sys_cfg), NULL))
+        goto err;
+
+    union DW1000_SUB_REG_EVC_CTRL evc_ctrl = {.evc_clr = 1};
+    if (dw1000_short_indexed_write(spi_cfg, DW1000_DIG_DIAG, DW1000_EVC_CTRL, &evc_ctrl, sizeof(evc_ctrl), NULL))
+        goto err;
+    evc_ctrl.value  = 0;
+    evc_ctrl.evc_en = 1;
+    if (dw1000_short_indexed_write(spi_cfg, DW1000_DIG_DIAG, DW1000_EVC_CTRL, &evc_ctrl, sizeof(evc_ctrl), NULL))
+        goto err;
+
+    struct dw1000_ff_stats *ff = &m_dw1000_ctx.ff;
+    ff->enabled = sys_cfg->ffen;
+    ff->evc_fcg = ff->evc_ffr = 0;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+#if (CONFIG_DW1000_FRAME_FILTER)
+/**
+ * @brief Add the frames accepted and rejected since the last poll.
+ *
+ * The event counters are 12 bits wide and are cleared by a reset, poll them
+ * at least every 4095 frames and before @ref dw1000_init().
+ */
+static int dw1000_frame_filter_poll(void)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    struct dw1000_ff_stats *ff = &m_dw1000_ctx.ff;
+    if (!ff->enabled)
+        return 0;
+
+    union DW1000_SUB_REG_EVC_FCG evc_fcg;
+    union DW1000_SUB_REG_EVC_FFR evc_ffr;
+    if (dw1000_short_indexed_read(spi_cfg, DW1000_DIG_DIAG, DW1000_EVC_FCG, &evc_fcg, sizeof(evc_fcg), NULL))
+        goto err;
+    if (dw1000_short_indexed_read(spi_cfg, DW1000_DIG_DIAG, DW1000_EVC_FFR, &evc_ffr, sizeof(evc_ffr), NULL))
+        goto err;
+
+    ff->accepted += (evc_fcg.evc_fcg - ff->evc_fcg) & 0xFFF;
+    ff->rejected += (evc_ffr.evc_ffr - ff->evc_ffr) & 0xFFF;
+    ff->evc_fcg = evc_fcg.evc_fcg;
+    ff->evc_ffr = evc_ffr.evc_ffr;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+#endif
+
+/**
+ * @brief Read the external clock counter captured on the RMARKER of the last
+ * received frame (EC_RXTC) and the 1 GHz count from the RMARKER to the next
+ * external clock edge (EC_GOLP). Only valid in @ref DW1000_EXT_SYNC_OSRS mode.
+ *
+ * @retval 0  Read.
+ * @retval -1 SPI access failed.
+ */
+int dw1000_ext_sync_read_rx(uint32_t *rx_ts_est, uint8_t *offset_ext)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    union DW1000_REG_EXT_SYNC ext_sync;
+    if (dw1000_short_indexed_read(spi_cfg, DW1000_EXT_SYNC, DW1000_EC_RXTC, &ext_sync.ec_rxtc,
+            sizeof(ext_sync.ec_rxtc) + sizeof(ext_sync.ec_golp), NULL))
+        goto err;
+
+    *rx_ts_est  = ext_sync.ec_rxtc.rx_ts_est;
+    *offset_ext = ext_sync.ec_golp.offset_ext;
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
 int dw1000_soft_reset(bool verbose)
 {
     if (verbose)
@@ -1121,15 +1472,43 @@ err:
     return -1;
 }
 
+/**
+ * @brief Whether the preamble code is one of the codes the user manual lists
+ * for the channel and PRF. The DPS codes 13 to 16 and 21 to 24 are not used.
+ */
+static bool dw1000_pcode_valid(uint8_t chan, uint8_t prf, uint8_t pcode)
+{
+    // First of the two 16 MHz PRF codes of each channel
+    static const uint8_t pcode_16mhz[] = {
+        [DW1000_CHAN_1] = 1, [DW1000_CHAN_2] = 3, [DW1000_CHAN_3] = 5,
+        [DW1000_CHAN_4] = 7, [DW1000_CHAN_5] = 3, [DW1000_CHAN_7] = 7,
+    };
+    if ((chan >= sizeof(pcode_16mhz)) || !pcode_16mhz[chan])
+        return false;
+
+    if (prf == DW1000_PRF_16MHZ)
+        return (pcode == pcode_16mhz[chan]) || (pcode == pcode_16mhz[chan] + 1);
+    if (prf == DW1000_PRF_64MHZ) {
+        uint8_t first = ((chan == DW1000_CHAN_4) || (chan == DW1000_CHAN_7)) ? DW1000_PCODE_17 : DW1000_PCODE_9;
+        return (pcode >= first) && (pcode < first + 4);
+    }
+    return false;
+}
+
 /**
  * TODO: LDOTUNE
- * TODO: External Synchronisation
  * TODO: IC Calibration – Crystal Oscillator Trim
  */
 int dw1000_init(bool verbose)
 {
     dw1000_trace(INIT, "%s\n", __func__);
 
+#if (CONFIG_DW1000_FRAME_FILTER)
+    // The reset clears the event counters
+    if (dw1000_frame_filter_poll())
+        goto err;
+#endif
+
     // Perform initial hardware reset before checking PLL status
     if (dw1000_hard_reset(verbose))
         goto err;
@@ -1158,6 +1537,7 @@ int dw1000_init(bool verbose)
     union DW1000_REG_SYS_CFG *sys_cfg = &m_dw1000_ctx.sys_cfg;
     sys_cfg->hirq_pol = DW1000_HIRQ_POL_ACTIVE_HIGH;
     sys_cfg->dis_drxb = true;
+    sys_cfg->phr_mode = CONFIG_DW1000_LONG_FRAME ? DW1000_SYS_CFG_PHR_LONG_FRAME : DW1000_SYS_CFG_PHR_STD_FRAME;
     // sys_cfg->rxm110k  = true;
     sys_cfg->rxm110k  = false;
 #if (CONFIG_DW1000_TAG || CONFIG_DW1000_ANCHOR_LISTEN_TO)
@@ -1191,6 +1571,12 @@ int dw1000_init(bool verbose)
             goto err;
     // }
 
+    // The receiver turns on right after a WAIT4RESP frame until a reply window sets W4R_TIM
+    union DW1000_REG_ACK_RESP_T *ack_resp_t = &m_dw1000_ctx.ack_resp_t;
+    ack_resp_t->value = 0;
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_ACK_RESP_T, ack_resp_t, sizeof(*ack_resp_t), !verbose ? NULL : "ack_resp_t: "))
+        goto err;
+
     union DW1000_SUB_REG_GPIO_MODE *gpio_mode = &m_dw1000_ctx.gpio_mode;
     gpio_mode->value = 0;
     if (dw1000_short_indexed_write(spi_cfg, DW1000_GPIO_CTRL, DW1000_GPIO_MODE, gpio_mode, sizeof(*gpio_mode), !verbose ? NULL : "gpio_mode: "))
@@ -1245,18 +1631,32 @@ int dw1000_init(bool verbose)
         goto err;
 
     // TODO: LDOTUNE
-    // TODO: External Synchronisation
+
+#if (CONFIG_DW1000_EXT_SYNC)
+    if (dw1000_ext_sync_config(DW1000_EXT_SYNC_OSTR, EXT_SYNC_WAIT))
+        goto err;
+#endif
+
+#if (CONFIG_DW1000_FRAME_FILTER)
+    if (dw1000_frame_filter_config(DW1000_PAN_ID, m_dw1000_ctx.my_addr, FRAME_FILTER_ALLOW))
+        goto err;
+#endif
 
     /* *************************************************************************
      *                          Channel Configuration
      * ************************************************************************/
 
+    const struct cell_radio *cell = &m_dw1000_ctx.cell;
+    if (!dw1000_pcode_valid(cell->chan, DW1000_PRF, cell->pcode)) {
+        dw1000_trace(ERROR, "preamble code %d is not valid on channel %d at PRF %d\n", cell->pcode, cell->chan, DW1000_PRF);
+        goto err;
+    }
     union DW1000_REG_CHAN_CTRL *chan_ctrl = &m_dw1000_ctx.chan_ctrl;
-    chan_ctrl->tx_chan  = DW1000_CHAN;
-    chan_ctrl->rx_chan  = DW1000_CHAN;
+    chan_ctrl->tx_chan  = cell->chan;
+    chan_ctrl->rx_chan  = cell->chan;
     chan_ctrl->rxprf    = DW1000_PRF;
-    chan_ctrl->tx_pcode = DW1000_PCODE;
-    chan_ctrl->rx_pcode = DW1000_PCODE;
+    chan_ctrl->tx_pcode = cell->pcode;
+    chan_ctrl->rx_pcode = cell->pcode;
     hard_assert(chan_ctrl->tx_chan == chan_ctrl->rx_chan);
     hard_assert((chan_ctrl->rxprf == DW1000_PRF_16MHZ) || (chan_ctrl->rxprf == DW1000_PRF_64MHZ));
     hard_assert(chan_ctrl->tx_pcode == chan_ctrl->rx_pcode);
@@ -1547,16 +1947,29 @@ int dw1000_init(bool verbose)
     /**
      * whilst SFD detection timeout (see Sub-Register 0x27:20 – DRX_SFDTOC) is on.
      */
+    m_dw1000_ctx.pac_size = pac_size;
     drx_conf->drx_sfdtoc.value = preamble_length + sfd_length + 1 - pac_size;
     if (dw1000_short_indexed_write(spi_cfg, DW1000_DRX_CONF, DW1000_DRX_SFDTOC, &drx_conf->drx_sfdtoc, sizeof(drx_conf->drx_sfdtoc), !verbose ? NULL : "drx_sfdtoc: "))
         goto err;
-    if (verbose)
+    if (verbose) {
         dw1000_trace(INFO, "SFD Detection Timeout            : %d\n", drx_conf->drx_sfdtoc.value);
+        dw1000_trace(INFO, "Airtime (poll, resp, final)      : %lu, %lu, %lu us\n",
+            dw1000_frame_airtime_ns(sizeof(union dw1000_poll_msg) + 2, true) / 1000,
+            dw1000_frame_airtime_ns(sizeof(union dw1000_resp_msg) + 2, true) / 1000,
+            dw1000_frame_airtime_ns(sizeof(union dw1000_final_msg) + 2, true) / 1000);
+        dw1000_trace(INFO, "Airtime per exchange             : %lu us (%lu us with the standard header)\n",
+            dw1000_twr_exchange_airtime_ns(0) / 1000,
+            dw1000_twr_exchange_airtime_ns(DW1000_TWR_HDR_STD_LEN - DW1000_TWR_HDR_LEN) / 1000);
+        dw1000_trace(INFO, "Airtime of the ranging init      : %lu us (%lu us with the standard header and tag_addr)\n",
+            dw1000_frame_airtime_ns(sizeof(union dw1000_rng_init_msg) + 2, true) / 1000,
+            dw1000_frame_airtime_ns(DW1000_RNG_INIT_STD_LEN + 2, true) / 1000);
+    }
 
     // TBD: Register file: 0x21 – User defined SFD sequence
 
     /**
      * preamble detection timeout (see Sub-Register 0x27:24 – DRX_PRETOC) are off,
+     * until a scheduled reply window sets the preamble detection timeout.
      */
     drx_conf->drx_pretoc.value = 0;
     if (dw1000_short_indexed_write(spi_cfg, DW1000_DRX_CONF, DW1000_DRX_PRETOC, &drx_conf->drx_pretoc, sizeof(drx_conf->drx_pretoc), !verbose ? NULL : "drx_pretoc: "))
@@ -1692,6 +2105,11 @@ int dw1000_init(bool verbose)
     if (dw1000_long_indexed_write(spi_cfg, DW1000_LDE_CTRL, DW1000_LDE_RXANTD, lde_rxantd, sizeof(*lde_rxantd), !verbose ? NULL : "lde_rxantd: "))
         goto err;
 
+    // The transmit antenna delay is needed to predict the TX timestamps
+    union DW1000_REG_TX_ANTD *tx_antd = &m_dw1000_ctx.tx_antd;
+    if (dw1000_non_indexed_read(spi_cfg, DW1000_TX_ANTD, tx_antd, sizeof(*tx_antd), !verbose ? NULL : "tx_antd: "))
+        goto err;
+
     union DW1000_SUB_REG_LDE_REPC *lde_repc = &m_dw1000_ctx.lde_repc;
     uint16_t _lde_repc[24] = {
         [0]  = 0x5998,
@@ -1876,6 +2294,36 @@ int dw1000_rx_start(const struct spi_config *spi_cfg)
     return 0;
 }
 
+/**
+ * @brief Turn the receiver on at dx_time.
+ *
+ * The low-order 9 bits of DX_TIME are ignored, the receiver turns on up to
+ * 8 ns early. RX_FWTO and DRX_PRETOC, when enabled, run from the moment the
+ * receiver is on. When dx_time has already passed the DW1000 raises HPDWARN
+ * and would only turn the receiver on after the system time wraps around,
+ * about 17 s later; the ISR then turns it on right away and counts the late
+ * start.
+ *
+ * @param[in] dx_time    Receiver on time, in units of the 63.8976 GHz sampling clock.
+ */
+int dw1000_delayed_rx_start(uint64_t dx_time)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_DX_TIME, &dx_time, sizeof(union DW1000_REG_DX_TIME), NULL))
+        goto err;
+
+    m_dw1000_ctx.dx.pending = DW1000_DX_RX;
+    m_dw1000_ctx.dx.rx++;
+    union DW1000_REG_SYS_CTRL sys_ctrl = {.rxenab = 1, .rxdlye = 1};
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+        goto err;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
 /**
  * @brief In order to transmit, the host controller must write data for transmission
  * to Register file: 0x09 – Transmit Data Buffer.
@@ -1885,10 +2333,113 @@ int dw1000_prepare_tx_buffer(const struct spi_config *spi_cfg, void *buf, size_t
     if (len > DW1000_TX_BUFFER_SIZE)
         goto err;
 
-    if (dw1000_non_indexed_write(spi_cfg, DW1000_TX_BUFFER, buf, len, NULL))
+    if (dw1000_stream(spi_cfg, DW1000_TX_BUFFER, 0, buf, len, true))
+        goto err;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Write the length and TX buffer offset of the next frame to TX_FCTRL.
+ * Frames longer than 127 bytes carry the upper bits in TFLE and need the long
+ * frame PHR mode.
+ *
+ * @param[in] flen       Frame length including the 2 byte FCS.
+ * @param[in] txboffs    Offset of the frame in the TX buffer.
+ */
+static int dw1000_set_tx_frame_len(size_t flen, uint16_t txboffs)
+{
+    bool long_frame = (m_dw1000_ctx.sys_cfg.phr_mode == DW1000_SYS_CFG_PHR_LONG_FRAME);
+    if ((flen > (long_frame ? DW1000_LONG_FRAME_MAX : DW1000_STD_FRAME_MAX)) || (txboffs + flen > DW1000_TX_BUFFER_SIZE))
+        goto err;
+
+    union DW1000_REG_TX_FCTRL *tx_fctrl = &m_dw1000_ctx.tx_fctrl;
+    tx_fctrl->ofs_00.tflen   = (flen & 0x7F);
+    tx_fctrl->ofs_00.tfle    = (flen >> 7) & 0x7;
+    tx_fctrl->ofs_00.txboffs = txboffs;
+    if (dw1000_non_indexed_write(&m_dw1000_ctx.spi_cfg, DW1000_TX_FCTRL, tx_fctrl, sizeof(*tx_fctrl), NULL))
         goto err;
 
     return 0;
+err:
+    dw1000_trace(ERROR, "%s failed, flen %u\n", __func__, (unsigned)flen);
+    return -1;
+}
+
+/**
+ * @brief Length of the received frame including the FCS, RXFLEN extended by
+ * RXFLE in the long frame PHR mode.
+ */
+static inline uint16_t dw1000_rx_frame_len(const union DW1000_REG_RX_FINFO *rx_finfo)
+{
+    if (m_dw1000_ctx.sys_cfg.phr_mode == DW1000_SYS_CFG_PHR_LONG_FRAME)
+        return ((uint16_t)rx_finfo->rxfle << 7) | rx_finfo->rxflen;
+    return rx_finfo->rxflen;
+}
+
+/**
+ * @brief Read the received frame, FCS included, from RX_BUFFER into buf.
+ * A frame longer than size is cut to size.
+ *
+ * @return Bytes read, or -1 on error.
+ */
+static int dw1000_read_rx_frame(const union DW1000_REG_RX_FINFO *rx_finfo, void *buf, size_t size)
+{
+    size_t len = dw1000_rx_frame_len(rx_finfo);
+    if (len > size)
+        len = size;
+    if ((len == 0) || dw1000_stream(&m_dw1000_ctx.spi_cfg, DW1000_RX_BUFFER, 0, buf, len, false))
+        goto err;
+
+    return (int)len;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Read the first len bytes of the received frame into buf, but only the
+ * MAC header and function code unless they match @p m.
+ *
+ * Without hardware frame filtering, a frame for another peer or out of
+ * sequence is dropped after a few bytes of SPI traffic, and the rest of a
+ * matching frame is read with an offset read when it is long enough to be
+ * worth a second transaction. With FFEN on, the DW1000 has already rejected
+ * frames for other PANs and addresses, so nearly every frame matches and the
+ * split would only add a transaction; the frame is then read in one go and
+ * matched afterwards.
+ *
+ * @param[in]  m         Expected header, up to and including the octet at payload_ofs.
+ * @param[out] buf       At least MAC_FRAME_MATCH_BYTES.
+ * @param[in]  len       Bytes of the frame to read.
+ *
+ * @return len if the frame matches and has been read, 0 if it is dropped
+ *         (buf then holds its header at most), -1 on error.
+ */
+static int dw1000_read_rx_frame_match(const struct mac_frame_match *m, void *buf, size_t len)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    size_t hdr_len = m->payload_ofs + 1;
+    if (len < hdr_len)
+        return 0;
+
+    if (!CONFIG_DW1000_RX_HEADER_FIRST || m_dw1000_ctx.sys_cfg.ffen || (len < hdr_len + DW1000_RX_SPLIT_MIN)) {
+        if (dw1000_stream(spi_cfg, DW1000_RX_BUFFER, 0, buf, len, false))
+            goto err;
+        return mac_frame_match(m, buf) ? (int)len : 0;
+    }
+
+    if (dw1000_stream(spi_cfg, DW1000_RX_BUFFER, 0, buf, hdr_len, false))
+        goto err;
+    if (!mac_frame_match(m, buf))
+        return 0;
+    if (dw1000_stream(spi_cfg, DW1000_RX_BUFFER, hdr_len, (uint8_t *)buf + hdr_len, len - hdr_len, false))
+        goto err;
+
+    return (int)len;
 err:
     dw1000_trace(ERROR, "%s failed\n", __func__);
     return -1;
@@ -1923,13 +2474,12 @@ int dw1000_transmit_message(void *buf, size_t len, bool wait4resp)
         goto err;
 
     const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
-    union DW1000_REG_TX_FCTRL *tx_fctrl = &m_dw1000_ctx.tx_fctrl;
-    len = len + 2;
-    m_dw1000_ctx.tx_fctrl.ofs_00.tflen = (len & 0x7F);
-    if (m_dw1000_ctx.sys_cfg.phr_mode == DW1000_SYS_CFG_PHR_LONG_FRAME)
-        m_dw1000_ctx.tx_fctrl.ofs_00.tfle = (len >> 7) & 0x3;
-
-    if (dw1000_non_indexed_write(spi_cfg, DW1000_TX_FCTRL, &m_dw1000_ctx.tx_fctrl, sizeof(m_dw1000_ctx.tx_fctrl), NULL))
+#if (CONFIG_DW1000_PRESTAGE_TX)
+    m_dw1000_ctx.tx_staged = false;
+    m_dw1000_ctx.tx_done   = false;
+#endif
+    // The FCS is appended by the DW1000, only the frame body is written
+    if (dw1000_set_tx_frame_len(len + 2, 0))
         goto err;
 
     if (dw1000_prepare_tx_buffer(spi_cfg, buf, len))
@@ -1939,6 +2489,10 @@ int dw1000_transmit_message(void *buf, size_t len, bool wait4resp)
     if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
         goto err;
 
+#if (CONFIG_DW1000_SESSION)
+    m_dw1000_ctx.stats.tx_frames++;
+#endif
+
     // pico_set_led(led_out);
     // led_out = !led_out;
 
@@ -1958,23 +2512,26 @@ int dw1000_delayed_transmit_message(void *buf, size_t len, uint64_t dx_time, boo
     if (dw1000_non_indexed_write(spi_cfg, DW1000_DX_TIME, &dx_time, sizeof(union DW1000_REG_DX_TIME), NULL))
         goto err;
 
-    union DW1000_REG_TX_FCTRL *tx_fctrl = &m_dw1000_ctx.tx_fctrl;
-    len = len + 2;
-    m_dw1000_ctx.tx_fctrl.ofs_00.tflen = (len & 0x7F);
-    if (m_dw1000_ctx.sys_cfg.phr_mode == DW1000_SYS_CFG_PHR_LONG_FRAME) {
-        m_dw1000_ctx.tx_fctrl.ofs_00.tfle = (len >> 7) & 0x3;
-        hard_assert(0);
-    }
-    if (dw1000_non_indexed_write(spi_cfg, DW1000_TX_FCTRL, &m_dw1000_ctx.tx_fctrl, sizeof(m_dw1000_ctx.tx_fctrl), NULL))
+#if (CONFIG_DW1000_PRESTAGE_TX)
+    m_dw1000_ctx.tx_staged = false;
+    m_dw1000_ctx.tx_done   = false;
+#endif
+    if (dw1000_set_tx_frame_len(len + 2, 0))
         goto err;
 
     if (dw1000_prepare_tx_buffer(spi_cfg, buf, len))
         goto err;
 
+    m_dw1000_ctx.dx.pending = DW1000_DX_TX;
+    m_dw1000_ctx.dx.tx++;
     union DW1000_REG_SYS_CTRL sys_ctrl = {.txstrt = 1, .txdlys = 1, .wait4resp = !!wait4resp};
     if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
         goto err;
 
+#if (CONFIG_DW1000_SESSION)
+    m_dw1000_ctx.stats.tx_frames++;
+#endif
+
     // pico_set_led(led_out);
     // led_out = !led_out;
 
@@ -1984,6 +2541,341 @@ err:
     return -1;
 }
 
+#if (CONFIG_DW1000_TX_QUEUE)
+/**
+ * @brief Number of free slots in the TX queue.
+ */
+static inline uint8_t dw1000_txq_space(void)
+{
+    const struct dw1000_tx_queue *txq = &m_dw1000_ctx.txq;
+    return TXQ_SLOTS - (uint8_t)(txq->loaded - txq->sent);
+}
+
+/**
+ * @brief Write a frame into the next free slot of the TX queue.
+ *
+ * Each slot is its own region of the TX buffer, so a frame can be loaded
+ * while the frame before it is still being sent from another slot.
+ *
+ * @note dw1000_transmit_message() and dw1000_stage_tx_frame() write their
+ *       frame at the start of the TX buffer, over the first slot.
+ *
+ * @param[in] buf        Frame without the FCS.
+ * @param[in] len        Length of the frame in bytes.
+ */
+int dw1000_txq_load(void *buf, size_t len)
+{
+    struct dw1000_tx_queue *txq = &m_dw1000_ctx.txq;
+    if ((buf == NULL) || (len == 0) || (len + 2 > DW1000_TXQ_SLOT_SIZE) || !dw1000_txq_space())
+        goto err;
+
+    uint8_t slot = txq->loaded % TXQ_SLOTS;
+    if (dw1000_stream(&m_dw1000_ctx.spi_cfg, DW1000_TX_BUFFER, slot * DW1000_TXQ_SLOT_SIZE, buf, len, true))
+        goto err;
+
+    if (txq->on_air)
+        txq->overlapped++;
+    txq->flen[slot] = (uint16_t)(len + 2);
+    txq->loaded++;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Point TX_FCTRL at the oldest frame in the TX queue and start it,
+ * nothing is written to the TX buffer.
+ */
+static int dw1000_txq_kick(const union DW1000_REG_SYS_CTRL *sys_ctrl)
+{
+    struct dw1000_tx_queue *txq = &m_dw1000_ctx.txq;
+    if ((txq->loaded == txq->sent) || txq->on_air)
+        goto err;
+
+    uint8_t slot = txq->sent % TXQ_SLOTS;
+    if (dw1000_set_tx_frame_len(txq->flen[slot], slot * DW1000_TXQ_SLOT_SIZE))
+        goto err;
+
+    txq->on_air = true;
+    if (dw1000_non_indexed_write(&m_dw1000_ctx.spi_cfg, DW1000_SYS_CTRL, (void *)sys_ctrl, sizeof(*sys_ctrl), NULL)) {
+        txq->on_air = false;
+        goto err;
+    }
+
+#if (CONFIG_DW1000_SESSION)
+    m_dw1000_ctx.stats.tx_frames++;
+#endif
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Send the oldest frame in the TX queue now.
+ */
+int dw1000_txq_start(bool wait4resp)
+{
+    union DW1000_REG_SYS_CTRL sys_ctrl = {.txstrt = 1, .wait4resp = !!wait4resp};
+    return dw1000_txq_kick(&sys_ctrl);
+}
+
+/**
+ * @brief Retire the frame on air if its TXFRS interrupt went missing.
+ *
+ * Call once the frame must have left, e.g. after the acknowledgement wait.
+ * SYS_STATUS.TXFRS is polled in case only the interrupt was lost; if the
+ * frame never completed, the transceiver is turned off. The slot is freed
+ * either way, so a lost interrupt costs one frame instead of failing every
+ * dw1000_txq_start() after it.
+ */
+static int dw1000_txq_recover(void)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    struct dw1000_tx_queue *txq = &m_dw1000_ctx.txq;
+    if (!txq->on_air)
+        return 0;
+
+    union DW1000_REG_SYS_STATUS sys_status;
+    if (dw1000_short_indexed_read(spi_cfg, DW1000_SYS_STATUS, offsetof(union DW1000_REG_SYS_STATUS, ofs_00), &sys_status.ofs_00, sizeof(sys_status.ofs_00), NULL))
+        goto err;
+    if (sys_status.ofs_00.txfrs) {
+        if (dw1000_clear_sys_status_ofs_00_by_mask(spi_cfg, DW1000_SYS_STS_TXFRS))
+            goto err;
+    } else {
+        union DW1000_REG_SYS_CTRL sys_ctrl = {.trxoff = 1};
+        if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+            goto err;
+    }
+
+    // The interrupt may still have come in meanwhile
+    uint32_t irq = save_and_disable_interrupts();
+    if (txq->on_air) {
+        txq->on_air = false;
+        txq->sent++;
+        txq->recovered++;
+    }
+    restore_interrupts(irq);
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+#endif
+
+#if (CONFIG_DW1000_PREDICT_TX_TS)
+/**
+ * @brief Predict the TX timestamp of a delayed transmission.
+ *
+ * The low-order 9 bits of DX_TIME are ignored and the transmit antenna delay
+ * is added to the time the frame leaves, so the value that TX_TIME reports
+ * after TXFRS is known before the frame is sent and can be carried in the
+ * frame itself. Like TX_TIME it wraps at 40 bits.
+ *
+ * @param[in] dx_time    Value programmed into DX_TIME.
+ *
+ * @return The TX timestamp, in units of the 63.8976 GHz sampling clock.
+ */
+uint64_t dw1000_predict_tx_stamp(uint64_t dx_time)
+{
+    return ((dx_time & DX_TIME_MASK) + m_dw1000_ctx.tx_antd.value) & DW1000_TIMESTAMP_MASK;
+}
+#endif
+
+#if (CONFIG_DW1000_FIXED_POINT_TWR)
+/**
+ * @brief Convert a Q8 time of flight into millimetres.
+ */
+uint32_t dw1000_tof_q8_to_mm(uint32_t tof_q8)
+{
+    return (uint32_t)(((uint64_t)tof_q8 * DW1000_MM_PER_TICK_Q16 + (1ULL << 23)) >> 24);
+}
+#endif
+
+#if (CONFIG_DW1000_TWR_BENCH)
+/**
+ * @brief Compare the integer DS-TWR computation with the double reference on
+ * synthetic exchanges, and time both.
+ *
+ * Reply times go from 1 ms to 200 ms, distances from 0 to 100 m and the
+ * crystals of either side are off by up to +-20 ppm. Each side counts its
+ * round and reply in its own clock.
+ */
+static void dw1000_ds_twr_bench(void)
+{
+    #define TWR_BENCH_N (64)
+    static uint64_t ra[TWR_BENCH_N], da[TWR_BENCH_N], rb[TWR_BENCH_N], db[TWR_BENCH_N];
+    static uint32_t tof_q8[TWR_BENCH_N];
+    static double tof_ref[TWR_BENCH_N], tof_true[TWR_BENCH_N];
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+
+    for (int i = 0; i < TWR_BENCH_N; i++) {
+        double tof     = sim_rand_range(&rnd, 0, 100.0 / SPEED_OF_LIGHT * (double)DW1000_SAMPLING_CLOCK);
+        double reply_a = (double)DX_TIME_US(sim_rand_range(&rnd, 1000, 200000));
+        double reply_b = (double)DX_TIME_US(sim_rand_range(&rnd, 1000, 200000));
+        double e_a     = sim_rand_range(&rnd, -20e-6, 20e-6);
+        double e_b     = sim_rand_range(&rnd, -20e-6, 20e-6);
+        ra[i] = (uint64_t)llround((2 * tof + reply_b) * (1.0 + e_a));
+        da[i] = (uint64_t)llround(reply_a * (1.0 + e_a));
+        rb[i] = (uint64_t)llround((2 * tof + reply_a) * (1.0 + e_b));
+        db[i] = (uint64_t)llround(reply_b * (1.0 + e_b));
+        tof_true[i] = tof;
+    }
+
+    uint64_t t0 = time_us_64();
+    for (int i = 0; i < TWR_BENCH_N; i++)
+        tof_q8[i] = twr_ds_tof_q8(ra[i], da[i], rb[i], db[i]);
+    uint64_t t1 = time_us_64();
+    for (int i = 0; i < TWR_BENCH_N; i++)
+        tof_ref[i] = ((double)ra[i] * (double)rb[i] - (double)da[i] * (double)db[i]) / (double)(ra[i] + rb[i] + da[i] + db[i]);
+    uint64_t t2 = time_us_64();
+
+    double max_err = 0, max_drift = 0;
+    for (int i = 0; i < TWR_BENCH_N; i++) {
+        max_err   = fmax(max_err, fabs((double)tof_q8[i] / 256.0 - tof_ref[i]));
+        max_drift = fmax(max_drift, fabs((double)tof_q8[i] / 256.0 - tof_true[i]));
+    }
+
+    dw1000_trace(INFO, "ds-twr bench: %d exchanges, +-20 ppm\n", TWR_BENCH_N);
+    dw1000_trace(INFO, " int   : %llu us\n", t1 - t0);
+    dw1000_trace(INFO, " double: %llu us\n", t2 - t1);
+    dw1000_trace(INFO, " max err: %lf mm to double, %lf mm to true\n",
+        max_err * SPEED_OF_LIGHT * 1000.0 / (double)DW1000_SAMPLING_CLOCK,
+        max_drift * SPEED_OF_LIGHT * 1000.0 / (double)DW1000_SAMPLING_CLOCK);
+    #undef TWR_BENCH_N
+}
+#endif
+
+#if (CONFIG_DW1000_MULTILAT)
+static const struct dw1000_anchor_pos m_anchor_map[] = {
+    MULTILAT_ANCHOR_MAP
+};
+#define MULTILAT_ANCHORS ((int)(sizeof(m_anchor_map) / sizeof(m_anchor_map[0])))
+_Static_assert(sizeof(m_anchor_map) / sizeof(m_anchor_map[0]) >= 3, "the anchor map needs at least three anchors");
+_Static_assert(sizeof(m_anchor_map) / sizeof(m_anchor_map[0]) <= MULTILAT_MAX_ANCHORS, "too many anchors in the anchor map");
+#endif
+
+/**
+ * @brief Read the carrier recovery integrator of the last received frame.
+ *
+ * @param[out] car_int   Signed 21-bit content of DRX_CAR_INT.
+ */
+int dw1000_read_car_int(int32_t *car_int)
+{
+    if (car_int == NULL)
+        goto err;
+
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    union DW1000_SUB_REG_DRX_CAR_INT drx_car_int;
+    if (dw1000_short_indexed_read(spi_cfg, DW1000_DRX_CONF, DW1000_DRX_CAR_INT, &drx_car_int, sizeof(drx_car_int), NULL))
+        goto err;
+
+    *car_int = twr_car_int(drx_car_int.value);
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Clock offset of the last received frame's transmitter relative to
+ * the local clock, positive when the remote clock runs faster.
+ */
+float dw1000_clock_offset_ratio(int32_t car_int)
+{
+    return twr_clock_offset_ratio(car_int, DW1000_BR == DW1000_BR_110KBPS, m_dw1000_ctx.cell.chan);
+}
+
+#if (CONFIG_DW1000_PRESTAGE_TX)
+/**
+ * @brief Load a complete frame into the DW1000 ahead of its transmission.
+ *
+ * TX_FCTRL and TX_BUFFER are written while the receiver is still waiting for
+ * the frame that triggers the transmission. Once it arrives, only the fields
+ * that changed are patched with dw1000_patch_tx_frame() before the delayed
+ * transmission is started with dw1000_start_staged_tx().
+ *
+ * @note The TX buffer must not be written while a frame is sent from it,
+ *       wait for m_dw1000_ctx.tx_done after the previous transmission.
+ */
+int dw1000_stage_tx_frame(void *buf, size_t len)
+{
+    if (buf == NULL || len == 0)
+        goto err;
+
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    if (dw1000_set_tx_frame_len(len + 2, 0))
+        goto err;
+
+    if (dw1000_prepare_tx_buffer(spi_cfg, buf, len))
+        goto err;
+
+    m_dw1000_ctx.tx_staged = true;
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Overwrite part of the staged frame at an offset of the TX buffer.
+ *
+ * @param[in] ofs        Byte offset of the field within the frame.
+ * @param[in] buf        New content of the field.
+ * @param[in] len        Length of the field in bytes.
+ */
+int dw1000_patch_tx_frame(uint16_t ofs, void *buf, size_t len)
+{
+    if (!m_dw1000_ctx.tx_staged || (ofs + len > DW1000_TX_BUFFER_SIZE))
+        goto err;
+
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    if (dw1000_stream(spi_cfg, DW1000_TX_BUFFER, ofs, buf, len, true))
+        goto err;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+/**
+ * @brief Start the delayed transmission of the staged frame at dx_time.
+ */
+int dw1000_start_staged_tx(uint64_t dx_time, bool wait4resp)
+{
+    if (!m_dw1000_ctx.tx_staged)
+        goto err;
+
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_DX_TIME, &dx_time, sizeof(union DW1000_REG_DX_TIME), NULL))
+        goto err;
+
+    m_dw1000_ctx.tx_staged = false;
+    m_dw1000_ctx.tx_done   = false;
+    m_dw1000_ctx.dx.pending = DW1000_DX_TX;
+    m_dw1000_ctx.dx.tx++;
+    union DW1000_REG_SYS_CTRL sys_ctrl = {.txstrt = 1, .txdlys = 1, .wait4resp = !!wait4resp};
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+        goto err;
+
+#if (CONFIG_DW1000_SESSION)
+    m_dw1000_ctx.stats.tx_frames++;
+#endif
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+#endif
+
 void dw1000_isr()
 {
     const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
@@ -1991,6 +2883,70 @@ void dw1000_isr()
         goto err;
     union DW1000_REG_SYS_STATUS sys_status = m_dw1000_ctx.sys_status;
 
+    struct dw1000_rx_window *win = &m_dw1000_ctx.rx_window;
+    if (win->open && (sys_status.ofs_00.rxfcg || (sys_status.ofs_00.value & (DW1000_SYS_STS_RX_TO | DW1000_SYS_STS_RX_ERR)))) {
+        win->open = false;
+        win->count++;
+        win->saved_us += win->delay_us;
+        if (sys_status.ofs_00.rxfcg) {
+            win->on_us += win->reply_us;
+        } else if (sys_status.ofs_00.value & DW1000_SYS_STS_RX_ERR) {
+            // The reply was on air, the receiver stopped about when it ended
+            win->on_us += win->reply_us;
+            win->errors++;
+        } else if (sys_status.ofs_00.rxpto) {
+            win->on_us += win->pretoc_us;
+            win->empty++;
+        } else {
+            win->on_us += win->timeout_us;
+            win->timeouts++;
+        }
+    }
+
+#if (CONFIG_DW1000_TX_QUEUE)
+    // The frame on air is done, its slot is free and the next one can start
+    struct dw1000_tx_queue *txq = &m_dw1000_ctx.txq;
+    if (sys_status.ofs_00.txfrs && txq->on_air) {
+        txq->on_air = false;
+        txq->sent++;
+    }
+#endif
+
+    // The last delayed start was issued after its DX_TIME had passed
+    if (sys_status.ofs_00.hpdwarn) {
+        sys_status.ofs_00.hpdwarn = 0;
+        if (m_dw1000_ctx.dx.pending == DW1000_DX_TX) {
+            /**
+             * The DW1000 would hold the frame until the system time wraps,
+             * about 17 s later, and with WAIT4RESP the receiver stays off
+             * until then, so no RX timeout ends the exchange either. Drop
+             * the frame and fail the exchange as if its reply timed out.
+             */
+            m_dw1000_ctx.dx.tx_late++;
+            union DW1000_REG_SYS_CTRL sys_ctrl = {.trxoff = 1};
+            if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+                goto err;
+            m_dw1000_ctx.sys_status.ofs_00.value |= DW1000_SYS_STS_RXRFTO;
+        #if (CONFIG_DW1000_PRESTAGE_TX)
+            m_dw1000_ctx.tx_done = true;
+        #endif
+            if (win->open) {
+                win->open = false;
+                win->count++;
+                win->late++;
+            }
+        } else if (m_dw1000_ctx.dx.pending == DW1000_DX_RX) {
+            // Open the missed slot late rather than 17 s late, RX_FWTO still ends it
+            m_dw1000_ctx.dx.rx_late++;
+            union DW1000_REG_SYS_CTRL sys_ctrl = {.trxoff = 1};
+            if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+                goto err;
+            if (dw1000_rx_start(spi_cfg))
+                goto err;
+        }
+        m_dw1000_ctx.dx.pending = DW1000_DX_NONE;
+    }
+
     #if (CONFIG_DW1000_ANCHOR_LISTEN_TO)
     if (m_dw1000_ctx.twr_state == DW1000_DS_TWR_STATE_LISTEN)
         m_dw1000_ctx.listen_to++;
@@ -2002,6 +2958,10 @@ void dw1000_isr()
 
     if (sys_status.ofs_00.value & (DW1000_SYS_STS_RXFCG | DW1000_SYS_STS_RXDFR))
     {
+    #if (CONFIG_DW1000_SESSION)
+        if (sys_status.ofs_00.rxfcg)
+            m_dw1000_ctx.stats.rx_frames++;
+    #endif
         // pico_set_led(led_out);
         // led_out = !led_out;
 
@@ -2024,7 +2984,10 @@ void dw1000_isr()
     #if (CONFIG_DW1000_DELAY_TX)
     else if (sys_status.ofs_00.value & DW1000_SYS_STS_TXFRS)
     {
-    #if (CONFIG_DW1000_ANCHOR)
+    #if (CONFIG_DW1000_PRESTAGE_TX)
+        m_dw1000_ctx.tx_done = true;
+    #endif
+    #if (CONFIG_DW1000_ANCHOR) && (!CONFIG_DW1000_PREDICT_TX_TS)
         // response sent
         if (m_dw1000_ctx.catch_resp_txtfs) {
             m_dw1000_ctx.catch_resp_txtfs = false;
@@ -2033,7 +2996,7 @@ void dw1000_isr()
             // dw1000_trace(INFO, "t_resp_tx: %llx\n", t_resp_tx);
         }
     #endif
-    #if (CONFIG_DW1000_TAG)
+    #if (CONFIG_DW1000_TAG) && (!CONFIG_DW1000_PREDICT_TX_TS)
         if (m_dw1000_ctx.catch_poll_txtfs) {
             m_dw1000_ctx.catch_poll_txtfs = false;
             if (dw1000_non_indexed_read(spi_cfg, DW1000_TX_TIME, &t_poll_tx, 5, NULL))
@@ -2056,6 +3019,10 @@ void dw1000_isr()
         #endif
             dw1000_trace(INFO, "rxrfto\n");
     }
+    else if (sys_status.ofs_00.value & DW1000_SYS_STS_RXPTO)
+    {
+        dw1000_trace(INFO, "rxpto\n");
+    }
     else if (sys_status.ofs_00.value & (DW1000_SYS_STS_RXFSL | DW1000_SYS_STS_RXFCE | DW1000_SYS_STS_RXPHE))
     {
         print_buf(&sys_status, sizeof(sys_status), "\nre00: ");
@@ -2093,39 +3060,839 @@ void dw1000_isr()
     // pico_set_led(led_out);
     // led_out = !led_out;
 
-    if (dw1000_clear_sys_status(spi_cfg))
+    if (dw1000_clear_sys_status(spi_cfg))
+        goto err;
+
+    return;
+err:
+    dw1000_trace(ERROR, "%s failed.\n", __func__);
+    return;
+}
+
+int driver_dw1000_gpio_init()
+{
+    dw1000_trace(INIT, "%s\n", __func__);
+
+    m_dw1000_ctx.gpio_rst_cfg.pin = RSTn_PIN;
+    gpio_init(m_dw1000_ctx.gpio_rst_cfg.pin);
+    gpio_set_dir(m_dw1000_ctx.gpio_rst_cfg.pin, GPIO_OUT);
+
+    return 0;
+}
+
+int driver_dw1000_gpio_irq_init()
+{
+    dw1000_trace(INIT, "%s\n", __func__);
+
+    struct gpio_config *gpio_irq_cfg = &m_dw1000_ctx.gpio_irq_cfg;
+    gpio_irq_cfg->pin        = IRQ_PIN;
+    gpio_irq_cfg->enabled    = true;
+    // gpio_irq_cfg->event_mask = GPIO_IRQ_EDGE_RISE;
+    gpio_irq_cfg->event_mask = GPIO_IRQ_LEVEL_HIGH;
+    gpio_irq_cfg->callback   = dw1000_isr;
+
+    if (gpio_irq_init(gpio_irq_cfg))
+        goto err;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+int driver_dw1000_spi_init()
+{
+    dw1000_trace(INIT, "%s\n", __func__);
+
+    struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    spi_cfg->spi        = SPI_INST;
+    spi_cfg->spi_speed  = SPI_SPEED;
+    spi_cfg->pin.sck    = SPI0_SCK_PIN;
+    spi_cfg->pin.tx     = SPI0_TX_PIN;
+    spi_cfg->pin.rx     = SPI0_RX_PIN;
+    spi_cfg->pin.csn    = SPI0_CSN_PIN;
+    spi_cfg->slave_mode = false;
+
+    spi_init(spi_cfg->spi, spi_cfg->spi_speed);
+    spi_set_slave(spi_cfg->spi, !!spi_cfg->slave_mode);
+    gpio_set_function(spi_cfg->pin.sck, GPIO_FUNC_SPI);
+    gpio_set_function(spi_cfg->pin.tx, GPIO_FUNC_SPI);
+    gpio_set_function(spi_cfg->pin.rx, GPIO_FUNC_SPI);
+    // gpio_set_function(spi_cfg->pin.csn, GPIO_FUNC_SPI);
+
+    // Make the SPI pins available to picotool
+    // bi_decl(bi_4pins_with_func(SPI0_RX_PIN, SPI0_TX_PIN, SPI0_SCK_PIN, SPI0_CSN_PIN, GPIO_FUNC_SPI));
+    // bi_decl(bi_3pins_with_func(SPI0_RX_PIN, SPI0_TX_PIN, SPI0_SCK_PIN, GPIO_FUNC_SPI));
+
+    // Chip select is active-low, so we'll initialise it to a driven-high state
+    gpio_init(spi_cfg->pin.csn);
+    gpio_put(spi_cfg->pin.csn, 1);
+    gpio_set_dir(spi_cfg->pin.csn, GPIO_OUT);
+
+    // Make the CS pin available to picotool
+    // bi_decl(bi_1pin_with_name(SPI0_CSN_PIN, "SPI CS"));
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+
+#if (CONFIG_DW1000_CELL_PLAN)
+static const struct cell_pos m_cell_map[] = {
+    CELL_MAP
+};
+#define CELLS ((int)(sizeof(m_cell_map) / sizeof(m_cell_map[0])))
+_Static_assert(sizeof(m_cell_map) / sizeof(m_cell_map[0]) <= CELL_PLAN_MAX, "too many cells in the cell map");
+_Static_assert(CELL_ID < sizeof(m_cell_map) / sizeof(m_cell_map[0]), "CELL_ID is not in the cell map");
+
+/**
+ * @brief Take the channel and preamble code of a cell of the cell map.
+ *
+ * The narrow band channels 1, 2, 3 and 5 do not overlap and are the
+ * candidates of cell_plan(), with DW1000_CHAN and DW1000_PCODE first. Call it
+ * after dw1000_ctx_init(), the next dw1000_init() applies the cell.
+ *
+ * @param[in] cell_id    Cell of this device in the cell map.
+ */
+int dw1000_set_cell(uint8_t cell_id)
+{
+    const uint8_t chans[] = {DW1000_CHAN_1, DW1000_CHAN_2, DW1000_CHAN_3, DW1000_CHAN_5};
+    struct cell_radio cand[sizeof(chans) * 4 + 1] = {{DW1000_CHAN, DW1000_PCODE}};
+    int n_cand = 1;
+    for (int c = 0; c < (int)sizeof(chans); c++) {
+        for (uint8_t pcode = DW1000_PCODE_1; pcode <= DW1000_PCODE_24; pcode++) {
+            if (dw1000_pcode_valid(chans[c], DW1000_PRF, pcode) && ((chans[c] != DW1000_CHAN) || (pcode != DW1000_PCODE)))
+                cand[n_cand++] = (struct cell_radio){chans[c], pcode};
+        }
+    }
+
+    struct cell_radio plan[CELL_PLAN_MAX];
+    int shared = cell_plan(m_cell_map, CELLS, CELL_REUSE_DIST_M, cand, n_cand, plan);
+    if ((cell_id >= CELLS) || (shared < 0))
+        goto err;
+    for (int i = 0; i < CELLS; i++)
+        dw1000_trace(INFO, "cell %d: channel %d, preamble code %d%s\n", i, plan[i].chan, plan[i].pcode, (i == cell_id) ? " (this cell)" : "");
+    if (shared)
+        dw1000_trace(WARN, "@@ cell plan: %d pairs of neighbouring cells share a channel and code\n", shared);
+    m_dw1000_ctx.cell = plan[cell_id];
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+#endif
+
+void dw1000_ctx_init()
+{
+    memset(&m_dw1000_ctx, 0, sizeof(m_dw1000_ctx));
+    m_dw1000_ctx.lde_run_enable = true;
+    m_dw1000_ctx.cell.chan  = DW1000_CHAN;
+    m_dw1000_ctx.cell.pcode = DW1000_PCODE;
+#if (CONFIG_DW1000_CELL_PLAN)
+    dw1000_set_cell(CELL_ID);
+#endif
+#if (CONFIG_DW1000_TAG)
+    m_dw1000_ctx.my_addr = 0xAA;
+#endif
+#if (CONFIG_DW1000_ANCHOR)
+    m_dw1000_ctx.my_addr = ANCHOR_ADDR;
+#endif
+#if (CONFIG_DW1000_EXT_SYNC) && (CONFIG_DW1000_EXT_SYNC_MASTER)
+    m_dw1000_ctx.ext_sync.next_pulse_us = time_us_64();
+#endif
+#if (CONFIG_DW1000_BLINK_BACKOFF)
+    // Tags powered up together would otherwise blink in step and collide on every blink
+    m_dw1000_ctx.blink_backoff.period_us  = SESSION_DISCOVERY_PERIOD_MS * 1000;
+    m_dw1000_ctx.blink_backoff.jitter_pct = BLINK_JITTER_PERCENT;
+    m_dw1000_ctx.blink_backoff.max_exp    = BLINK_BACKOFF_MAX_EXP;
+#endif
+#if (CONFIG_DW1000_CLOCK_SYNC)
+    m_dw1000_ctx.sync.kf.r            = SYNC_KF_R;
+    m_dw1000_ctx.sync.kf.q            = SYNC_KF_Q;
+    m_dw1000_ctx.sync.kf.drift0       = SYNC_KF_DRIFT0;
+    m_dw1000_ctx.sync.kf.lock_nis     = SYNC_LOCK_NIS;
+    m_dw1000_ctx.sync.kf.lock_count   = SYNC_LOCK_COUNT;
+    m_dw1000_ctx.sync.kf.unlock_count = SYNC_UNLOCK_COUNT;
+#endif
+#if (CONFIG_DW1000_RANGE_FILTER)
+    m_dw1000_ctx.range_filter.kf.r           = RANGE_FILTER_R;
+    m_dw1000_ctx.range_filter.kf.q           = RANGE_FILTER_Q;
+    m_dw1000_ctx.range_filter.kf.rate0       = RANGE_FILTER_RATE0;
+    m_dw1000_ctx.range_filter.kf.gate        = RANGE_FILTER_GATE;
+    m_dw1000_ctx.range_filter.kf.max_rejects = RANGE_FILTER_MAX_REJECTS;
+    m_dw1000_ctx.range_filter.kf.peers       = RANGE_FILTER_PEERS;
+#endif
+#if (CONFIG_DW1000_ADAPTIVE_RATE)
+    // A fix is one ranging exchange; the preamble length and bit rate set its airtime
+    m_dw1000_ctx.rate.fix_airtime_us = dw1000_twr_exchange_airtime_ns(0) / 1000;
+#endif
+    mac_frame_match_init(&m_dw1000_ctx.twr_match, DW1000_TWR_FCTRL, DW1000_PAN_ID, m_dw1000_ctx.my_addr);
+}
+
+/**
+ * @brief Check the frame control, sequence number, PAN ID (unless compact),
+ * destination and function code of a received ranging frame in one masked
+ * compare.
+ *
+ * @param[in] frame      Received frame, at least MAC_FRAME_MATCH_BYTES of buffer.
+ * @param[in] seq_num    Expected sequence number, -1 for any.
+ * @param[in] code       Expected function code.
+ */
+static bool dw1000_twr_frame_match(const void *frame, int seq_num, uint8_t code)
+{
+    struct mac_frame_match m = m_dw1000_ctx.twr_match;
+    if (seq_num >= 0)
+        mac_frame_match_seq(&m, (uint8_t)seq_num);
+    mac_frame_match_byte(&m, m.payload_ofs, code, 0xFF);
+    return mac_frame_match(&m, frame);
+}
+
+/**
+ * @brief Read a received ranging frame of len bytes into rx_buf, dropping it
+ * after the header unless it matches as in dw1000_twr_frame_match(). A frame
+ * longer than rx_buf is cut to its size.
+ *
+ * @return Bytes read if the frame matches, 0 if not, -1 on error.
+ */
+static int dw1000_read_twr_frame(size_t len, int seq_num, uint8_t code)
+{
+    struct mac_frame_match m = m_dw1000_ctx.twr_match;
+    if (seq_num >= 0)
+        mac_frame_match_seq(&m, (uint8_t)seq_num);
+    mac_frame_match_byte(&m, m.payload_ofs, code, 0xFF);
+    if (len > sizeof(m_dw1000_ctx.rx_buf))
+        len = sizeof(m_dw1000_ctx.rx_buf);
+    return dw1000_read_rx_frame_match(&m, m_dw1000_ctx.rx_buf, len);
+}
+
+#if (CONFIG_DW1000_FRAME_BENCH)
+/**
+ * @brief Time the masked compare of a poll frame against the field by field
+ * check it replaces. The codec itself is tested on the host, see utility/test.
+ */
+static void dw1000_frame_bench(void)
+{
+    #define FRAME_BENCH_N (2000)
+    static uint8_t buf[MAC_FRAME_MATCH_BYTES];
+
+    union dw1000_poll_msg *poll = (void *)buf;
+    memset(buf, 0, sizeof(buf));
+    poll->fctrl    = DW1000_TWR_FCTRL;
+    poll->seq_num  = 7;
+#if (!CONFIG_DW1000_COMPACT_FRAMES)
+    poll->pan_id   = DW1000_PAN_ID;
+#endif
+    poll->dst_addr = m_dw1000_ctx.my_addr;
+    poll->src_addr = 0x1234;
+    poll->code     = DW1000_TWR_CODE_POLL;
+    volatile int hits = 0;
+    uint64_t t0 = time_us_64();
+    for (int i = 0; i < FRAME_BENCH_N; i++) {
+        volatile union dw1000_poll_msg *p = poll;
+        hits += (p->fctrl == DW1000_TWR_FCTRL) && (p->seq_num == 7) &&
+        #if (!CONFIG_DW1000_COMPACT_FRAMES)
+            (p->pan_id == DW1000_PAN_ID) &&
+        #endif
+            (p->code == DW1000_TWR_CODE_POLL) && (p->dst_addr == m_dw1000_ctx.my_addr);
+    }
+    uint64_t t1 = time_us_64();
+    for (int i = 0; i < FRAME_BENCH_N; i++)
+        hits += dw1000_twr_frame_match(poll, 7, DW1000_TWR_CODE_POLL);
+    uint64_t t2 = time_us_64();
+    dw1000_trace(INFO, "frame bench: poll header check\n");
+    dw1000_trace(INFO, " fields: %lf us\n", (double)(t1 - t0) / FRAME_BENCH_N);
+    dw1000_trace(INFO, " masked: %lf us, %d hits\n", (double)(t2 - t1) / FRAME_BENCH_N, hits);
+    #undef FRAME_BENCH_N
+}
+#endif
+
+#if (CONFIG_DW1000_SESSION)
+/**
+ * @brief Count a completed ranging exchange and print the ranging throughput
+ * every SESSION_REPORT_INTERVAL fixes.
+ *
+ * The airtime spent per fix is reported as the number of frames sent and
+ * received for each fix, which includes the discovery frames (blink and
+ * ranging init) whenever a session has to be re-established.
+ */
+static void dw1000_session_fix(void)
+{
+    struct dw1000_twr_stats *stats = &m_dw1000_ctx.stats;
+
+    stats->fixes++;
+    if (stats->fixes % SESSION_REPORT_INTERVAL)
+        return;
+
+    uint64_t elapsed_us = time_us_64() - stats->t_start_us;
+    dw1000_trace(INFO, "@@ session: %lu fixes, %lu attempts, %lu discoveries, %lu tx, %lu rx\n",
+        stats->fixes, stats->attempts, stats->discoveries, stats->tx_frames, stats->rx_frames);
+    dw1000_trace(INFO, "@@ session: %.2lf fix/s, %.2lf frames/fix\n",
+        (double)stats->fixes * 1000000.0 / (double)elapsed_us,
+        (double)(stats->tx_frames + stats->rx_frames) / (double)stats->fixes);
+    const struct dw1000_rx_window *win = &m_dw1000_ctx.rx_window;
+    if (win->count)
+        dw1000_trace(INFO, "@@ rx window: %lu, %lu empty, %lu lost, %lu in error, %lu late, %.0lf us on (estimated), %.0lf us saved by W4R_TIM per window\n",
+            win->count, win->empty, win->timeouts, win->errors, win->late, (double)win->on_us / win->count, (double)win->saved_us / win->count);
+#if (CONFIG_DW1000_FRAME_FILTER)
+    const struct dw1000_ff_stats *ff = &m_dw1000_ctx.ff;
+    if (!dw1000_frame_filter_poll())
+        dw1000_trace(INFO, "@@ frame filter: %lu accepted, %lu rejected\n", ff->accepted, ff->rejected);
+#endif
+    const struct dw1000_dx_stats *dx = &m_dw1000_ctx.dx;
+    if (dx->tx_late || dx->rx_late)
+        dw1000_trace(WARN, "@@ late delayed start: tx %lu/%lu dropped, rx %lu/%lu opened late\n",
+            dx->tx_late, dx->tx, dx->rx_late, dx->rx);
+#if (CONFIG_DW1000_ADAPTIVE_RATE)
+    dw1000_trace(INFO, "@@ rate: period %u ms, %lu speed-ups, airtime %.2lf permille\n",
+        m_dw1000_ctx.rate.period_ms, m_dw1000_ctx.rate.faster,
+        (double)stats->fixes * m_dw1000_ctx.rate.fix_airtime_us * 1000.0 / (double)elapsed_us);
+#endif
+}
+
+/**
+ * @brief Record a failed ranging exchange. A paired tag falls back to
+ * discovery after SESSION_MAX_FAILS consecutive failures.
+ */
+static void dw1000_session_fail(void)
+{
+    if (!m_dw1000_ctx.paired)
+        return;
+
+    if (++m_dw1000_ctx.fail_cnt >= SESSION_MAX_FAILS) {
+        dw1000_trace(WARN, "@@ session lost %x\n", m_dw1000_ctx.tar_addr);
+        m_dw1000_ctx.paired   = false;
+        m_dw1000_ctx.fail_cnt = 0;
+    }
+}
+#endif
+
+#if (CONFIG_DW1000_MULTILAT)
+static int dw1000_multilat_index(uint16_t addr)
+{
+    for (int i = 0; i < MULTILAT_ANCHORS; i++)
+        if (m_anchor_map[i].addr == addr)
+            return i;
+    return -1;
+}
+
+/**
+ * @brief Anchor to poll in the next exchange, the anchor map is polled in turn.
+ */
+static uint16_t dw1000_multilat_next_anchor(void)
+{
+    struct dw1000_multilat *ml = &m_dw1000_ctx.multilat;
+    uint16_t addr = m_anchor_map[ml->next].addr;
+    ml->next = (ml->next + 1) % MULTILAT_ANCHORS;
+    return addr;
+}
+
+/**
+ * @brief Record a range and solve the position from the ranges that are not
+ * older than MULTILAT_MAX_AGE_MS. The previous fix is the starting point.
+ *
+ * @param[in] addr      Anchor the range was measured to.
+ * @param[in] range_m   Range in metres.
+ */
+static void dw1000_multilat_range(uint16_t addr, float range_m)
+{
+    struct dw1000_multilat *ml = &m_dw1000_ctx.multilat;
+    int idx = dw1000_multilat_index(addr);
+    if (idx < 0)
+        return;
+
+    uint64_t now = time_us_64();
+    ml->range[idx]      = range_m;
+    ml->t_range_us[idx] = now;
+
+    struct multilat_meas meas[MULTILAT_MAX_ANCHORS];
+    int n = 0;
+    for (int i = 0; i < MULTILAT_ANCHORS; i++) {
+        if (!ml->t_range_us[i] || (now - ml->t_range_us[i] > MULTILAT_MAX_AGE_MS * 1000ULL))
+            continue;
+        memcpy(meas[n].pos, m_anchor_map[i].pos, sizeof(meas[n].pos));
+        meas[n++].range = ml->range[i];
+    }
+    if (n < 3)
+        return;
+
+    float guess[3];
+    memcpy(guess, ml->fix.pos, sizeof(guess));
+    uint64_t t0 = time_us_64();
+    int rc = multilat_solve(meas, n, MULTILAT_3D, MULTILAT_TAG_Z, ml->has_fix ? guess : NULL, &ml->fix);
+    uint64_t t_solve = time_us_64() - t0;
+    ml->has_fix = !rc;
+    if (rc) {
+        dw1000_trace(WARN, "@@ pos: degenerate geometry with %d anchors\n", n);
+        return;
+    }
+
+    const struct multilat_result *fix = &ml->fix;
+    dw1000_trace(INFO, "@@ pos %.3lf %.3lf %.3lf m (%s), %u anchors, rms %.3lf m, %u iter, %llu us\n",
+        (double)fix->pos[0], (double)fix->pos[1], (double)fix->pos[2], fix->is_3d ? "3D" : "2D",
+        fix->anchors, (double)fix->rms, fix->iterations, t_solve);
+}
+#endif
+
+#if (CONFIG_DW1000_RANGE_FILTER)
+/**
+ * @brief Filter one range of a peer, see range_filter_update().
+ *
+ * @param[in]  addr          Peer address.
+ * @param[in]  range_mm      Measured range.
+ * @param[out] filtered_mm   Filtered range.
+ *
+ * @retval 0  Range accepted.
+ * @retval 1  Range rejected.
+ */
+static int dw1000_range_filter_update(uint16_t addr, float range_mm, float *filtered_mm)
+{
+    struct dw1000_range_filter *rf = &m_dw1000_ctx.range_filter;
+    uint64_t t0 = time_us_64();
+    int rc = range_filter_update(&rf->kf, addr, t0, range_mm, filtered_mm);
+
+    /**
+     * The update takes about a microsecond, the 1 us timer ticks at random
+     * phases so the sum over many updates is still a fair measure.
+     */
+    rf->cost_us += time_us_64() - t0;
+    if (rf->kf.restarts != rf->restarts) {
+        rf->restarts = rf->kf.restarts;
+        dw1000_trace(WARN, "@@ range filter restart %x\n", addr);
+    }
+    if (!(rf->kf.ranges % RANGE_FILTER_REPORT_INTERVAL)) {
+        dw1000_trace(INFO, "@@ range filter: %lu ranges, %lu rejected (%.1lf%%), %.2lf us/range\n",
+            rf->kf.ranges, rf->kf.rejected, 100.0 * (double)rf->kf.rejected / (double)rf->kf.ranges,
+            (double)rf->cost_us / (double)rf->kf.ranges);
+    }
+    return rc;
+}
+#endif
+
+#if (CONFIG_DW1000_ADAPTIVE_RATE)
+/**
+ * @brief Adapt the poll period to the last range of a peer.
+ *
+ * A range away from the prediction halves the period. Otherwise the period
+ * grows by RATE_BACKOFF per fix, but stays short enough for the range to
+ * change by at most RATE_STEP_MM between two fixes at the estimated range
+ * rate. The airtime budget sets the shortest period.
+ */
+static void dw1000_rate_update(uint16_t addr)
+{
+    struct dw1000_rate_ctrl *rate = &m_dw1000_ctx.rate;
+    const struct range_track *trk = range_filter_find(&m_dw1000_ctx.range_filter.kf, addr);
+    if (trk == NULL)
+        return;
+
+    float period = rate->period_ms ? rate->period_ms : m_dw1000_ctx.period_ms;
+    if (trk->nis > RATE_NIS_FAST) {
+        period *= 0.5f;
+        rate->faster++;
+    } else {
+        period *= RATE_BACKOFF;
+    }
+    float speed = fabsf(trk->rate);
+    if (speed > 0.0f)
+        period = fminf(period, 1000.0f * RATE_STEP_MM / speed);
+
+    // fix_airtime_us / (RATE_AIRTIME_BUDGET_PERMILLE / 1000) in ms
+    float min_period = fmaxf(RATE_MIN_PERIOD_MS, (float)rate->fix_airtime_us / RATE_AIRTIME_BUDGET_PERMILLE);
+    period = fminf(fmaxf(period, min_period), RATE_MAX_PERIOD_MS);
+
+    if ((uint16_t)period != rate->period_ms)
+        dw1000_trace(PERF, "@@ rate: %u ms, %.0lf mm/s, nis %.1lf\n", (uint16_t)period, (double)speed, (double)trk->nis);
+    rate->period_ms = (uint16_t)period;
+}
+#endif
+
+#if (CONFIG_DW1000_RANGE_FILTER) || (CONFIG_DW1000_MULTILAT)
+/**
+ * @brief Hand a measured range over to the filter and the position solver.
+ *
+ * @param[in] addr       Peer address.
+ * @param[in] range_mm   Measured range.
+ */
+static void dw1000_range_publish(uint16_t addr, float range_mm)
+{
+#if (CONFIG_DW1000_RANGE_FILTER)
+    float filtered_mm;
+    int rejected = dw1000_range_filter_update(addr, range_mm, &filtered_mm);
+#if (CONFIG_DW1000_ADAPTIVE_RATE)
+    dw1000_rate_update(addr);
+#endif
+    if (rejected) {
+        dw1000_trace(WARN, "@@ range %.0lf mm rejected, %.0lf mm expected\n", (double)range_mm, (double)filtered_mm);
+        return;
+    }
+    dw1000_trace(INFO, " filtered : %.0lf mm\n", (double)filtered_mm);
+    range_mm = filtered_mm;
+#endif
+#if (CONFIG_DW1000_MULTILAT)
+    dw1000_multilat_range(addr, range_mm / 1000.0f);
+#endif
+}
+#endif
+
+#if (CONFIG_DW1000_TDOA) && (CONFIG_DW1000_ANCHOR)
+/**
+ * @brief Forward a TDoA record upstream as one line, see tdoa_format().
+ */
+static void dw1000_tdoa_emit(const struct tdoa_record *rec)
+{
+    char line[TDOA_LINE_MAX];
+    if (tdoa_format(line, sizeof(line), rec) > 0)
+        puts(line);
+}
+#endif
+
+#if (CONFIG_DW1000_EXT_SYNC) && (CONFIG_DW1000_EXT_SYNC_MASTER)
+/**
+ * @brief Pulse the SYNC line once the reset period has elapsed.
+ *
+ * Must not be called with a delayed transmission pending, the DX_TIME of that
+ * transmission would refer to the old timebase.
+ */
+static void dw1000_ext_sync_poll(void)
+{
+    struct dw1000_ext_sync *ext = &m_dw1000_ctx.ext_sync;
+    uint64_t now = time_us_64();
+    if (now < ext->next_pulse_us)
+        return;
+
+    gpio_put(SYNC_PIN, 1);
+    busy_wait_us(EXT_SYNC_PULSE_US);
+    gpio_put(SYNC_PIN, 0);
+    ext->resets++;
+
+    ext->next_pulse_us += EXT_SYNC_PERIOD_MS * 1000;
+    if (ext->next_pulse_us < now)
+        ext->next_pulse_us = now + EXT_SYNC_PERIOD_MS * 1000;
+}
+#endif
+
+#if (CONFIG_DW1000_CLOCK_SYNC) && (CONFIG_DW1000_ANCHOR)
+#if (CONFIG_DW1000_SYNC_REFERENCE)
+/**
+ * @brief Send a sync frame carrying its own predicted TX timestamp.
+ *
+ * The receiver is turned off for the transmission and turned back on by
+ * WAIT4RESP once the frame has been sent.
+ */
+static int dw1000_clock_sync_send(void)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    struct dw1000_clock_sync *sync = &m_dw1000_ctx.sync;
+
+    union DW1000_REG_SYS_CTRL sys_ctrl = {.trxoff = 1};
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+        goto err;
+
+#if (CONFIG_DW1000_EXT_SYNC) && (CONFIG_DW1000_EXT_SYNC_MASTER)
+    // The previous sync frame is long gone, reset the timebases before stamping this one
+    dw1000_ext_sync_poll();
+#endif
+
+    uint64_t sys_time = 0;
+    if (dw1000_non_indexed_read(spi_cfg, DW1000_SYS_TIME, &sys_time, sizeof(union DW1000_REG_SYS_TIME), NULL))
+        goto err;
+    uint64_t dx_time  = sys_time + DX_TIME_US(TX_DELAY_US);
+    uint64_t tx_stamp = dw1000_predict_tx_stamp(dx_time);
+
+    union dw1000_sync_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
+    tx_frame->fctrl    = IEEE_802_15_4_FCTRL_RANGE_16;
+    tx_frame->seq_num  = ++sync->seq_num;
+    tx_frame->pan_id   = DW1000_PAN_ID;
+    tx_frame->dst_addr = DW1000_BROADCAST_ADDR;
+    tx_frame->src_addr = m_dw1000_ctx.my_addr;
+    tx_frame->code     = DW1000_CODE_CLOCK_SYNC;
+    memcpy(tx_frame->tx_stamp, &tx_stamp, sizeof(tx_frame->tx_stamp));
+    if (dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, true))
+        goto err;
+
+    uint64_t now = time_us_64();
+    sync->next_tx_us += SYNC_PERIOD_MS * 1000;
+    if (sync->next_tx_us < now)
+        sync->next_tx_us = now + SYNC_PERIOD_MS * 1000;
+
+    return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
+}
+#elif (CONFIG_DW1000_EXT_SYNC)
+/**
+ * @brief Measure the wired sync error with one sync frame.
+ *
+ * The timebases of both anchors are reset by the same SYNC edge, so the
+ * reference TX stamp plus the time of flight should match the local RX stamp.
+ *
+ * @param[in] local_ts   Local RX timestamp of the sync frame.
+ * @param[in] ref_ts     Reference TX timestamp carried in the sync frame.
+ */
+static void dw1000_ext_sync_bench(uint64_t local_ts, uint64_t ref_ts)
+{
+    struct dw1000_ext_sync *ext = &m_dw1000_ctx.ext_sync;
+
+    // The local time went backwards since the last sync frame
+    if (ext->count && tdoa_stamp_diff(local_ts, ext->local_ts) < 0)
+        ext->resets++;
+    ext->local_ts = local_ts;
+
+    int64_t err = tdoa_stamp_diff(ref_ts + SYNC_REF_TOF, local_ts);
+    ext->err_sum += (double)err;
+    ext->err_sq  += (double)err * (double)err;
+    if (llabs(err) > ext->err_max)
+        ext->err_max = llabs(err);
+
+    if (!(++ext->count % SYNC_REPORT_INTERVAL)) {
+        double mean = ext->err_sum / SYNC_REPORT_INTERVAL;
+        double rms  = sqrt(ext->err_sq / SYNC_REPORT_INTERVAL);
+        dw1000_trace(INFO, "@@ ext sync error mean %lf ns, rms %lf ns, max %lf ns, %lu resets\n",
+            mean * 1e9 / (double)DW1000_SAMPLING_CLOCK, rms * 1e9 / (double)DW1000_SAMPLING_CLOCK,
+            (double)ext->err_max * 1e9 / (double)DW1000_SAMPLING_CLOCK, ext->resets);
+        ext->err_sum = ext->err_sq = 0;
+        ext->err_max = 0;
+    }
+}
+#else
+/**
+ * @brief Feed one sync frame into the clock filter.
+ *
+ * @param[in] local_ts   Local RX timestamp of the sync frame.
+ * @param[in] ref_ts     Reference TX timestamp carried in the sync frame.
+ */
+static void dw1000_clock_sync_update(uint64_t local_ts, uint64_t ref_ts)
+{
+    struct dw1000_clock_sync *sync = &m_dw1000_ctx.sync;
+    bool locked = sync->kf.locked;
+
+    if (!sync->kf.count)
+        sync->t_first_us = time_us_64();
+    double y = clock_sync_update(&sync->kf, local_ts, ref_ts + SYNC_REF_TOF);
+
+    if (!locked && sync->kf.locked) {
+        dw1000_trace(INFO, "@@ sync locked to %x after %llu ms, drift %lf ppm\n", sync->ref_addr,
+            (time_us_64() - sync->t_first_us) / 1000, sync->kf.drift * 1e6 / (double)DW1000_SAMPLING_CLOCK);
+    } else if (locked && !sync->kf.locked) {
+        dw1000_trace(WARN, "@@ sync lost after %d outliers, last residual %lf ticks\n", SYNC_UNLOCK_COUNT, y);
+    }
+
+    sync->res_sq += y * y;
+    if (!(sync->kf.count % SYNC_REPORT_INTERVAL)) {
+        double rms = sqrt(sync->res_sq / SYNC_REPORT_INTERVAL);
+        dw1000_trace(INFO, "@@ sync residual %lf ticks (%lf ns) rms, drift %lf ppm\n", rms,
+            rms * 1e9 / (double)DW1000_SAMPLING_CLOCK, sync->kf.drift * 1e6 / (double)DW1000_SAMPLING_CLOCK);
+        sync->res_sq = 0;
+    }
+}
+#endif
+
+/**
+ * @brief Convert a local timestamp into the clock of the reference anchor.
+ *
+ * @retval 0  Converted.
+ * @retval -1 The filter is not locked yet.
+ */
+int dw1000_clock_sync_to_ref(uint64_t local_ts, uint64_t *ref_ts)
+{
+#if (CONFIG_DW1000_SYNC_REFERENCE) || (CONFIG_DW1000_EXT_SYNC)
+    *ref_ts = local_ts & DW1000_TIMESTAMP_MASK;
+    return 0;
+#else
+    return clock_sync_to_ref(&m_dw1000_ctx.sync.kf, local_ts, ref_ts);
+#endif
+}
+#endif
+
+#if (CONFIG_DW1000_PRESTAGE_TX)
+#if (CONFIG_DW1000_ANCHOR)
+/**
+ * @brief Stage the response to the next poll. The sequence number and the
+ * destination address are patched once the poll has been received.
+ */
+static int dw1000_stage_resp_msg(void)
+{
+    union dw1000_resp_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
+    memset(tx_frame, 0, sizeof(*tx_frame));
+    tx_frame->fctrl    = DW1000_TWR_FCTRL;
+#if (!CONFIG_DW1000_COMPACT_FRAMES)
+    tx_frame->pan_id   = DW1000_PAN_ID;
+#endif
+    tx_frame->dst_addr = m_dw1000_ctx.tar_addr;
+    tx_frame->src_addr = m_dw1000_ctx.my_addr;
+    tx_frame->code     = DW1000_TWR_CODE_RESP;
+    return dw1000_stage_tx_frame(tx_frame, sizeof(*tx_frame));
+}
+#endif
+
+#if (CONFIG_DW1000_TAG) && (!CONFIG_DW1000_SS_TWR)
+/**
+ * @brief Stage the final message while waiting for the response. The
+ * sequence number, destination address and timestamps are patched once the
+ * response has been received.
+ */
+static int dw1000_stage_final_msg(void)
+{
+    union dw1000_final_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
+    memset(tx_frame, 0, sizeof(*tx_frame));
+    tx_frame->fctrl    = DW1000_TWR_FCTRL;
+    tx_frame->seq_num  = m_dw1000_ctx.seq_num + 2;
+#if (!CONFIG_DW1000_COMPACT_FRAMES)
+    tx_frame->pan_id   = DW1000_PAN_ID;
+#endif
+    tx_frame->dst_addr = m_dw1000_ctx.tar_addr;
+    tx_frame->src_addr = m_dw1000_ctx.my_addr;
+    tx_frame->code     = DW1000_TWR_CODE_FINAL;
+    return dw1000_stage_tx_frame(tx_frame, sizeof(*tx_frame));
+}
+#endif
+#endif
+
+#if (CONFIG_DW1000_DATA_LINK)
+#define LINK_ACK_TIM (DW1000_BR == DW1000_BR_6800KBPS ? 3 : (DW1000_BR == DW1000_BR_850KBPS ? 2 : 0))
+
+/**
+ * @brief Receiver on time from the end of a data frame to the end of its
+ * acknowledgement, sent ACK_TIM preamble symbols after the data frame.
+ */
+static inline uint32_t dw1000_link_ack_us(void)
+{
+    return (uint32_t)((LINK_ACK_TIM * DW1000_PREAMBLE_SYMBOL_PS(DW1000_PRF) / 1000 +
+        dw1000_frame_airtime_ns(sizeof(union dw1000_ack_msg) + 2, true)) / 1000);
+}
+
+/**
+ * @brief Gap before the next data frame: the anchor reads the whole frame
+ * over SPI before it turns its receiver back on.
+ */
+static inline uint32_t dw1000_link_ifs_us(uint16_t len)
+{
+    size_t flen = offsetof(union dw1000_data_msg, payload) + len + 2;
+    return LINK_IFS_US + (uint32_t)(8ULL * (flen + 1) * 1000000ULL / SPI_SPEED);
+}
+
+/**
+ * @brief Set up the data link: the anchor acknowledges data frames for its
+ * address in hardware, which needs frame filtering, and the tag waits for
+ * the acknowledgement of every frame it sends.
+ */
+static int dw1000_link_config(void)
+{
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+
+    if (dw1000_frame_filter_config(DW1000_PAN_ID, m_dw1000_ctx.my_addr, DW1000_FF_DATA | DW1000_FF_ACK))
+        goto err;
+
+    union DW1000_REG_SYS_CFG *sys_cfg = &m_dw1000_ctx.sys_cfg;
+    sys_cfg->autoack = CONFIG_DW1000_ANCHOR;
+    sys_cfg->rxwtoe  = CONFIG_DW1000_TAG;
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CFG, sys_cfg, sizeof(*sys_cfg), NULL))
         goto err;
 
-    return;
-err:
-    dw1000_trace(ERROR, "%s failed.\n", __func__);
-    return;
-}
+    union DW1000_REG_ACK_RESP_T *ack_resp_t = &m_dw1000_ctx.ack_resp_t;
+    ack_resp_t->w4r_tim = 0;
+    ack_resp_t->ack_tim = LINK_ACK_TIM;
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_ACK_RESP_T, ack_resp_t, sizeof(*ack_resp_t), NULL))
+        goto err;
 
-int driver_dw1000_gpio_init()
-{
-    dw1000_trace(INIT, "%s\n", __func__);
+    union DW1000_REG_RX_FWTO *rx_fwto = &m_dw1000_ctx.rx_fwto;
+    rx_fwto->rxfwto = (uint16_t)(((dw1000_link_ack_us() + RX_FWTO_MARGIN_US) * 1000000ULL + DW1000_RX_FWTO_UNIT_PS - 1) / DW1000_RX_FWTO_UNIT_PS);
+    if (dw1000_non_indexed_write(spi_cfg, DW1000_RX_FWTO, rx_fwto, sizeof(*rx_fwto), NULL))
+        goto err;
 
-    m_dw1000_ctx.gpio_rst_cfg.pin = RSTn_PIN;
-    gpio_init(m_dw1000_ctx.gpio_rst_cfg.pin);
-    gpio_set_dir(m_dw1000_ctx.gpio_rst_cfg.pin, GPIO_OUT);
+    if (dw1000_set_pretoc(0))
+        goto err;
+
+    memset(&m_dw1000_ctx.link, 0, sizeof(m_dw1000_ctx.link));
+    // DW1000_CODE_DATA and DW1000_CODE_DATA_SYN only differ in bit 0
+    struct mac_frame_match *m = &m_dw1000_ctx.link.rx_match;
+    mac_frame_match_init(m, IEEE_802_15_4_FCTRL_DATA_AR_16, DW1000_PAN_ID, m_dw1000_ctx.my_addr);
+    mac_frame_match_byte(m, m->payload_ofs, DW1000_CODE_DATA, 0xFE);
+    dw1000_trace(INFO, "link: ACK_TIM %d, %lu us per acknowledgement, %lu us per full frame\n", LINK_ACK_TIM,
+        dw1000_link_ack_us(), dw1000_frame_airtime_ns(sizeof(union dw1000_data_msg) + 2, true) / 1000);
 
     return 0;
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
+    return -1;
 }
 
-int driver_dw1000_gpio_irq_init()
+#if (CONFIG_DW1000_TAG)
+/**
+ * @brief Pick the frame to send next: the oldest frame whose timer ran out,
+ * else a new frame while the window has room.
+ *
+ * @return The frame, or NULL when there is nothing to send yet.
+ */
+static struct dw1000_link_slot *dw1000_link_next(uint16_t dst_addr, const uint8_t *data, size_t len,
+    size_t *next, bool synced)
 {
-    dw1000_trace(INIT, "%s\n", __func__);
+    struct dw1000_link *link = &m_dw1000_ctx.link;
+    uint64_t now = time_us_64();
+
+    for (uint8_t seq = link->tx_base; seq != link->tx_seq; seq++) {
+        struct dw1000_link_slot *s = &link->tx[seq % LINK_WINDOW];
+        if (!s->acked && !s->queued && (now - s->tx_us >= LINK_RTO_US)) {
+            s->retries++;
+            link->retransmits++;
+            return s;
+        }
+    }
+    if ((*next >= len) || ((uint8_t)(link->tx_seq - link->tx_base) >= (synced ? LINK_WINDOW : 1)))
+        return NULL;
+
+    struct dw1000_link_slot *slot = &link->tx[link->tx_seq % LINK_WINDOW];
+    size_t n = len - *next;
+    if (n > DW1000_DATA_PAYLOAD_MAX)
+        n = DW1000_DATA_PAYLOAD_MAX;
+    struct mac_frame f;
+    if (mac_frame_build(&f, &slot->msg, sizeof(slot->msg), IEEE_802_15_4_FCTRL_DATA_AR_16, link->tx_seq))
+        return NULL;
+    mac_frame_set_dst(&f, DW1000_PAN_ID, dst_addr);
+    mac_frame_set_src(&f, DW1000_PAN_ID, m_dw1000_ctx.my_addr);
+    uint8_t *payload = mac_frame_payload(&f);
+    payload[0] = *next ? DW1000_CODE_DATA : DW1000_CODE_DATA_SYN;
+    memcpy(&payload[1], &data[*next], n);
+    link->tx_seq++;
+    slot->len     = (uint16_t)n;
+    slot->acked   = false;
+    slot->retries = 0;
+    *next += n;
+
+    return slot;
+}
 
-    struct gpio_config *gpio_irq_cfg = &m_dw1000_ctx.gpio_irq_cfg;
-    gpio_irq_cfg->pin        = IRQ_PIN;
-    gpio_irq_cfg->enabled    = true;
-    // gpio_irq_cfg->event_mask = GPIO_IRQ_EDGE_RISE;
-    gpio_irq_cfg->event_mask = GPIO_IRQ_LEVEL_HIGH;
-    gpio_irq_cfg->callback   = dw1000_isr;
+/**
+ * @brief Load frames into the TX queue while it has a free slot and there is
+ * a frame to send.
+ */
+static int dw1000_link_load(uint16_t dst_addr, const uint8_t *data, size_t len, size_t *next, bool synced)
+{
+    struct dw1000_link *link = &m_dw1000_ctx.link;
+#if (LINK_SIM_LOSS_PERMILLE)
+    static struct sim_rand rnd = {.state = 1};
+#endif
+    struct dw1000_link_slot *slot;
 
-    if (gpio_irq_init(gpio_irq_cfg))
-        goto err;
+    while (dw1000_txq_space() && (slot = dw1000_link_next(dst_addr, data, len, next, synced))) {
+        if (slot->retries > LINK_MAX_RETRIES) {
+            dw1000_trace(ERROR, "@@ link: frame %d not acknowledged\n", slot->msg.seq_num);
+            goto err;
+        }
+    #if (LINK_SIM_LOSS_PERMILLE)
+        // A frame for a foreign address costs the same airtime and is never acknowledged
+        if (sim_rand_u32(&rnd) % 1000 < LINK_SIM_LOSS_PERMILLE)
+            slot->msg.dst_addr = (uint16_t)~dst_addr;
+    #endif
+        link->queued[m_dw1000_ctx.txq.loaded % TXQ_SLOTS] = slot;
+        int rc = dw1000_txq_load(&slot->msg, offsetof(union dw1000_data_msg, payload) + slot->len);
+        slot->msg.dst_addr = dst_addr;
+        if (rc)
+            goto err;
+        slot->queued = true;
+    }
 
     return 0;
 err:
@@ -2133,55 +3900,246 @@ err:
     return -1;
 }
 
-int driver_dw1000_spi_init()
+/**
+ * @brief Send a buffer over the data link and return once all of it has been
+ * acknowledged.
+ *
+ * The first frame carries DW1000_CODE_DATA_SYN and goes out alone so that
+ * the receiver starts the stream at its sequence number, after that up to
+ * LINK_WINDOW frames are in flight. Every frame requests an acknowledgement
+ * and the receiver stays on for it right after the frame (WAIT4RESP). A frame
+ * without acknowledgement is sent again once LINK_RTO_US has passed, new
+ * frames go out in the meantime as long as the window is not full. Frames go
+ * through the TX queue, the next one is written to the DW1000 while the
+ * current one is on air and waits for its acknowledgement.
+ *
+ * @retval 0  All data acknowledged.
+ * @retval -1 A frame ran out of retries, or SPI access failed.
+ */
+static int dw1000_link_send(uint16_t dst_addr, const uint8_t *data, size_t len)
 {
-    dw1000_trace(INIT, "%s\n", __func__);
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    volatile union DW1000_REG_SYS_STATUS *sys_status = &m_dw1000_ctx.sys_status;
+    struct dw1000_link *link = &m_dw1000_ctx.link;
+    struct dw1000_tx_queue *txq = &m_dw1000_ctx.txq;
+    bool synced = false;
+    size_t next = 0;
+
+    link->tx_base = link->tx_seq;
+    while ((next < len) || (link->tx_base != link->tx_seq)) {
+        if (dw1000_link_load(dst_addr, data, len, &next, synced))
+            goto err;
+        // Window full, wait for a timer
+        if (txq->loaded == txq->sent)
+            continue;
 
-    struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
-    spi_cfg->spi        = SPI_INST;
-    spi_cfg->spi_speed  = SPI_SPEED;
-    spi_cfg->pin.sck    = SPI0_SCK_PIN;
-    spi_cfg->pin.tx     = SPI0_TX_PIN;
-    spi_cfg->pin.rx     = SPI0_RX_PIN;
-    spi_cfg->pin.csn    = SPI0_CSN_PIN;
-    spi_cfg->slave_mode = false;
+        struct dw1000_link_slot *slot = link->queued[txq->sent % TXQ_SLOTS];
+        slot->queued = false;
+        sys_status->ofs_00.value = 0;
+        slot->tx_us = time_us_64();
+        if (dw1000_txq_start(true))
+            goto err;
+        link->frames++;
 
-    spi_init(spi_cfg->spi, spi_cfg->spi_speed);
-    spi_set_slave(spi_cfg->spi, !!spi_cfg->slave_mode);
-    gpio_set_function(spi_cfg->pin.sck, GPIO_FUNC_SPI);
-    gpio_set_function(spi_cfg->pin.tx, GPIO_FUNC_SPI);
-    gpio_set_function(spi_cfg->pin.rx, GPIO_FUNC_SPI);
-    // gpio_set_function(spi_cfg->pin.csn, GPIO_FUNC_SPI);
+        // The next frame goes into the other slot while this one is on air
+        if (dw1000_link_load(dst_addr, data, len, &next, synced))
+            goto err;
 
-    // Make the SPI pins available to picotool
-    // bi_decl(bi_4pins_with_func(SPI0_RX_PIN, SPI0_TX_PIN, SPI0_SCK_PIN, SPI0_CSN_PIN, GPIO_FUNC_SPI));
-    // bi_decl(bi_3pins_with_func(SPI0_RX_PIN, SPI0_TX_PIN, SPI0_SCK_PIN, GPIO_FUNC_SPI));
+        // Counted from the end of the TX buffer write, which takes milliseconds for a long frame
+        uint64_t deadline = time_us_64() + LINK_ACK_WAIT_US;
+        while (!(sys_status->ofs_00.value & (DW1000_SYS_STS_RXFCG | DW1000_SYS_STS_RX_TO)) && (time_us_64() < deadline))
+            ;
 
-    // Chip select is active-low, so we'll initialise it to a driven-high state
-    gpio_init(spi_cfg->pin.csn);
-    gpio_put(spi_cfg->pin.csn, 1);
-    gpio_set_dir(spi_cfg->pin.csn, GPIO_OUT);
+        bool acked = false;
+        if (sys_status->ofs_00.rxfcg) {
+            union DW1000_REG_RX_FINFO rx_finfo;
+            union dw1000_ack_msg ack;
+            if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
+                goto err;
+            if (dw1000_rx_frame_len(&rx_finfo) == sizeof(ack) + 2) {
+                if (dw1000_read_rx_frame(&rx_finfo, &ack, sizeof(ack)) < 0)
+                    goto err;
+                // Any frame in flight, the acknowledgement of an earlier try may come late
+                struct dw1000_link_slot *s = &link->tx[ack.seq_num % LINK_WINDOW];
+                if ((ack.fctrl == IEEE_802_15_4_FCTRL_ACK) &&
+                    ((uint8_t)(ack.seq_num - link->tx_base) < (uint8_t)(link->tx_seq - link->tx_base)) && !s->acked) {
+                    s->acked = acked = true;
+                    link->bytes += s->len;
+                    if (s->msg.code == DW1000_CODE_DATA_SYN)
+                        synced = true;
+                }
+            }
+        } else if (!(sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO)) {
+            union DW1000_REG_SYS_CTRL sys_ctrl = {.trxoff = 1};
+            if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CTRL, &sys_ctrl, sizeof(sys_ctrl), NULL))
+                goto err;
+        }
+        if (!acked)
+            link->timeouts++;
+        if (dw1000_txq_recover())
+            goto err;
+        sys_status->ofs_00.value = 0;
 
-    // Make the CS pin available to picotool
-    // bi_decl(bi_1pin_with_name(SPI0_CSN_PIN, "SPI CS"));
+        while ((link->tx_base != link->tx_seq) && link->tx[link->tx_base % LINK_WINDOW].acked)
+            link->tx_base++;
+
+        busy_wait_us(dw1000_link_ifs_us(slot->len));
+    }
 
     return 0;
 err:
     dw1000_trace(ERROR, "%s failed\n", __func__);
     return -1;
 }
+#endif
 
-void dw1000_ctx_init()
+#if (CONFIG_DW1000_ANCHOR)
+/**
+ * @brief Hand received payload to the application in stream order. The
+ * bench stream is a counting byte pattern, which is checked here.
+ */
+static void dw1000_link_deliver(const uint8_t *payload, size_t len)
 {
-    memset(&m_dw1000_ctx, 0, sizeof(m_dw1000_ctx));
-    m_dw1000_ctx.lde_run_enable = true;
-#if (CONFIG_DW1000_TAG)
-    m_dw1000_ctx.my_addr = 0xAA;
+    struct dw1000_link *link = &m_dw1000_ctx.link;
+    for (size_t i = 0; i < len; i++) {
+        if (payload[i] != (uint8_t)link->rx_offset)
+            link->bad_bytes++;
+        link->rx_offset++;
+    }
+    link->bytes += len;
+}
+
+/**
+ * @brief Take one data frame, already acknowledged in hardware, into the
+ * receive window and deliver what has become contiguous.
+ *
+ * The sender never has a frame in flight more than LINK_WINDOW ahead of the
+ * next one to deliver, so anything further away is a frame delivered before
+ * whose acknowledgement was lost.
+ */
+static void dw1000_link_receive(const union dw1000_data_msg *msg, size_t len)
+{
+    struct dw1000_link *link = &m_dw1000_ctx.link;
+
+    if (msg->code == DW1000_CODE_DATA_SYN) {
+        if (!link->rx_synced || (msg->seq_num != (uint8_t)(link->rx_next - 1))) {
+            for (int i = 0; i < LINK_WINDOW; i++)
+                link->rx[i].valid = false;
+            link->rx_next   = msg->seq_num;
+            link->rx_offset = 0;
+            link->rx_synced = true;
+        }
+    }
+    if (!link->rx_synced)
+        return;
+
+    struct dw1000_link_slot *slot = &link->rx[msg->seq_num % LINK_WINDOW];
+    if (((uint8_t)(msg->seq_num - link->rx_next) >= LINK_WINDOW) || slot->valid) {
+        link->duplicates++;
+        return;
+    }
+    memcpy(&slot->msg, msg, len);
+    slot->len   = (uint16_t)(len - offsetof(union dw1000_data_msg, payload));
+    slot->valid = true;
+
+    for (slot = &link->rx[link->rx_next % LINK_WINDOW]; slot->valid; slot = &link->rx[link->rx_next % LINK_WINDOW]) {
+        dw1000_link_deliver(slot->msg.payload, slot->len);
+        slot->valid = false;
+        link->rx_next++;
+    }
+}
 #endif
-#if (CONFIG_DW1000_ANCHOR)
-    m_dw1000_ctx.my_addr = 0xCC;
+
+/**
+ * @brief Data link goodput: the tag streams LINK_BENCH_BYTES to the anchor
+ * over and over, with LINK_SIM_LOSS_PERMILLE of the frames lost, and both
+ * sides print the goodput against the PHY data rate.
+ */
+static void dw1000_link_bench(void)
+{
+    struct dw1000_link *link = &m_dw1000_ctx.link;
+    // Nominal data rate, the Reed-Solomon parity takes 48 of every 378 bits
+    const double phy_kbps = 1e9 / (double)DW1000_DATA_SYMBOL_PS(DW1000_BR) *
+        DW1000_RS_BLOCK_BITS / (DW1000_RS_BLOCK_BITS + DW1000_RS_PARITY_BITS);
+
+    if (dw1000_link_config())
+        return;
+
+#if (CONFIG_DW1000_TAG)
+    static uint8_t data[LINK_BENCH_BYTES];
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (uint8_t)i;
+
+    while (1) {
+        uint64_t bytes = link->bytes;
+        uint32_t frames = link->frames, retransmits = link->retransmits, timeouts = link->timeouts;
+        uint32_t overlapped = m_dw1000_ctx.txq.overlapped, recovered = m_dw1000_ctx.txq.recovered;
+        uint64_t t_start = time_us_64();
+        if (dw1000_link_send(LINK_PEER_ADDR, data, sizeof(data)))
+            goto err;
+        uint64_t t_us = time_us_64() - t_start;
+        double kbps = (double)(link->bytes - bytes) * 8.0 * 1000.0 / (double)t_us;
+        dw1000_trace(INFO, "@@ link tx: %llu bytes in %llu us, %.0lf kbps (%.1lf%% of %.0lf kbps), %lu frames, %lu retransmitted, %lu unacknowledged, %lu loaded on air, %lu TXFRS missed\n",
+            link->bytes - bytes, t_us, kbps, 100.0 * kbps / phy_kbps, phy_kbps,
+            link->frames - frames, link->retransmits - retransmits, link->timeouts - timeouts,
+            m_dw1000_ctx.txq.overlapped - overlapped, m_dw1000_ctx.txq.recovered - recovered);
+        sleep_ms(LINK_REPORT_MS);
+    }
+#else
+    const struct spi_config *spi_cfg = &m_dw1000_ctx.spi_cfg;
+    volatile union DW1000_REG_SYS_STATUS *sys_status = &m_dw1000_ctx.sys_status;
+    static union dw1000_data_msg msg;
+    uint64_t t_report = time_us_64(), bytes = 0;
+
+    if (dw1000_rx_start(spi_cfg))
+        goto err;
+    while (1) {
+        if (sys_status->ofs_00.rxfcg) {
+            bool aat = sys_status->ofs_00.aat;
+            sys_status->ofs_00.value = 0;
+            uint64_t t_rx = time_us_64();
+
+            union DW1000_REG_RX_FINFO rx_finfo;
+            if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
+                goto err;
+            size_t len = dw1000_rx_frame_len(&rx_finfo) - 2;
+            if ((len > offsetof(union dw1000_data_msg, payload)) && (len <= sizeof(msg))) {
+                int rc = dw1000_read_rx_frame_match(&link->rx_match, &msg, len);
+                if (rc < 0)
+                    goto err;
+                if (rc)
+                    dw1000_link_receive(&msg, len);
+            }
+            // Turning the receiver on would cut the acknowledgement short
+            if (aat) {
+                while (time_us_64() - t_rx < dw1000_link_ack_us())
+                    ;
+            }
+            if (dw1000_rx_start(spi_cfg))
+                goto err;
+        } else if (sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO) {
+            sys_status->ofs_00.value = 0;
+            if (dw1000_rx_start(spi_cfg))
+                goto err;
+        }
+
+        uint64_t now = time_us_64();
+        if (now - t_report >= LINK_REPORT_MS * 1000) {
+            if (link->bytes != bytes) {
+                double kbps = (double)(link->bytes - bytes) * 8.0 * 1000.0 / (double)(now - t_report);
+                dw1000_trace(INFO, "@@ link rx: %.0lf kbps (%.1lf%% of %.0lf kbps), %llu bytes, %lu duplicates, %lu bad bytes\n",
+                    kbps, 100.0 * kbps / phy_kbps, phy_kbps, link->bytes, link->duplicates, link->bad_bytes);
+            }
+            bytes    = link->bytes;
+            t_report = now;
+        }
+    }
 #endif
+
+err:
+    dw1000_trace(ERROR, "%s failed\n", __func__);
 }
+#endif
 
 void dw1000_unit_test()
 {
@@ -2203,6 +4161,23 @@ void dw1000_unit_test()
     if (dw1000_dump_all_regs(spi_cfg))
         goto err;
 
+#if (CONFIG_DW1000_TWR_BENCH)
+    dw1000_ds_twr_bench();
+#endif
+
+#if (CONFIG_DW1000_FRAME_BENCH)
+    dw1000_frame_bench();
+#endif
+
+#if (CONFIG_DW1000_DATA_LINK)
+    dw1000_link_bench();
+    return;
+#endif
+
+#if (CONFIG_DW1000_SESSION)
+    m_dw1000_ctx.stats.t_start_us = time_us_64();
+#endif
+
 #if (CONFIG_DW1000_ANCHOR)
     union DW1000_REG_RX_TIME rx_time;
     uint64_t t_reply_1, t_reply_2, t_round_1, t_round_2, t_round_1_adj, t_round_2_adj;
@@ -2220,7 +4195,8 @@ void dw1000_unit_test()
                 if (dw1000_init(false))
                     goto err;
             }
-        #else
+        #elif (!CONFIG_DW1000_EXT_SYNC)
+            // A hard reset would drop the timebase the SYNC line aligned
             if (dw1000_init(false))
                 goto err;
         #endif
@@ -2235,6 +4211,13 @@ void dw1000_unit_test()
         #endif
                 dw1000_trace(INFO, "-> listen\n");
 
+        #if (CONFIG_DW1000_PRESTAGE_TX)
+            if (dw1000_stage_resp_msg())
+                goto err;
+        #endif
+            // Listen for as long as it takes
+            if (dw1000_set_pretoc(0))
+                goto err;
             if (dw1000_rx_start(spi_cfg))
                 goto err;
 
@@ -2245,6 +4228,16 @@ void dw1000_unit_test()
         // Discovery phase
         case DW1000_DS_TWR_STATE_LISTEN:
         {
+        #if (CONFIG_DW1000_EXT_SYNC) && (CONFIG_DW1000_EXT_SYNC_MASTER) && \
+            !((CONFIG_DW1000_CLOCK_SYNC) && (CONFIG_DW1000_SYNC_REFERENCE))
+            dw1000_ext_sync_poll();
+        #endif
+        #if (CONFIG_DW1000_CLOCK_SYNC) && (CONFIG_DW1000_SYNC_REFERENCE)
+            if (time_us_64() >= m_dw1000_ctx.sync.next_tx_us) {
+                if (dw1000_clock_sync_send())
+                    goto err;
+            }
+        #endif
             if (sys_status->ofs_00.rxfcg) {
                 sys_status->ofs_00.value = 0;
 
@@ -2260,26 +4253,87 @@ void dw1000_unit_test()
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_TIME, &rx_time, sizeof(rx_time), NULL))
                     goto err;
                 // print_buf(&rx_time, sizeof(rx_time), "rx_time:\n");
+            #if (!CONFIG_DW1000_TDOA)
                 uint64_t rx_rawst = ((uint64_t)rx_time.rx_rawst_h << 24) | (uint64_t)rx_time.rx_rawst_l;
                 dw1000_trace(INFO, "rx_stamp: %10llx\n", rx_time.rx_stamp);
                 dw1000_trace(INFO, "rx_rawst: %10llx\n", rx_rawst);
+            #endif
 
                 union DW1000_REG_RX_FINFO rx_finfo;
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
                     goto err;
-                dw1000_trace(INFO, "rxflen:%d\n", rx_finfo.rxflen);
 
                 union ieee_blink_frame *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, rx_finfo.rxflen, NULL))
+                int rx_len = dw1000_read_rx_frame(&rx_finfo, rx_frame, sizeof(m_dw1000_ctx.rx_buf));
+                if (rx_len < 0)
                     goto err;
-                print_buf(rx_frame, rx_finfo.rxflen, "blink frame:\n");
+            #if (!CONFIG_DW1000_TDOA)
+                dw1000_trace(INFO, "rxflen:%d\n", dw1000_rx_frame_len(&rx_finfo));
+                print_buf(rx_frame, rx_len, "blink frame:\n");
+            #endif
             // #endif
+            #if (CONFIG_DW1000_TDOA)
+            #if (CONFIG_DW1000_CLOCK_SYNC) && (!CONFIG_DW1000_SYNC_REFERENCE)
+                union dw1000_sync_msg *sync_frame = (void *)rx_frame;
+                if ((dw1000_rx_frame_len(&rx_finfo) == sizeof(union dw1000_sync_msg) + 2) &&
+                    (sync_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16) &&
+                    (sync_frame->code == DW1000_CODE_CLOCK_SYNC)) {
+                    uint64_t ref_ts = 0;
+                    memcpy(&ref_ts, sync_frame->tx_stamp, sizeof(sync_frame->tx_stamp));
+                    m_dw1000_ctx.sync.ref_addr = sync_frame->src_addr;
+                #if (CONFIG_DW1000_EXT_SYNC)
+                    dw1000_ext_sync_bench(rx_time.rx_stamp, ref_ts);
+                #else
+                    dw1000_clock_sync_update(rx_time.rx_stamp, ref_ts);
+                #endif
+                }
+            #endif
+                // Timestamp the blink and keep listening, there is no ranging exchange
+                struct tdoa_record rec;
+                if (!tdoa_record_from_blink(&rec, (const uint8_t *)rx_frame, dw1000_rx_frame_len(&rx_finfo))) {
+                    rec.rx_stamp  = rx_time.rx_stamp;
+                    rec.anchor_id = m_dw1000_ctx.my_addr;
+                    rec.fp_power  = (int16_t)lroundf(dw1000_cal_first_path_power_level() * 100.0f);
+                    rec.rx_power  = (int16_t)lroundf(dw1000_cal_rx_power_level() * 100.0f);
+                #if (CONFIG_DW1000_CLOCK_SYNC)
+                    dw1000_clock_sync_to_ref(rec.rx_stamp, &rec.ref_stamp);
+                #elif (CONFIG_DW1000_EXT_SYNC)
+                    rec.ref_stamp = rec.rx_stamp;
+                #endif
+                    dw1000_tdoa_emit(&rec);
+                #if (CONFIG_DW1000_SESSION)
+                    dw1000_session_fix();
+                #endif
+                }
+                if (dw1000_rx_start(spi_cfg))
+                    goto err;
+                break;
+            #endif
                 if (rx_frame->fctrl == IEEE_802_15_4_BLINK_CCP_64) {
                     m_dw1000_ctx.tar_addr = rx_frame->long_address;
                     m_dw1000_ctx.seq_num  = rx_frame->seq_num;
                     dw1000_trace(INFO, "-> ranging init %d\n", m_dw1000_ctx.seq_num);
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RANGING_INIT;
-                } else {
+                }
+            #if (CONFIG_DW1000_SESSION)
+                // A paired tag polls directly without blinking first
+                else if ((dw1000_rx_frame_len(&rx_finfo) == sizeof(union dw1000_poll_msg) + 2) &&
+                         dw1000_twr_frame_match(rx_frame, -1, DW1000_TWR_CODE_POLL)) {
+                    union dw1000_poll_msg *poll = (void *)rx_frame;
+                #if (!CONFIG_DW1000_ANCHOR_LISTEN_TO)
+                    m_dw1000_ctx.sys_cfg.rxwtoe = true;
+                    if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CFG, &m_dw1000_ctx.sys_cfg, sizeof(m_dw1000_ctx.sys_cfg), NULL))
+                        goto err;
+                #endif
+                    t_poll_rx = rx_time.rx_stamp;
+                    m_dw1000_ctx.tar_addr = poll->src_addr;
+                    m_dw1000_ctx.seq_num  = poll->seq_num;
+                    m_dw1000_ctx.stats.attempts++;
+                    dw1000_trace(PERF, "-> resp %d\n", m_dw1000_ctx.seq_num);
+                    m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RESPONSE;
+                }
+            #endif
+                else {
                     dw1000_trace(WARN, "@@ invalid blink\n");
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
                 }
@@ -2300,17 +4354,28 @@ void dw1000_unit_test()
             if (dw1000_non_indexed_write(spi_cfg, DW1000_SYS_CFG, &m_dw1000_ctx.sys_cfg, sizeof(m_dw1000_ctx.sys_cfg), NULL))
                 goto err;
         #endif
+            // The tag polls TX_DELAY_US after receiving the ranging init
+            if (dw1000_open_reply_window(CONFIG_DW1000_DELAY_TX ? TX_DELAY_US : RX_FWTO_SW_REPLY_US, CONFIG_DW1000_DELAY_TX,
+                    sizeof(union dw1000_rng_init_msg) + 2, sizeof(union dw1000_poll_msg) + 2))
+                goto err;
             union dw1000_rng_init_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
-            tx_frame->fctrl    = IEEE_802_15_4_FCTRL_RANGE_16;
+            tx_frame->fctrl    = DW1000_TWR_FCTRL;
             tx_frame->seq_num  = ++m_dw1000_ctx.seq_num;
+        #if (!CONFIG_DW1000_COMPACT_FRAMES)
             tx_frame->pan_id   = DW1000_PAN_ID;
+        #endif
             tx_frame->dst_addr = m_dw1000_ctx.tar_addr;
             tx_frame->src_addr = m_dw1000_ctx.my_addr;
             tx_frame->code     = DW1000_TWR_CODE_RNG_INIT;
 
             dw1000_trace(PERF, "-> poll wait %d\n", m_dw1000_ctx.seq_num);
             m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_POLL_WAIT;
-            tx_frame->tx_delay_ms = TX_DELAY_MS;
+            tx_frame->tx_delay_us = TX_DELAY_US;
+        #if (CONFIG_DW1000_SESSION)
+            tx_frame->period_ms   = SESSION_PERIOD_MS;
+        #else
+            tx_frame->period_ms   = 0;
+        #endif
         // #if (CONFIG_DW1000_DELAY_TX)
         //     uint64_t dx_time = rx_time.rx_stamp + DX_TIME_MS(TX_DELAY_MS);
         //     dw1000_trace(PERF, " dx_time: %10llx, %llx\n", dx_time, DX_TIME_MS(TX_DELAY_MS));
@@ -2322,6 +4387,13 @@ void dw1000_unit_test()
         }
         case DW1000_DS_TWR_STATE_POLL_WAIT:
         {
+        #if (CONFIG_DW1000_PRESTAGE_TX)
+            // The ranging init has left the TX buffer, stage the response
+            if (!m_dw1000_ctx.tx_staged && m_dw1000_ctx.tx_done) {
+                if (dw1000_stage_resp_msg())
+                    goto err;
+            }
+        #endif
             if (sys_status->ofs_00.rxfcg) {
                 sys_status->ofs_00.value = 0;
 
@@ -2331,36 +4403,39 @@ void dw1000_unit_test()
                 dw1000_trace(PERF, "rx_stamp: %llx\n", t_poll_rx);
 
                 union dw1000_poll_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, sizeof(union dw1000_poll_msg), NULL))
+                int match = dw1000_read_twr_frame(sizeof(union dw1000_poll_msg), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_POLL);
+                if (match < 0)
                     goto err;
             #else
                 union DW1000_REG_RX_FINFO rx_finfo;
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
                     goto err;
-                dw1000_trace(INFO, "rxflen:%d\n", rx_finfo.rxflen);
+                dw1000_trace(INFO, "rxflen:%d\n", dw1000_rx_frame_len(&rx_finfo));
 
                 union dw1000_poll_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, rx_finfo.rxflen, NULL))
+                int match = dw1000_read_twr_frame(dw1000_rx_frame_len(&rx_finfo), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_POLL);
+                if (match < 0)
                     goto err;
-                print_buf(rx_frame, rx_finfo.rxflen, "poll frame:\n");
+                if (match)
+                    print_buf(rx_frame, match, "poll frame:\n");
             #endif
 
-                if ((rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16) &&
-                    ((m_dw1000_ctx.seq_num + 1) == rx_frame->seq_num) &&
-                    (rx_frame->code == DW1000_TWR_CODE_POLL) &&
-                    (rx_frame->dst_addr == m_dw1000_ctx.my_addr)) {
+                if (match) {
                     m_dw1000_ctx.tar_addr = rx_frame->src_addr;
                     m_dw1000_ctx.seq_num  = rx_frame->seq_num;
+                #if (CONFIG_DW1000_SESSION)
+                    m_dw1000_ctx.stats.attempts++;
+                #endif
                     dw1000_trace(PERF, "-> resp %d,%d\n", m_dw1000_ctx.seq_num);
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RESPONSE;
                 } else {
-                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16),
+                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == DW1000_TWR_FCTRL),
                         (m_dw1000_ctx.seq_num + 1), rx_frame->seq_num,
                         (rx_frame->code == DW1000_TWR_CODE_POLL),
                         (rx_frame->dst_addr == m_dw1000_ctx.my_addr));
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
                 }
-            } else if (sys_status->ofs_00.rxrfto) {
+            } else if (sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO) {
                 sys_status->ofs_00.value = 0;
                 m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
             }
@@ -2372,27 +4447,96 @@ void dw1000_unit_test()
         case DW1000_DS_TWR_STATE_RESPONSE:
         {
             union dw1000_resp_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
-            tx_frame->fctrl    = IEEE_802_15_4_FCTRL_RANGE_16;
+            tx_frame->fctrl    = DW1000_TWR_FCTRL;
             tx_frame->seq_num  = ++m_dw1000_ctx.seq_num;
+        #if (!CONFIG_DW1000_COMPACT_FRAMES)
             tx_frame->pan_id   = DW1000_PAN_ID;
+        #endif
             tx_frame->dst_addr = m_dw1000_ctx.tar_addr;
             tx_frame->src_addr = m_dw1000_ctx.my_addr;
             tx_frame->code     = DW1000_TWR_CODE_RESP;
+        #if (!CONFIG_DW1000_SS_TWR)
+            // The tag sends the final TX_DELAY_US after receiving the response
+            if (dw1000_open_reply_window(CONFIG_DW1000_DELAY_TX ? TX_DELAY_US : RX_FWTO_SW_REPLY_US, CONFIG_DW1000_DELAY_TX,
+                    sizeof(union dw1000_resp_msg) + 2, sizeof(union dw1000_final_msg) + 2))
+                goto err;
+        #endif
+        #if (CONFIG_DW1000_RANGE_REPORT)
+            // Range of the previous exchange with this tag, tof_seq lets the tag check its age
+            bool report = (m_dw1000_ctx.tof_addr == m_dw1000_ctx.tar_addr);
+            tx_frame->tof      = report ? m_dw1000_ctx.tof_q8 : 0;
+            tx_frame->tof_seq  = report ? m_dw1000_ctx.tof_seq : 0;
+        #endif
 
         #if (CONFIG_DW1000_DELAY_TX)
-            dx_time = t_poll_rx + DX_TIME_MS(TX_DELAY_MS);
+            // With DX_RX_FINAL the receiver is turned on for the final from FINAL_WAIT instead
+            bool wait4resp = !CONFIG_DW1000_SS_TWR && !CONFIG_DW1000_DX_RX_FINAL;
+            dx_time = t_poll_rx + DX_TIME_US(TX_DELAY_US);
+        #if (CONFIG_DW1000_PREDICT_TX_TS)
+            t_resp_tx = dw1000_predict_tx_stamp(dx_time);
+        #else
             m_dw1000_ctx.catch_resp_txtfs = true;
-            dw1000_trace(PERF, " dx_time: %10llx, %llx\n", dx_time, DX_TIME_MS(TX_DELAY_MS));
-            dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, true);
+        #endif
+        #if (CONFIG_DW1000_SS_TWR)
+            tx_frame->t_reply = (uint32_t)(t_resp_tx - t_poll_rx);
+        #endif
+            dw1000_trace(PERF, " dx_time: %10llx, %llx\n", dx_time, DX_TIME_US(TX_DELAY_US));
+        #if (CONFIG_DW1000_PRESTAGE_TX)
+            if (m_dw1000_ctx.tx_staged) {
+                // Only seq_num and dst_addr differ from the staged response
+                size_t ofs = offsetof(union dw1000_resp_msg, seq_num);
+                if (dw1000_patch_tx_frame(ofs, &m_dw1000_ctx.tx_buf[ofs], offsetof(union dw1000_resp_msg, src_addr) - ofs))
+                    goto err;
+            #if (CONFIG_DW1000_RANGE_REPORT)
+                ofs = offsetof(union dw1000_resp_msg, tof);
+                if (dw1000_patch_tx_frame(ofs, &m_dw1000_ctx.tx_buf[ofs], sizeof(tx_frame->tof) + sizeof(tx_frame->tof_seq)))
+                    goto err;
+            #endif
+            #if (CONFIG_DW1000_SS_TWR)
+                ofs = offsetof(union dw1000_resp_msg, t_reply);
+                if (dw1000_patch_tx_frame(ofs, &m_dw1000_ctx.tx_buf[ofs], sizeof(tx_frame->t_reply)))
+                    goto err;
+            #endif
+                dw1000_start_staged_tx(dx_time, wait4resp);
+            } else
+        #endif
+                dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, wait4resp);
+        #if (CONFIG_DW1000_DX_RX_FINAL)
+            final_rx_armed = true;
+        #endif
         #else
             dw1000_transmit_message(tx_frame, sizeof(*tx_frame), true);
         #endif
+        #if (CONFIG_DW1000_SS_TWR)
+            // The range is computed by the tag, there is no final message
+        #if (CONFIG_DW1000_SESSION)
+            dw1000_session_fix();
+        #endif
+            m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
+        #else
             dw1000_trace(PERF, "-> final wait %d\n", m_dw1000_ctx.seq_num);
             m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_FINAL_WAIT;
+        #endif
             break;
         }
         case DW1000_DS_TWR_STATE_FINAL_WAIT:
         {
+        #if (CONFIG_DW1000_DX_RX_FINAL)
+            /**
+             * The response is out, turn the receiver on where W4R_TIM would:
+             * W4R_GUARD_US before the preamble of the final, which the tag
+             * sends TX_DELAY_US after the response. The reply window set up
+             * in RESPONSE runs from there.
+             */
+            if (final_rx_armed && m_dw1000_ctx.tx_done && !(sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO)) {
+                final_rx_armed = false;
+                uint32_t shr_ns = dw1000_frame_airtime_ns(sizeof(union dw1000_final_msg) + 2, true) -
+                    dw1000_frame_airtime_ns(sizeof(union dw1000_final_msg) + 2, false);
+                uint64_t rx_time = t_resp_tx + DX_TIME_US(TX_DELAY_US) - DX_TIME_NS(shr_ns) - DX_TIME_US(W4R_GUARD_US);
+                if (dw1000_delayed_rx_start(rx_time & DW1000_TIMESTAMP_MASK))
+                    goto err;
+            }
+        #endif
             if (sys_status->ofs_00.rxfcg) {
                 sys_status->ofs_00.value = 0;
 
@@ -2402,24 +4546,24 @@ void dw1000_unit_test()
                 dw1000_trace(PERF, "rx_stamp: %llx\n", t_final_rx);
 
                 union dw1000_final_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, sizeof(union dw1000_final_msg), NULL))
+                int match = dw1000_read_twr_frame(sizeof(union dw1000_final_msg), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_FINAL);
+                if (match < 0)
                     goto err;
             #else
                 union DW1000_REG_RX_FINFO rx_finfo;
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
                     goto err;
-                dw1000_trace(INFO, "rxflen:%d\n", rx_finfo.rxflen);
+                dw1000_trace(INFO, "rxflen:%d\n", dw1000_rx_frame_len(&rx_finfo));
 
                 union dw1000_final_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, rx_finfo.rxflen, NULL))
+                int match = dw1000_read_twr_frame(dw1000_rx_frame_len(&rx_finfo), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_FINAL);
+                if (match < 0)
                     goto err;
-                print_buf(rx_frame, rx_finfo.rxflen, "final frame:\n");
+                if (match)
+                    print_buf(rx_frame, match, "final frame:\n");
             #endif
 
-                if ((rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16) &&
-                    ((m_dw1000_ctx.seq_num + 1) == rx_frame->seq_num) &&
-                    (rx_frame->code == DW1000_TWR_CODE_FINAL) &&
-                    (rx_frame->dst_addr == m_dw1000_ctx.my_addr)) {
+                if (match) {
                     m_dw1000_ctx.tar_addr = rx_frame->src_addr;
                     m_dw1000_ctx.seq_num  = rx_frame->seq_num;
                     pico_set_led(led_out);
@@ -2430,7 +4574,11 @@ void dw1000_unit_test()
                     t_reply_1 = (uint64_t)(t_resp_tx - t_poll_rx);
                     t_round_2 = (uint64_t)(t_final_rx - t_resp_tx);
                     // For close-up los workaround
+                #if (CONFIG_DW1000_FIXED_POINT_TWR)
+                    if (twr_u128_lt(twr_u128_mul(t_round_1, t_round_2), twr_u128_mul(t_reply_1, t_reply_2))) {
+                #else
                     if (t_round_1 * t_round_2 < t_reply_1 * t_reply_2) {
+                #endif
                         t_round_1_adj = (t_round_1 < t_reply_2 ? t_reply_2 + 1 : t_round_1);
                         t_round_2_adj = (t_round_2 < t_reply_1 ? t_reply_1 + 1 : t_round_2);
                     } else {
@@ -2439,24 +4587,50 @@ void dw1000_unit_test()
                     }
                     dw1000_trace(INFO, " t_round_1: %10llx, %10llx\n", t_round_1, t_round_1_adj);
                     dw1000_trace(INFO, " t_reply_2: %10llx\n", t_reply_2);
-                    dw1000_trace(INFO, " t_reply_1: %10llx, %10llx\n", t_reply_1, DX_TIME_MS(TX_DELAY_MS));
+                    dw1000_trace(INFO, " t_reply_1: %10llx, %10llx\n", t_reply_1, DX_TIME_US(TX_DELAY_US));
                     dw1000_trace(INFO, " t_round_2: %10llx, %10llx\n", t_round_2, t_round_2_adj);
 
+                #if (CONFIG_DW1000_FIXED_POINT_TWR)
+                    uint32_t tof_q8 = twr_ds_tof_q8(t_round_1_adj, t_reply_1, t_round_2_adj, t_reply_2);
+                    dw1000_trace(INFO, " t_prop   : %lu/256\n", tof_q8);
+                    dw1000_trace(INFO, " dist     : %lu mm\n", dw1000_tof_q8_to_mm(tof_q8));
+                #if (CONFIG_DW1000_RANGE_FILTER)
+                    dw1000_range_publish(m_dw1000_ctx.tar_addr, (float)tof_q8 * (float)DW1000_MM_PER_TICK_Q16 / (256.0f * 65536.0f));
+                #endif
+                #if (CONFIG_DW1000_RANGE_REPORT)
+                    m_dw1000_ctx.tof_q8 = tof_q8;
+                #endif
+                #else
                     dw1000_trace(INFO, " t1: %lf\n", (double)((t_round_1_adj * t_round_2_adj) - (t_reply_1 * t_reply_2)));
                     dw1000_trace(INFO, " t2: %lf\n", (double)(t_round_1_adj + t_round_2_adj + t_reply_1 + t_reply_2));
 
                     double t_prop = (double)((t_round_1_adj * t_round_2_adj) - (t_reply_1 * t_reply_2)) / (double)(t_round_1_adj + t_round_2_adj + t_reply_1 + t_reply_2);
                     dw1000_trace(INFO, " t_prop   : %lf\n", t_prop);
                     dw1000_trace(INFO, " dist     : %lf cm\n", (((double)SPEED_OF_LIGHT * (double)t_prop * 100.0) / (double)DW1000_SAMPLING_CLOCK));
+                #if (CONFIG_DW1000_RANGE_FILTER)
+                    dw1000_range_publish(m_dw1000_ctx.tar_addr, (float)(t_prop * (double)DW1000_MM_PER_TICK_Q16 / 65536.0));
+                #endif
+                #if (CONFIG_DW1000_RANGE_REPORT)
+                    m_dw1000_ctx.tof_q8 = t_prop > 0 ? (uint32_t)lround(t_prop * 256.0) : 0;
+                #endif
+                #endif
+                #if (CONFIG_DW1000_RANGE_REPORT)
+                    // Reported to the tag in the next response
+                    m_dw1000_ctx.tof_addr = m_dw1000_ctx.tar_addr;
+                    m_dw1000_ctx.tof_seq  = m_dw1000_ctx.seq_num;
+                #endif
+                #if (CONFIG_DW1000_SESSION)
+                    dw1000_session_fix();
+                #endif
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
                 } else {
-                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16),
+                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == DW1000_TWR_FCTRL),
                         (m_dw1000_ctx.seq_num + 1), rx_frame->seq_num,
                         (rx_frame->code == DW1000_TWR_CODE_FINAL),
                         (rx_frame->dst_addr == m_dw1000_ctx.my_addr));
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
                 }
-            } else if (sys_status->ofs_00.rxrfto) {
+            } else if (sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO) {
                 sys_status->ofs_00.value = 0;
                 m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_RX_INIT;
             }
@@ -2479,14 +4653,49 @@ void dw1000_unit_test()
         switch (m_dw1000_ctx.twr_state) {
         case DW1000_DS_TWR_STATE_TX_INIT:
         {
+        #if (CONFIG_DW1000_SESSION)
+            /**
+             * Keep an absolute cadence: the time spent in the previous
+             * exchange is part of the period rather than added to it.
+             */
+            uint64_t now = time_us_64();
+            if (m_dw1000_ctx.next_fix_us > now)
+                sleep_us(m_dw1000_ctx.next_fix_us - now);
+            else
+                m_dw1000_ctx.next_fix_us = now;
+        #if (CONFIG_DW1000_ADAPTIVE_RATE)
+            uint16_t period_ms = m_dw1000_ctx.rate.period_ms ? m_dw1000_ctx.rate.period_ms : m_dw1000_ctx.period_ms;
+        #else
+            uint16_t period_ms = m_dw1000_ctx.period_ms;
+        #endif
+        #if (CONFIG_DW1000_BLINK_BACKOFF)
+            uint32_t blink_us = backoff_delay_us(&m_dw1000_ctx.blink_backoff, get_rand_32());
+        #else
+            uint32_t blink_us = SESSION_DISCOVERY_PERIOD_MS * 1000;
+        #endif
+            m_dw1000_ctx.next_fix_us += m_dw1000_ctx.paired ? (uint64_t)period_ms * 1000 : blink_us;
+            m_dw1000_ctx.stats.attempts++;
+        #else
             sleep_ms(1000);
+        #endif
         #if (CONFIG_DW1000_REINIT)
             if (dw1000_init(false))
                 goto err;
         #endif
-            dw1000_trace(INFO, "-> blink %d\n", m_dw1000_ctx.seq_num);
             pico_set_led(led_out);
             led_out = !led_out;
+        #if (CONFIG_DW1000_SESSION)
+            if (m_dw1000_ctx.paired) {
+            #if (CONFIG_DW1000_MULTILAT)
+                m_dw1000_ctx.tar_addr = dw1000_multilat_next_anchor();
+            #endif
+                dw1000_trace(PERF, "-> poll %d\n", m_dw1000_ctx.seq_num);
+                m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_POLL;
+                break;
+            }
+            m_dw1000_ctx.stats.discoveries++;
+        #endif
+            dw1000_trace(INFO, "-> blink %d\n", m_dw1000_ctx.seq_num);
             m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_BLINK;
             break;
         }
@@ -2498,6 +4707,18 @@ void dw1000_unit_test()
             tx_frame->seq_num      = ++m_dw1000_ctx.seq_num;
             tx_frame->long_address = m_dw1000_ctx.my_addr;
 
+        #if (CONFIG_DW1000_TDOA)
+            // A single blink per fix, the anchors timestamp it
+            dw1000_transmit_message(tx_frame, sizeof(*tx_frame), false);
+        #if (CONFIG_DW1000_SESSION)
+            dw1000_session_fix();
+        #endif
+            m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
+            break;
+        #endif
+            // The anchor answers from its main loop
+            if (dw1000_open_reply_window(RX_FWTO_SW_REPLY_US, false, sizeof(union ieee_blink_frame) + 2, sizeof(union dw1000_rng_init_msg) + 2))
+                goto err;
             dw1000_transmit_message(tx_frame, sizeof(*tx_frame), true);
             t_poll_tx = t_resp_rx = t_final_dx = 0;
             dw1000_trace(PERF, "-> init wait %d\n", m_dw1000_ctx.seq_num);
@@ -2515,7 +4736,8 @@ void dw1000_unit_test()
                 dw1000_trace(PERF, "rx_stamp: %llx\n", rx_time.rx_stamp);
 
                 union dw1000_rng_init_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, sizeof(union dw1000_rng_init_msg), NULL))
+                int match = dw1000_read_twr_frame(sizeof(union dw1000_rng_init_msg), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_RNG_INIT);
+                if (match < 0)
                     goto err;
             #else
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_TIME, &rx_time, sizeof(rx_time), NULL))
@@ -2528,31 +4750,43 @@ void dw1000_unit_test()
                 union DW1000_REG_RX_FINFO rx_finfo;
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
                     goto err;
-                dw1000_trace(INFO, "rxflen:%d\n", rx_finfo.rxflen);
+                dw1000_trace(INFO, "rxflen:%d\n", dw1000_rx_frame_len(&rx_finfo));
 
                 union dw1000_rng_init_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, rx_finfo.rxflen, NULL))
+                int match = dw1000_read_twr_frame(dw1000_rx_frame_len(&rx_finfo), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_RNG_INIT);
+                if (match < 0)
                     goto err;
-                print_buf(rx_frame, rx_finfo.rxflen, "rng init frame:\n");
+                if (match)
+                    print_buf(rx_frame, match, "rng init frame:\n");
             #endif
-                if ((rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16) &&
-                    ((m_dw1000_ctx.seq_num + 1) == rx_frame->seq_num) &&
-                    (rx_frame->code == DW1000_TWR_CODE_RNG_INIT) &&
-                    (rx_frame->dst_addr == m_dw1000_ctx.my_addr)) {
+                if (match) {
                     m_dw1000_ctx.tar_addr    = rx_frame->src_addr;
                     m_dw1000_ctx.seq_num     = rx_frame->seq_num;
-                    m_dw1000_ctx.tx_delay_ms = rx_frame->tx_delay_ms;
-                    dw1000_trace(PERF, "-> poll %d,%d\n", m_dw1000_ctx.seq_num, rx_frame->tx_delay_ms);
+                    m_dw1000_ctx.tx_delay_us = rx_frame->tx_delay_us;
+                #if (CONFIG_DW1000_SESSION)
+                    m_dw1000_ctx.period_ms   = rx_frame->period_ms ? rx_frame->period_ms : SESSION_DISCOVERY_PERIOD_MS;
+                #endif
+                #if (CONFIG_DW1000_ADAPTIVE_RATE)
+                    // Start from the period offered by the anchor
+                    m_dw1000_ctx.rate.period_ms = 0;
+                #endif
+                    dw1000_trace(PERF, "-> poll %d,%d\n", m_dw1000_ctx.seq_num, rx_frame->tx_delay_us);
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_POLL;
                 } else {
-                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16),
+                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == DW1000_TWR_FCTRL),
                         (m_dw1000_ctx.seq_num + 1), rx_frame->seq_num,
                         (rx_frame->code == DW1000_TWR_CODE_RNG_INIT),
                         (rx_frame->dst_addr == m_dw1000_ctx.my_addr));
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
                 }
-            } else if (sys_status->ofs_00.rxrfto) {
+            #if (CONFIG_DW1000_BLINK_BACKOFF)
+                backoff_result(&m_dw1000_ctx.blink_backoff, match);
+            #endif
+            } else if (sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO) {
                 sys_status->ofs_00.value = 0;
+            #if (CONFIG_DW1000_BLINK_BACKOFF)
+                backoff_result(&m_dw1000_ctx.blink_backoff, false);
+            #endif
                 m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
             }
             break;
@@ -2561,22 +4795,51 @@ void dw1000_unit_test()
         case DW1000_DS_TWR_STATE_POLL:
         {
             union dw1000_poll_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
-            tx_frame->fctrl    = IEEE_802_15_4_FCTRL_RANGE_16;
+            tx_frame->fctrl    = DW1000_TWR_FCTRL;
             tx_frame->seq_num  = ++m_dw1000_ctx.seq_num;
+        #if (!CONFIG_DW1000_COMPACT_FRAMES)
             tx_frame->pan_id   = DW1000_PAN_ID;
+        #endif
             tx_frame->dst_addr = m_dw1000_ctx.tar_addr;
             tx_frame->src_addr = m_dw1000_ctx.my_addr;
             tx_frame->code     = DW1000_TWR_CODE_POLL;
+            // The anchor responds tx_delay_us after receiving the poll
+            if (dw1000_open_reply_window(CONFIG_DW1000_DELAY_TX ? m_dw1000_ctx.tx_delay_us : RX_FWTO_SW_REPLY_US, CONFIG_DW1000_DELAY_TX,
+                    sizeof(union dw1000_poll_msg) + 2, sizeof(union dw1000_resp_msg) + 2))
+                goto err;
         #if (CONFIG_DW1000_DELAY_TX)
             // #define TX_DELAY_MS (5)
             // uint64_t dx_time = rx_time.rx_stamp + DX_TIME_MS(TX_DELAY_MS);
             // dw1000_trace(PERF, " dx_time: %10llx, %llx\n", dx_time, DX_TIME_MS(TX_DELAY_MS));
             // dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, true);
 
-            m_dw1000_ctx.catch_poll_txtfs = true;
-            dx_time = rx_time.rx_stamp + DX_TIME_MS(m_dw1000_ctx.tx_delay_ms);
-            dw1000_trace(PERF, " dx_time: %10llx, %llx\n", dx_time, DX_TIME_MS(m_dw1000_ctx.tx_delay_ms));
-            dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, true);
+        #if (CONFIG_DW1000_SESSION)
+            if (m_dw1000_ctx.paired) {
+            #if (CONFIG_DW1000_PREDICT_TX_TS)
+                // There is no ranging init to schedule against, use the system time instead
+                uint64_t sys_time = 0;
+                if (dw1000_non_indexed_read(spi_cfg, DW1000_SYS_TIME, &sys_time, sizeof(union DW1000_REG_SYS_TIME), NULL))
+                    goto err;
+                dx_time = sys_time + DX_TIME_US(m_dw1000_ctx.tx_delay_us);
+                t_poll_tx = dw1000_predict_tx_stamp(dx_time);
+                dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, true);
+            #else
+                // There is no ranging init to schedule against, the TX time is caught on TXFRS
+                m_dw1000_ctx.catch_poll_txtfs = true;
+                dw1000_transmit_message(tx_frame, sizeof(*tx_frame), true);
+            #endif
+            } else
+        #endif
+            {
+                dx_time = rx_time.rx_stamp + DX_TIME_US(m_dw1000_ctx.tx_delay_us);
+            #if (CONFIG_DW1000_PREDICT_TX_TS)
+                t_poll_tx = dw1000_predict_tx_stamp(dx_time);
+            #else
+                m_dw1000_ctx.catch_poll_txtfs = true;
+            #endif
+                dw1000_trace(PERF, " dx_time: %10llx, %llx\n", dx_time, DX_TIME_US(m_dw1000_ctx.tx_delay_us));
+                dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), dx_time, true);
+            }
         #else
             dw1000_transmit_message(tx_frame, sizeof(*tx_frame), true);
         #endif
@@ -2586,6 +4849,13 @@ void dw1000_unit_test()
         }
         case DW1000_DS_TWR_STATE_RESPONSE_WAIT:
         {
+        #if (CONFIG_DW1000_PRESTAGE_TX) && (!CONFIG_DW1000_SS_TWR)
+            // The poll has left the TX buffer, stage the final message
+            if (!m_dw1000_ctx.tx_staged && m_dw1000_ctx.tx_done) {
+                if (dw1000_stage_final_msg())
+                    goto err;
+            }
+        #endif
             if (sys_status->ofs_00.rxfcg) {
                 sys_status->ofs_00.value = 0;
 
@@ -2595,36 +4865,85 @@ void dw1000_unit_test()
                 dw1000_trace(PERF, "rx_stamp: %llx\n", t_resp_rx);
 
                 union dw1000_resp_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, sizeof(union dw1000_resp_msg), NULL))
+                int match = dw1000_read_twr_frame(sizeof(union dw1000_resp_msg), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_RESP);
+                if (match < 0)
                     goto err;
             #else
                 union DW1000_REG_RX_FINFO rx_finfo;
                 if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_FINFO, &rx_finfo, sizeof(rx_finfo), NULL))
                     goto err;
-                dw1000_trace(INFO, "rxflen:%d\n", rx_finfo.rxflen);
+                dw1000_trace(INFO, "rxflen:%d\n", dw1000_rx_frame_len(&rx_finfo));
 
                 union dw1000_resp_msg *rx_frame = (void *)m_dw1000_ctx.rx_buf;
-                if (dw1000_non_indexed_read(spi_cfg, DW1000_RX_BUFFER, rx_frame, rx_finfo.rxflen, NULL))
+                int match = dw1000_read_twr_frame(dw1000_rx_frame_len(&rx_finfo), (uint8_t)(m_dw1000_ctx.seq_num + 1), DW1000_TWR_CODE_RESP);
+                if (match < 0)
                     goto err;
-                print_buf(rx_frame, rx_finfo.rxflen, "resp frame:\n");
+                if (match)
+                    print_buf(rx_frame, match, "resp frame:\n");
             #endif
-                if ((rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16) &&
-                    ((m_dw1000_ctx.seq_num + 1) == rx_frame->seq_num) &&
-                    (rx_frame->code == DW1000_TWR_CODE_RESP) &&
-                    (rx_frame->dst_addr == m_dw1000_ctx.my_addr)) {
+                if (match) {
                     m_dw1000_ctx.tar_addr = rx_frame->src_addr;
                     m_dw1000_ctx.seq_num  = rx_frame->seq_num;
+                #if (CONFIG_DW1000_SS_TWR)
+                    int32_t car_int;
+                    if (dw1000_read_car_int(&car_int))
+                        goto err;
+                    float ratio = dw1000_clock_offset_ratio(car_int);
+                    float t_prop = twr_ss_tof((uint32_t)(t_resp_rx - t_poll_tx), rx_frame->t_reply, ratio);
+                    dw1000_trace(INFO, " clk ofs  : %lf ppm\n", (double)ratio * 1e6);
+                    dw1000_trace(INFO, " t_prop   : %lf\n", (double)t_prop);
+                    dw1000_trace(INFO, " dist     : %lf cm\n", (((double)SPEED_OF_LIGHT * (double)t_prop * 100.0) / (double)DW1000_SAMPLING_CLOCK));
+                #if (CONFIG_DW1000_RANGE_FILTER) || (CONFIG_DW1000_MULTILAT)
+                    dw1000_range_publish(m_dw1000_ctx.tar_addr, t_prop * (float)DW1000_MM_PER_TICK_Q16 / 65536.0f);
+                #endif
+                #if (CONFIG_DW1000_SESSION)
+                    m_dw1000_ctx.paired   = true;
+                    m_dw1000_ctx.fail_cnt = 0;
+                    dw1000_session_fix();
+                #endif
+                    m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
+                #else
+                #if (CONFIG_DW1000_RANGE_REPORT)
+                    // Only accept the range of our own previous exchange
+                #if (CONFIG_DW1000_MULTILAT)
+                    // with this anchor, the other anchors were polled in between
+                    int idx = dw1000_multilat_index(m_dw1000_ctx.tar_addr);
+                    bool fresh = (idx >= 0) && (rx_frame->tof_seq == m_dw1000_ctx.multilat.tof_seq[idx]);
+                #else
+                    bool fresh = (rx_frame->tof_seq == m_dw1000_ctx.tof_seq) && (m_dw1000_ctx.tof_addr == m_dw1000_ctx.tar_addr);
+                #endif
+                    if (rx_frame->tof && fresh) {
+                        m_dw1000_ctx.tof_q8 = rx_frame->tof;
+                    #if (CONFIG_DW1000_FIXED_POINT_TWR)
+                        dw1000_trace(INFO, " range    : %lu mm (%d)\n", dw1000_tof_q8_to_mm(rx_frame->tof), rx_frame->tof_seq);
+                    #else
+                        dw1000_trace(INFO, " range    : %lf cm (%d)\n", ((double)SPEED_OF_LIGHT * (double)rx_frame->tof * 100.0) / (256.0 * (double)DW1000_SAMPLING_CLOCK), rx_frame->tof_seq);
+                    #endif
+                    #if (CONFIG_DW1000_RANGE_FILTER) || (CONFIG_DW1000_MULTILAT)
+                        dw1000_range_publish(m_dw1000_ctx.tar_addr, (float)rx_frame->tof * (float)DW1000_MM_PER_TICK_Q16 / (256.0f * 65536.0f));
+                    #endif
+                    } else if (rx_frame->tof) {
+                        dw1000_trace(WARN, "@@ stale range %d,%d\n", rx_frame->tof_seq, m_dw1000_ctx.tof_seq);
+                    }
+                #endif
                     dw1000_trace(PERF, "-> final %d\n", m_dw1000_ctx.seq_num);
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_FINAL;
+                #endif
                 } else {
-                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == IEEE_802_15_4_FCTRL_RANGE_16),
+                    dw1000_trace(ERROR, "@@ err %d,(%d,%d),%d,%d\n", (rx_frame->fctrl == DW1000_TWR_FCTRL),
                         (m_dw1000_ctx.seq_num + 1), rx_frame->seq_num,
                         (rx_frame->code == DW1000_TWR_CODE_RESP),
                         (rx_frame->dst_addr == m_dw1000_ctx.my_addr));
+                #if (CONFIG_DW1000_SESSION)
+                    dw1000_session_fail();
+                #endif
                     m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
                 }
-            } else if (sys_status->ofs_00.rxrfto) {
+            } else if (sys_status->ofs_00.value & DW1000_SYS_STS_RX_TO) {
                 sys_status->ofs_00.value = 0;
+            #if (CONFIG_DW1000_SESSION)
+                dw1000_session_fail();
+            #endif
                 m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
             }
             break;
@@ -2632,9 +4951,11 @@ void dw1000_unit_test()
         case DW1000_DS_TWR_STATE_FINAL:
         {
             union dw1000_final_msg *tx_frame = (void *)m_dw1000_ctx.tx_buf;
-            tx_frame->fctrl     = IEEE_802_15_4_FCTRL_RANGE_16;
+            tx_frame->fctrl     = DW1000_TWR_FCTRL;
             tx_frame->seq_num   = ++m_dw1000_ctx.seq_num;
+        #if (!CONFIG_DW1000_COMPACT_FRAMES)
             tx_frame->pan_id    = DW1000_PAN_ID;
+        #endif
             tx_frame->dst_addr  = m_dw1000_ctx.tar_addr;
             tx_frame->src_addr  = m_dw1000_ctx.my_addr;
             tx_frame->code      = DW1000_TWR_CODE_FINAL;
@@ -2642,16 +4963,46 @@ void dw1000_unit_test()
             /**
              * dx_time = t_final_dx
              */
-            uint64_t dx = DX_TIME_MS(m_dw1000_ctx.tx_delay_ms);
+            uint64_t dx = DX_TIME_US(m_dw1000_ctx.tx_delay_us);
             t_final_dx = t_resp_rx + dx;
             dw1000_trace(PERF, " dx_time: %10llx, %llx\n", t_final_dx, dx);
             tx_frame->t_round_1 = (uint32_t)(t_resp_rx - t_poll_tx);
+        #if (CONFIG_DW1000_PREDICT_TX_TS)
+            tx_frame->t_reply_2 = (uint32_t)(dw1000_predict_tx_stamp(t_final_dx) - t_resp_rx);
+        #else
             tx_frame->t_reply_2 = (uint32_t)(dx);
-            dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), t_final_dx, false);
+        #endif
+        #if (CONFIG_DW1000_PRESTAGE_TX)
+            if (m_dw1000_ctx.tx_staged) {
+                size_t ofs = offsetof(union dw1000_final_msg, seq_num);
+                if (dw1000_patch_tx_frame(ofs, &m_dw1000_ctx.tx_buf[ofs], offsetof(union dw1000_final_msg, src_addr) - ofs))
+                    goto err;
+                ofs = offsetof(union dw1000_final_msg, t_round_1);
+                if (dw1000_patch_tx_frame(ofs, &m_dw1000_ctx.tx_buf[ofs], sizeof(tx_frame->t_round_1) + sizeof(tx_frame->t_reply_2)))
+                    goto err;
+                dw1000_start_staged_tx(t_final_dx, false);
+            } else
+        #endif
+                dw1000_delayed_transmit_message(tx_frame, sizeof(*tx_frame), t_final_dx, false);
         #else
             dw1000_transmit_message(tx_frame, sizeof(*tx_frame), false);
         #endif
             dw1000_trace(INFO, "@@ final\n");
+        #if (CONFIG_DW1000_RANGE_REPORT)
+            // The anchor reports the range of this exchange in its next response
+            m_dw1000_ctx.tof_addr = m_dw1000_ctx.tar_addr;
+            m_dw1000_ctx.tof_seq  = m_dw1000_ctx.seq_num;
+        #if (CONFIG_DW1000_MULTILAT)
+            int idx = dw1000_multilat_index(m_dw1000_ctx.tar_addr);
+            if (idx >= 0)
+                m_dw1000_ctx.multilat.tof_seq[idx] = m_dw1000_ctx.seq_num;
+        #endif
+        #endif
+        #if (CONFIG_DW1000_SESSION)
+            m_dw1000_ctx.paired   = true;
+            m_dw1000_ctx.fail_cnt = 0;
+            dw1000_session_fix();
+        #endif
             m_dw1000_ctx.twr_state = DW1000_DS_TWR_STATE_TX_INIT;
             break;
         }
@@ -14,6 +14,14 @@
 
 #include "gpio.h"
 #include "spi.h"
+#include "multilat.h"
+#include "mac_frame.h"
+#include "backoff.h"
+#include "twr.h"
+#include "tdoa.h"
+#include "clock_sync.h"
+#include "cell_plan.h"
+#include "range_filter.h"
 
 #define CONFIG_DW1000_SYS_STS_DEBUG     (0)
 #define CONFIG_DW1000_TAG               (0)
@@ -22,9 +30,58 @@
 #define CONFIG_DW1000_REINIT            (1)
 #define CONFIG_DW1000_DELAY_TX          (1)
 #define CONFIG_DW1000_NLOS              (1)
+#define CONFIG_DW1000_SESSION           (1)
+#define CONFIG_DW1000_PRESTAGE_TX       (CONFIG_DW1000_DELAY_TX)
+#define CONFIG_DW1000_PREDICT_TX_TS     (CONFIG_DW1000_DELAY_TX)
+#define CONFIG_DW1000_W4R_TIM           (CONFIG_DW1000_DELAY_TX)
+#define CONFIG_DW1000_PRETOC            (CONFIG_DW1000_DELAY_TX)    // Give up on a scheduled reply when its preamble is missing
+#define CONFIG_DW1000_DX_RX_FINAL       (CONFIG_DW1000_DELAY_TX)    // The anchor turns its receiver on for the final at a DX_TIME
+#define CONFIG_DW1000_SS_TWR            (0)
+#define CONFIG_DW1000_FIXED_POINT_TWR   (1)
+#define CONFIG_DW1000_TWR_BENCH         (0)
+#define CONFIG_DW1000_RANGE_REPORT      (!CONFIG_DW1000_SS_TWR)
+#define CONFIG_DW1000_TDOA              (0)     // Tags only blink, anchors timestamp the blinks
+#define CONFIG_DW1000_CLOCK_SYNC        (0)     // TDoA anchors track the clock of a reference anchor
+#define CONFIG_DW1000_EXT_SYNC          (0)     // Anchors reset their timebase from a shared wired SYNC line
+#define CONFIG_DW1000_MULTILAT          (0)     // Tags poll the anchors of the anchor map in turn and solve their position
+#define CONFIG_DW1000_FRAME_BENCH       (0)     // Time the masked header compare of a ranging frame at start-up
+#define CONFIG_DW1000_RANGE_FILTER      (1)     // Smooth the ranges of each peer and reject outliers
+#define CONFIG_DW1000_ADAPTIVE_RATE     (0)     // Tags poll faster when moving and back off when stationary
+#define CONFIG_DW1000_FRAME_FILTER      (CONFIG_DW1000_ANCHOR)  // Reject frames for other PANs and addresses in hardware
+#define CONFIG_DW1000_DATA_LINK         (0)     // Stream data from the tag to the anchor instead of ranging
+#define CONFIG_DW1000_LONG_FRAME        (CONFIG_DW1000_DATA_LINK)   // Non-standard PHR for frames of up to 1023 bytes, both ends must use it
+#define CONFIG_DW1000_TX_QUEUE          (CONFIG_DW1000_DATA_LINK)   // Write the next frame into another part of the TX buffer while one is on air
+#define CONFIG_DW1000_COMPACT_FRAMES    (0)     // Ranging frames with a one octet frame control and no PAN ID, both ends must use it
+#define CONFIG_DW1000_RX_HEADER_FIRST   (1)     // Without frame filtering, read the MAC header of a received frame and the rest only if it is for us
+#define CONFIG_DW1000_BLINK_BACKOFF     (CONFIG_DW1000_SESSION) // Randomise the blink period of unpaired tags and back off after failed ranging inits
+#define CONFIG_DW1000_CELL_PLAN         (0)     // Take the channel and preamble code from a plan of the neighbouring cells
+
+#if (CONFIG_DW1000_SS_TWR) && (!CONFIG_DW1000_PREDICT_TX_TS)
+#error "CONFIG_DW1000_SS_TWR needs the response TX timestamp before the response is sent"
+#endif
+
+#if (CONFIG_DW1000_DX_RX_FINAL) && (!CONFIG_DW1000_PRESTAGE_TX)
+#error "CONFIG_DW1000_DX_RX_FINAL starts the receiver once the response is out, as CONFIG_DW1000_PRESTAGE_TX tracks"
+#endif
+
+#if (CONFIG_DW1000_TWR_BENCH) && (!CONFIG_DW1000_FIXED_POINT_TWR)
+#error "CONFIG_DW1000_TWR_BENCH times the integer DS-TWR of CONFIG_DW1000_FIXED_POINT_TWR"
+#endif
+
+#if (CONFIG_DW1000_DATA_LINK) && (!CONFIG_DW1000_TX_QUEUE)
+#error "CONFIG_DW1000_DATA_LINK sends its frames through the TX queue"
+#endif
 
 #if (CONFIG_DW1000_ANCHOR)
-#define TX_DELAY_MS (4)
+/**
+ * Reply delay from the RX timestamp of a frame to the TX timestamp of the answer.
+ * It has to cover the rest of the received frame, the SPI accesses to read it
+ * and to patch the pre-staged answer, and the preamble and SFD of the answer
+ * (about 1.06 ms with PSR 1024 at 850 kbps).
+ */
+#define TX_DELAY_US (2000)
+#define SESSION_PERIOD_MS (1000)    // Poll period offered to tags in the ranging init message
+#define ANCHOR_ADDR (0xCC)          // Short address, must be unique and match the anchor map of the tags
 #define CONFIG_DW1000_ANCHOR_LISTEN_TO      (0)
 #define CONFIG_DW1000_ANCHOR_POLLING_MODE   (0)
 #else
@@ -32,24 +89,195 @@
 #define CONFIG_DW1000_ANCHOR_POLLING_MODE   (0)
 #endif
 
+#if (CONFIG_DW1000_CLOCK_SYNC)
+#if (!CONFIG_DW1000_TDOA) || (!CONFIG_DW1000_PREDICT_TX_TS)
+#error "CONFIG_DW1000_CLOCK_SYNC needs CONFIG_DW1000_TDOA and CONFIG_DW1000_PREDICT_TX_TS"
+#endif
+#define CONFIG_DW1000_SYNC_REFERENCE    (0)         // This anchor sends the sync frames
+#define SYNC_PERIOD_MS                  (100)       // Sync frame period of the reference anchor
+#define SYNC_REF_TOF                    (0)         // Time of flight from the reference anchor (ticks), from the anchor map
+#define SYNC_KF_R                       (160.0)     // Timestamp noise variance (ticks^2), about 0.2 ns rms
+#define SYNC_KF_Q                       (4.0e3)     // Drift random walk density (ticks^2/s^3)
+#define SYNC_KF_DRIFT0                  (1.3e6)     // Initial drift uncertainty (ticks/s), about 20 ppm
+#define SYNC_LOCK_NIS                   (16.0)      // Chi-square bound on the normalized innovation, 4 sigma
+#define SYNC_LOCK_COUNT                 (10)        // Consecutive sync frames within SYNC_LOCK_NIS to lock
+#define SYNC_UNLOCK_COUNT               (5)         // Consecutive sync frames above SYNC_LOCK_NIS to drop the lock
+#define SYNC_REPORT_INTERVAL            (100)       // Print the residual every N sync frames
+#endif
+
+#if (CONFIG_DW1000_EXT_SYNC)
+#if (!CONFIG_DW1000_ANCHOR)
+#error "CONFIG_DW1000_EXT_SYNC is for anchors sharing a SYNC line"
+#endif
+/**
+ * All anchors have their SYNC pin on one line. The master drives it from
+ * SYNC_PIN, and every DW1000 on the line (the master's included) resets its
+ * system time WAIT 38.4 MHz cycles after it samples the rising edge. The
+ * timebases stay aligned only as well as the anchors' 38.4 MHz clocks agree,
+ * so the anchors should share one reference clock, or the master has to pulse
+ * often enough for the crystal drift to stay negligible. The anchors skip the
+ * CONFIG_DW1000_REINIT hard reset of every listen cycle, which would throw the
+ * aligned timebase away.
+ */
+#define CONFIG_DW1000_EXT_SYNC_MASTER   (0)     // This anchor drives the SYNC line
+#define EXT_SYNC_WAIT                   (8)     // EC_CTRL wait, 38.4 MHz cycles
+#define EXT_SYNC_PERIOD_MS              (1000)  // Timebase reset period of the master
+#define EXT_SYNC_PULSE_US               (1)     // SYNC pulse width
+#endif
+
+#if (CONFIG_DW1000_MULTILAT)
+#if (!CONFIG_DW1000_TAG) || (!CONFIG_DW1000_SESSION) || ((!CONFIG_DW1000_SS_TWR) && (!CONFIG_DW1000_RANGE_REPORT))
+#error "CONFIG_DW1000_MULTILAT needs a tag that polls anchors directly and learns its ranges"
+#endif
+#endif
+
+#if (CONFIG_DW1000_MULTILAT)
+/**
+ * Anchor map: short address and position (x, y, z) in metres.
+ */
+#define MULTILAT_ANCHOR_MAP \
+    {0x00CC, {0.0f, 0.0f, 2.5f}}, \
+    {0x00CD, {6.0f, 0.0f, 2.0f}}, \
+    {0x00CE, {6.0f, 4.0f, 2.5f}}, \
+    {0x00CF, {0.0f, 4.0f, 1.2f}},
+#define MULTILAT_3D                     (0)     // Solve for z as well, needs four anchors that are not coplanar
+#define MULTILAT_TAG_Z                  (1.0f)  // Height of the tag when solving in 2D (m)
+#define MULTILAT_MAX_AGE_MS             (5000)  // Older ranges are left out of the fix
+#endif
+
+#if (CONFIG_DW1000_CELL_PLAN)
+/**
+ * Cell map: centre (x, y) in metres of each ranging cell. All devices of a
+ * cell use the same cell map and cell ID, and so plan the same channel and
+ * preamble code. dw1000_set_cell() picks another cell before dw1000_init().
+ */
+#define CELL_MAP \
+    {{ 0.0f,  0.0f}}, \
+    {{20.0f,  0.0f}}, \
+    {{40.0f,  0.0f}}, \
+    {{ 0.0f, 20.0f}}, \
+    {{20.0f, 20.0f}}, \
+    {{40.0f, 20.0f}},
+#define CELL_ID                         (0)     // Cell of this device in the cell map, at dw1000_ctx_init()
+#define CELL_REUSE_DIST_M               (30.0f) // Closer cells hear each other and need another channel or code
+#endif
+
+#if (CONFIG_DW1000_RANGE_FILTER)
+/**
+ * Constant velocity Kalman filter per peer on range (mm) and range rate (mm/s).
+ */
+#define RANGE_FILTER_PEERS              (8)         // Peers tracked at once, the least recently updated one is replaced
+#define RANGE_FILTER_R                  (2500.0f)   // Range noise variance (mm^2), 5 cm rms
+#define RANGE_FILTER_Q                  (2.5e4f)    // Acceleration noise density (mm^2/s^3), raise it for fast peers
+#define RANGE_FILTER_RATE0              (1.0e6f)    // Initial range rate variance (mm^2/s^2), 1 m/s rms
+#define RANGE_FILTER_GATE               (3.0f)      // Innovation gate in standard deviations
+#define RANGE_FILTER_MAX_REJECTS        (3)         // Consecutive rejections after which the track restarts
+#define RANGE_FILTER_REPORT_INTERVAL    (20)        // Print the filter metrics every N ranges
+#endif
+
+#if (CONFIG_DW1000_ADAPTIVE_RATE)
+#if (!CONFIG_DW1000_TAG) || (!CONFIG_DW1000_SESSION) || (!CONFIG_DW1000_RANGE_FILTER)
+#error "CONFIG_DW1000_ADAPTIVE_RATE needs a tag in a session with the range filter"
+#endif
+#define RATE_AIRTIME_BUDGET_PERMILLE    (20)        // Share of the channel one tag may use
+#define RATE_MIN_PERIOD_MS              (100)
+#define RATE_MAX_PERIOD_MS              (5000)      // Period of a stationary tag
+#define RATE_STEP_MM                    (100.0f)    // Range change allowed between two fixes
+#define RATE_BACKOFF                    (1.25f)     // Period growth per fix while the ranges are as predicted
+#define RATE_NIS_FAST                   (4.0f)      // Normalised innovation squared that halves the period
+#endif
+
+#if (CONFIG_DW1000_TX_QUEUE)
+/**
+ * The TX buffer is split into TXQ_SLOTS equal regions that are filled and
+ * sent in turn, a frame must fit into one region.
+ */
+#define TXQ_SLOTS                       (2)         // Power of two
+#endif
+
+#if (CONFIG_DW1000_DATA_LINK)
+/**
+ * The anchor acknowledges every data frame in hardware (AUTOACK) and the tag
+ * keeps up to LINK_WINDOW frames unacknowledged, sending each one again
+ * LINK_RTO_US after its last try until it is acknowledged.
+ */
+#define LINK_WINDOW                     (8)         // Frames in flight, at most 128 with 8-bit sequence numbers
+#define LINK_RTO_US                     (2000)
+#define LINK_MAX_RETRIES                (10)
+#define LINK_IFS_US                     (150)       // Lets the receiver turn back on, plus the SPI read of the frame
+#define LINK_ACK_WAIT_US                (5000)      // Gives up on an acknowledgement whose interrupt went missing
+#define LINK_PEER_ADDR                  (0xCC)
+#define LINK_BENCH_BYTES                (16384)     // Stream sent by the tag in each run
+#define LINK_SIM_LOSS_PERMILLE          (50)        // Frames the tag sends to a foreign address, rejected by the anchor
+#define LINK_REPORT_MS                  (1000)
+#endif
+
+#if (CONFIG_DW1000_SESSION)
+#define SESSION_MAX_FAILS               (3)     // Consecutive failed polls before falling back to discovery
+#define SESSION_DISCOVERY_PERIOD_MS     (1000)  // Blink period of an unpaired tag
+#define SESSION_REPORT_INTERVAL         (10)    // Print the ranging statistics every N fixes
+#endif
+
+#if (CONFIG_DW1000_BLINK_BACKOFF)
+#define BLINK_JITTER_PERCENT            (50)    // Blink period drawn from the discovery period +-50%
+#define BLINK_BACKOFF_MAX_EXP           (3)     // The period doubles after each failed ranging init, up to 8 times
+#endif
+
+#if (CONFIG_DW1000_BLINK_BACKOFF) && (!CONFIG_DW1000_SESSION)
+#error "CONFIG_DW1000_BLINK_BACKOFF schedules the blinks of the ranging session"
+#endif
+
 #define IEEE_802_15_4_BLINK_CCP_64      (0xC5)
 // data, PAN ID Compress, 16 bits source address, 16 bits destination address
 #define IEEE_802_15_4_FCTRL_RANGE_16    (0x8841)
+// data, ACK request, PAN ID Compress, 16 bits source address, 16 bits destination address
+#define IEEE_802_15_4_FCTRL_DATA_AR_16  (0x8861)
+#define IEEE_802_15_4_FCTRL_ACK         (0x0002)
+// multipurpose, one octet frame control, 16 bits destination address, 16 bits source address
+#define IEEE_802_15_4_FCTRL_COMPACT_16  (0xA5)
 #define DW1000_PAN_ID                   (0xDECA)
 
 #define FCNTL_IEEE_BLINK_CCP_64         (0xC5)      //!< CCP blink frame control
 #define FCNTL_IEEE_BLINK_TAG_64         (0x56)      //!< Tag blink frame control
 #define FCNTL_IEEE_BLINK_ANC_64         (0x57)      //!< Anchor blink frame control
 #define FCNTL_IEEE_RANGE_16             (0x8841)    //!< Range frame control
+
+/**
+ * Frame control and MAC header length (up to the function code) of the ranging
+ * frames. The compact frames drop the PAN ID and one octet of frame control.
+ */
+#if (CONFIG_DW1000_COMPACT_FRAMES)
+#define DW1000_TWR_FCTRL                IEEE_802_15_4_FCTRL_COMPACT_16
+#define DW1000_TWR_HDR_LEN              (7)
+#else
+#define DW1000_TWR_FCTRL                IEEE_802_15_4_FCTRL_RANGE_16
+#define DW1000_TWR_HDR_LEN              (10)
+#endif
+#define DW1000_TWR_HDR_STD_LEN          (10)
+#define DW1000_RNG_INIT_STD_LEN         (DW1000_TWR_HDR_STD_LEN + 6)    // With the tag_addr the compact ranging init drops
 #define FCNTL_IEEE_PROVISION_16         (0x8844)    //!< Provision frame control
 
 #define DW1000_TWR_CODE_RNG_INIT        (0x20)
 #define DW1000_TWR_CODE_POLL            (0x61)
 #define DW1000_TWR_CODE_RESP            (0x50)
 #define DW1000_TWR_CODE_FINAL           (0x69)
+#define DW1000_CODE_CLOCK_SYNC          (0x2C)
+#define DW1000_CODE_DATA                (0x44)
+#define DW1000_CODE_DATA_SYN            (0x45)      // First frame of a stream
+#define DW1000_DATA_PAYLOAD_MAX         (DW1000_DATA_FRAME_MAX - 12)    // Longest data frame less the data header and FCS
+#define DW1000_BROADCAST_ADDR           (0xFFFF)
 
 #define SPEED_OF_LIGHT                  (299792458.0)
 
+/**
+ * Distance travelled by light in one period of the 63.8976 GHz sampling clock,
+ * in Q16 millimetres.
+ *
+ * 299792458 m/s / 63.8976 GHz = 4.6917519 mm
+ * 4.6917519 * 65536 = 307476.3
+ */
+#define DW1000_MM_PER_TICK_Q16          (307476ULL)
+
 /**
  * The chipping rate given by the IEEE 802.15.4-2011 standard [1] is 499.2 MHz.
  * DW1000 system clocks are referenced to this frequency.
@@ -96,6 +324,8 @@
 #define DX_TIME_MS(t)                   ((uint64_t)(t) * DW1000_SAMPLING_CLOCK / 1000ULL)
 #define DX_TIME_US(t)                   ((uint64_t)(t) * DW1000_SAMPLING_CLOCK / 1000000ULL)
 #define DX_TIME_NS(t)                   ((uint64_t)(t) * DW1000_SAMPLING_CLOCK / 1000000000ULL)
+#define DX_TIME_MASK                    (~0x1FFULL)
+#define DW1000_TIMESTAMP_MASK           (0xFFFFFFFFFFULL)
 
 /**
  * The Receive Frame Wait Timeout period is a 16-bit field. The units for this
@@ -109,6 +339,22 @@
 
 #define DW1000_TX_BUFFER_SIZE           (1024)
 #define DW1000_RX_BUFFER_SIZE           (1024)
+#define DW1000_STD_FRAME_MAX            (127)       // Longest frame including the FCS with the standard PHR
+#define DW1000_LONG_FRAME_MAX           (1023)      // ... and with the long frame PHR (TFLE / RXFLE)
+#define DW1000_RX_SPLIT_MIN             (4)         // Bytes after the header worth a second SPI transaction
+#if (CONFIG_DW1000_LONG_FRAME)
+#define DW1000_FRAME_MAX                (DW1000_LONG_FRAME_MAX)
+#else
+#define DW1000_FRAME_MAX                (DW1000_STD_FRAME_MAX)
+#endif
+#if (CONFIG_DW1000_TX_QUEUE)
+#define DW1000_TXQ_SLOT_SIZE            (DW1000_TX_BUFFER_SIZE / TXQ_SLOTS)
+#endif
+#if (CONFIG_DW1000_TX_QUEUE) && (DW1000_TXQ_SLOT_SIZE < DW1000_FRAME_MAX)
+#define DW1000_DATA_FRAME_MAX           (DW1000_TXQ_SLOT_SIZE)  // Data frames are sent through the TX queue
+#else
+#define DW1000_DATA_FRAME_MAX           (DW1000_FRAME_MAX)
+#endif
 
 // DW1000 Register File IDs
 enum DW1000_REG_FILE_ID
@@ -398,6 +644,13 @@ enum dw1000_hirq_pol_sel
     DW1000_HIRQ_POL_ACTIVE_HIGH = 1,
 };
 
+enum dw1000_ext_sync_mode
+{
+    DW1000_EXT_SYNC_NONE = 0,           // SYNC input ignored
+    DW1000_EXT_SYNC_OSTR,               // One-shot timebase reset on the SYNC edge
+    DW1000_EXT_SYNC_OSRS,               // External clock counter captured on RMARKER
+};
+
 enum dw1000_ds_twr_state
 {
     DW1000_DS_TWR_STATE_RX_INIT = 0,
@@ -457,10 +710,46 @@ enum dw1000_ds_twr_state
 // #define DW1000_PSR                      (DW1000_PSR_4096)
 
 #define DW1000_CHAN                     (DW1000_CHAN_5)
+#if (CONFIG_DW1000_DATA_LINK)
+// Bulk data at the highest data rate with a short preamble
+#define DW1000_BR                       (DW1000_BR_6800KBPS)
+#define DW1000_PSR                      (DW1000_PSR_128)
+#else
 #define DW1000_BR                       (DW1000_BR_850KBPS)
+#define DW1000_PSR                      (DW1000_PSR_1024)
+#endif
 #define DW1000_PCODE                    (DW1000_PCODE_9)
 #define DW1000_PRF                      (DW1000_PRF_64MHZ)
-#define DW1000_PSR                      (DW1000_PSR_1024)
+
+/**
+ * Symbol durations in picoseconds for the airtime of a frame. The PHR is sent
+ * at 850 kbps, or at 110 kbps in 110 kbps mode. Every block of up to 330 data
+ * bits is followed by 48 Reed-Solomon parity bits.
+ */
+#define DW1000_PREAMBLE_SYMBOL_PS(prf)  ((prf) == DW1000_PRF_16MHZ ? 993590ULL : 1017630ULL)
+#define DW1000_DATA_SYMBOL_PS(br) \
+    ((br) == DW1000_BR_110KBPS ? 8205128ULL : \
+     (br) == DW1000_BR_850KBPS ? 1025641ULL : 128205ULL)
+#define DW1000_PHR_SYMBOL_PS(br)        ((br) == DW1000_BR_110KBPS ? 8205128ULL : 1025641ULL)
+#define DW1000_PHR_BITS                 (21)
+#define DW1000_RS_BLOCK_BITS            (330)
+#define DW1000_RS_PARITY_BITS           (48)
+#define DW1000_PREAMBLE_SYMBOLS(psr) \
+    ((psr) == DW1000_PSR_64   ? 64   : (psr) == DW1000_PSR_128  ? 128  : \
+     (psr) == DW1000_PSR_256  ? 256  : (psr) == DW1000_PSR_512  ? 512  : \
+     (psr) == DW1000_PSR_1024 ? 1024 : (psr) == DW1000_PSR_1536 ? 1536 : \
+     (psr) == DW1000_PSR_2048 ? 2048 : 4096)
+#define DW1000_SFD_SYMBOLS(br)          ((br) == DW1000_BR_110KBPS ? 64 : 8)
+#define DW1000_RX_FWTO_UNIT_PS          (1025641ULL)    // 512 / 499.2 MHz
+
+/**
+ * Frame wait timeouts. A reply sent at a DX_TIME is known to the microsecond,
+ * a reply sent from the main loop is bounded by RX_FWTO_SW_REPLY_US.
+ */
+#define RX_FWTO_MARGIN_US               (100)       // RX turn-on, time of flight and clock offsets
+#define RX_FWTO_SW_REPLY_US             (20000)     // Reply sent as soon as the main loop gets to it
+#define W4R_GUARD_US                    (50)        // The receiver is on this long before the preamble of a scheduled reply
+#define PRETOC_MARGIN_PACS              (2)         // Preamble detection timeout past the end of the expected preamble
 
 // #define DW1000_CHAN                     (DW1000_CHAN_5)
 // #define DW1000_BR                       (DW1000_BR_6800KBPS)
@@ -511,8 +800,8 @@ union DW1000_REG_SYS_CFG
         uint32_t ffen       : 1;        // Bit[0] Frame Filtering Enable
         uint32_t ffbc       : 1;        // Bit[1] Frame Filtering Behave as a Coordinator
         uint32_t ffab       : 1;        // Bit[2] Frame Filtering Allow Beacon frame reception
-        uint32_t ffad       : 1;        // Bit[3] Frame Filtering Allow Acknowledgment frame reception
-        uint32_t ffaa       : 1;        // Bit[4] Frame Filtering Allow MAC command frame reception
+        uint32_t ffad       : 1;        // Bit[3] Frame Filtering Allow Data frame reception
+        uint32_t ffaa       : 1;        // Bit[4] Frame Filtering Allow Acknowledgment frame reception
         uint32_t ffam       : 1;        // Bit[5] Frame Filtering Allow MAC command frame reception
         uint32_t ffar       : 1;        // Bit[6] Frame Filtering Allow Reserved frame types
         uint32_t ffa4       : 1;        // Bit[7] Frame Filtering Allow frames with frame type field of 4
@@ -550,6 +839,20 @@ enum dw1000_sys_cfg_phr_mode
     DW1000_SYS_CFG_PHR_LONG_FRAME = 0x3
 };
 
+/**
+ * Frame types accepted by frame filtering, SYS_CFG bits FFAB to FFA5.
+ */
+#define DW1000_FF_BEACON                (1 << 2)    // Frame type 0
+#define DW1000_FF_DATA                  (1 << 3)    // Frame type 1
+#define DW1000_FF_ACK                   (1 << 4)    // Frame type 2
+#define DW1000_FF_MAC                   (1 << 5)    // Frame type 3
+#define DW1000_FF_TYPE_4                (1 << 7)    // Frame type 4
+#define DW1000_FF_TYPE_5                (1 << 8)    // Frame type 5, blinks
+#define DW1000_FF_MASK                  (0x1FF)     // FFEN to FFA5
+
+// Ranging frames, and the blinks that start a ranging exchange or carry a TDoA stamp
+#define FRAME_FILTER_ALLOW              (DW1000_FF_DATA | ((CONFIG_DW1000_ANCHOR || CONFIG_DW1000_COMPACT_FRAMES) ? DW1000_FF_TYPE_5 : 0))
+
 _Static_assert(sizeof(union DW1000_REG_SYS_CFG) == 4, "union DW1000_REG_SYS_CFG must be 4 bytes");
 
 // Register file: 0x05 - Reserved
@@ -736,13 +1039,19 @@ union DW1000_REG_SYS_MASK
 //     DW1000_SYS_MASK_MRFPLLLL | DW1000_SYS_MASK_MCLKPLLLL | DW1000_SYS_MASK_MRXSTDTO | \
 //     DW1000_SYS_MASK_MHPDWARN | DW1000_SYS_MASK_MTXBERR   | DW1000_SYS_MASK_MAFFREJ)
 
-#if (CONFIG_DW1000_DELAY_TX)
+/**
+ * With predicted TX timestamps TXFRS is only needed to know when the TX buffer
+ * can be written again for a pre-staged frame, or when the TX queue can start
+ * its next frame.
+ */
+#if ((CONFIG_DW1000_DELAY_TX) && (!CONFIG_DW1000_PREDICT_TX_TS || CONFIG_DW1000_PRESTAGE_TX)) || (CONFIG_DW1000_TX_QUEUE)
 #define DW1000_SYS_STS_MASK ( \
     DW1000_SYS_MASK_MRXFCG   | DW1000_SYS_MASK_MRXRFTO | DW1000_SYS_MASK_MHPDWARN | \
-    DW1000_SYS_MASK_MTXFRS)
+    DW1000_SYS_MASK_MRXPTO   | DW1000_SYS_MASK_MTXFRS)
 #else
 #define DW1000_SYS_STS_MASK ( \
-    DW1000_SYS_MASK_MRXFCG   | DW1000_SYS_MASK_MRXRFTO | DW1000_SYS_MASK_MHPDWARN)
+    DW1000_SYS_MASK_MRXFCG   | DW1000_SYS_MASK_MRXRFTO | DW1000_SYS_MASK_MHPDWARN | \
+    DW1000_SYS_MASK_MRXPTO)
 #endif
 
 // REG:0F:00 - SYS_STATUS - System Status Register (octets 0 to 3)
@@ -812,6 +1121,11 @@ _Static_assert(sizeof(union DW1000_REG_SYS_STATUS_0F_00) == 4, "union DW1000_REG
 #define DW1000_SYS_STS_TXBERR       (1 << 28)   // Bit[28] *Transmit Buffer Error.
 #define DW1000_SYS_STS_AFFREJ       (1 << 29)   // Bit[29] *Automatic Frame Filtering rejection.
 
+// The receiver gave up: nothing on air (RXPTO) or no complete frame in time (RXRFTO)
+#define DW1000_SYS_STS_RX_TO        (DW1000_SYS_STS_RXRFTO | DW1000_SYS_STS_RXPTO)
+// A frame was on air but did not come through: PHY header, Reed Solomon, FCS or SFD error
+#define DW1000_SYS_STS_RX_ERR       (DW1000_SYS_STS_RXPHE | DW1000_SYS_STS_RXFSL | DW1000_SYS_STS_RXFCE | DW1000_SYS_STS_RXSTDTO)
+
 #define DW1000_SYS_STS_TXFRB        (1 << 4)    // Bit[4] Transmit Frame Begins.
 #define DW1000_SYS_STS_TXPRS        (1 << 5)    // Bit[5] Transmit Preamble Sent.
 #define DW1000_SYS_STS_TXPHS        (1 << 6)    // Bit[6] Transmit PHY Header Sent.
@@ -946,6 +1260,23 @@ union DW1000_REG_SYS_STATE
 _Static_assert(sizeof(union DW1000_REG_SYS_STATE) == 4, "union DW1000_REG_SYS_STATE must be 4 bytes");
 
 // Register file: 0x1A - Acknowledgement time and response time
+union DW1000_REG_ACK_RESP_T
+{
+    struct
+    {
+        /**
+         * Bit[19:0] Wait-for-Response turn-around Time. Delay from the end of
+         * a frame sent with WAIT4RESP to turning the receiver on, in units of
+         * approximately 1 us (512 / 499.2 MHz).
+         */
+        uint32_t w4r_tim : 20;
+        uint32_t rsvd    : 4;           // Bit[23:20] Reserved.
+        uint32_t ack_tim : 8;           // Bit[31:24] Auto-Acknowledgement turn-around Time, in preamble symbols.
+    };
+    uint32_t value;
+};
+
+_Static_assert(sizeof(union DW1000_REG_ACK_RESP_T) == 4, "union DW1000_REG_ACK_RESP_T must be 4 bytes");
 
 // Register file: 0x1B - Reserved
 
@@ -2430,63 +2761,6 @@ union ieee_blink_frame
 
 _Static_assert(sizeof(union ieee_blink_frame) == 10, "union ieee_blink_frame must be 10 bytes");
 
-/**
- * This frame type field is a 3-bit field that indicates the type of frame.
- * Below lists the eight possible frame types and their assignment in IEEE
- * 802.15.4-2011.
- */
-enum ieee_802_15_4_frame_type
-{
-    IEEE_802_15_4_FTYPE_BEACON = 0,
-    IEEE_802_15_4_FTYPE_DATA = 1,
-    IEEE_802_15_4_FTYPE_ACK,
-    IEEE_802_15_4_FTYPE_MAC_CMD,
-};
-
-/**
- * The destination addressing mode field (2-bits) specifies whether the frame
- * contains a destination address and if so the size of the address field.
- */
-enum ieee_802_15_4_dst_addr_mode
-{
-    IEEE_802_15_4_DAM_NO_ADDR = 0,
-    IEEE_802_15_4_DAM_SHORT_ADDR = 1,
-    IEEE_802_15_4_DAM_RSVD,
-    IEEE_802_15_4_DAM_EXT_ADDR,
-};
-
-/**
- * The source addressing mode field (2-bits) specifies whether the frame
- * contains a source address and if so the size of the address field.
- */
-enum ieee_802_15_4_src_addr_mode
-{
-    IEEE_802_15_4_SAM_NO_ADDR = 0,
-    IEEE_802_15_4_SAM_SHORT_ADDR = 1,
-    IEEE_802_15_4_SAM_RSVD,
-    IEEE_802_15_4_SAM_EXT_ADDR,
-};
-
-/**
- * The frame control field in the MAC header
- */
-union ieee_802_15_4_mac_fctrl
-{
-    struct
-    {
-        uint16_t ftype   : 3;           // Bit[2:0] Frame Type.
-        uint16_t se      : 1;           // Bit[3] Security Enabled.
-        uint16_t fpend   : 1;           // Bit[4] Frame Pending.
-        uint16_t ack_req : 1;           // Bit[5] ACK Request .
-        uint16_t pan_id  : 1;           // Bit[6] PAN ID Compress.
-        uint16_t rsvd    : 3;           // Bit[9:7] Reserved.
-        uint16_t dam     : 2;           // Bit[11:10] Dest. Address Mode.
-        uint16_t fver    : 2;           // Bit[13:12] Frame Version.
-        uint16_t sam     : 2;           // Bit[15:14] Source Address Mode.
-    };
-    uint16_t value;
-};
-
 //! IEEE 802.15.4 standard ranging frames
 union ieee_rng_req_frame
 {
@@ -2510,60 +2784,95 @@ union dw1000_rng_init_msg
 //! Structure of range request frame
     struct
     {
+#if (CONFIG_DW1000_COMPACT_FRAMES)
+        uint8_t fctrl;                  //!< Frame control (0xA5 to indicate a multipurpose frame using 16-bit addressing)
+        uint8_t seq_num;                //!< Sequence number, incremented for each new frame
+#else
         uint16_t fctrl;                 //!< Frame control (0x8841 to indicate a data frame using 16-bit addressing)
         uint8_t seq_num;                //!< Sequence number, incremented for each new frame
         uint16_t pan_id;                //!< pan_id
+#endif
         uint16_t dst_addr;              //!< Destination address
         uint16_t src_addr;              //!< Source address
         uint8_t code;                   //!< Function code (0x20 to indicate the ranging init message)
-        uint16_t tag_addr;
-        uint16_t tx_delay_ms;
+#if (!CONFIG_DW1000_COMPACT_FRAMES)
+        uint16_t tag_addr;              //!< Unused, the tag address is the destination address
+#endif
+        uint16_t tx_delay_us;           //!< Reply delay in microseconds
+        uint16_t period_ms;             //!< Poll period of the ranging session
     };
 };
 
-_Static_assert(sizeof(union dw1000_rng_init_msg) == 14, "union dw1000_rng_init_msg must be 14 bytes");
+#if (CONFIG_DW1000_COMPACT_FRAMES)
+_Static_assert(sizeof(union dw1000_rng_init_msg) == DW1000_TWR_HDR_LEN + 4, "union dw1000_rng_init_msg must be 11 bytes");
+#else
+_Static_assert(sizeof(union dw1000_rng_init_msg) == DW1000_RNG_INIT_STD_LEN, "union dw1000_rng_init_msg must be 16 bytes");
+#endif
 
 union dw1000_poll_msg
 {
 //! Structure of range request frame
     struct
     {
+#if (CONFIG_DW1000_COMPACT_FRAMES)
+        uint8_t fctrl;                  //!< Frame control (0xA5 to indicate a multipurpose frame using 16-bit addressing)
+        uint8_t seq_num;                //!< Sequence number, incremented for each new frame
+#else
         uint16_t fctrl;                 //!< Frame control (0x8841 to indicate a data frame using 16-bit addressing)
         uint8_t seq_num;                //!< Sequence number, incremented for each new frame
         uint16_t pan_id;                //!< pan_id
+#endif
         uint16_t dst_addr;              //!< Destination address
         uint16_t src_addr;              //!< Source address
         uint8_t code;                   //!< Function code (0x61 to indicate the poll message)
     };
 };
 
-_Static_assert(sizeof(union dw1000_poll_msg) == 10, "union dw1000_poll_msg must be 10 bytes");
+_Static_assert(sizeof(union dw1000_poll_msg) == DW1000_TWR_HDR_LEN, "union dw1000_poll_msg must be the ranging header");
 
 union dw1000_resp_msg
 {
 //! Structure of range request frame
     struct
     {
+#if (CONFIG_DW1000_COMPACT_FRAMES)
+        uint8_t fctrl;                  //!< Frame control (0xA5 to indicate a multipurpose frame using 16-bit addressing)
+        uint8_t seq_num;                //!< Sequence number, incremented for each new frame
+#else
         uint16_t fctrl;                 //!< Frame control (0x8841 to indicate a data frame using 16-bit addressing)
         uint8_t seq_num;                //!< Sequence number, incremented for each new frame
         uint16_t pan_id;                //!< pan_id
+#endif
         uint16_t dst_addr;              //!< Destination address
         uint16_t src_addr;              //!< Source address
         uint8_t code;                   //!< Function code (0x50 to indicate the poll message)
-        uint32_t tof;                   //!< Calculated Time-of-Flight
+        uint32_t tof;                   //!< Time-of-Flight of the previous exchange (Q8), 0 if none
+        uint8_t tof_seq;                //!< Sequence number of the final message the tof was computed from
+#if (CONFIG_DW1000_SS_TWR)
+        uint32_t t_reply;               //!< Response TX timestamp minus poll RX timestamp (SS-TWR)
+#endif
     };
 };
 
-_Static_assert(sizeof(union dw1000_resp_msg) == 14, "union dw1000_resp_msg must be 14 bytes");
+#if (CONFIG_DW1000_SS_TWR)
+_Static_assert(sizeof(union dw1000_resp_msg) == DW1000_TWR_HDR_LEN + 9, "union dw1000_resp_msg must be the ranging header and 9 bytes");
+#else
+_Static_assert(sizeof(union dw1000_resp_msg) == DW1000_TWR_HDR_LEN + 5, "union dw1000_resp_msg must be the ranging header and 5 bytes");
+#endif
 
 union dw1000_final_msg
 {
 //! Structure of range request frame
     struct
     {
+#if (CONFIG_DW1000_COMPACT_FRAMES)
+        uint8_t fctrl;                  //!< Frame control (0xA5 to indicate a multipurpose frame using 16-bit addressing)
+        uint8_t seq_num;                //!< Sequence number, incremented for each new frame
+#else
         uint16_t fctrl;                 //!< Frame control (0x8841 to indicate a data frame using 16-bit addressing)
         uint8_t seq_num;                //!< Sequence number, incremented for each new frame
         uint16_t pan_id;                //!< pan_id
+#endif
         uint16_t dst_addr;              //!< Destination address
         uint16_t src_addr;              //!< Source address
         uint8_t code;                   //!< Function code (0x69 to indicate the poll message)
@@ -2572,7 +2881,53 @@ union dw1000_final_msg
     };
 };
 
-_Static_assert(sizeof(union dw1000_final_msg) == 18, "union dw1000_final_msg must be 18 bytes");
+_Static_assert(sizeof(union dw1000_final_msg) == DW1000_TWR_HDR_LEN + 8, "union dw1000_final_msg must be the ranging header and 8 bytes");
+
+union dw1000_sync_msg
+{
+//! Structure of clock sync frame
+    struct
+    {
+        uint16_t fctrl;                 //!< Frame control (0x8841 to indicate a data frame using 16-bit addressing)
+        uint8_t seq_num;                //!< Sequence number, incremented for each new frame
+        uint16_t pan_id;                //!< pan_id
+        uint16_t dst_addr;              //!< Broadcast address
+        uint16_t src_addr;              //!< Address of the reference anchor
+        uint8_t code;                   //!< Function code (0x2C to indicate the clock sync message)
+        uint8_t tx_stamp[5];            //!< TX timestamp of this frame in the reference clock
+    };
+};
+
+_Static_assert(sizeof(union dw1000_sync_msg) == 15, "union dw1000_sync_msg must be 15 bytes");
+
+union dw1000_data_msg
+{
+//! Structure of data link frame
+    struct
+    {
+        uint16_t fctrl;                 //!< Frame control (0x8861 to indicate a data frame with ACK request using 16-bit addressing)
+        uint8_t seq_num;                //!< Sequence number, echoed by the acknowledgement
+        uint16_t pan_id;                //!< pan_id
+        uint16_t dst_addr;              //!< Destination address
+        uint16_t src_addr;              //!< Source address
+        uint8_t code;                   //!< Function code (0x44 data, 0x45 first frame of a stream)
+        uint8_t payload[DW1000_DATA_PAYLOAD_MAX];
+    };
+};
+
+_Static_assert(sizeof(union dw1000_data_msg) == 10 + DW1000_DATA_PAYLOAD_MAX, "union dw1000_data_msg must be the data header and payload");
+
+union dw1000_ack_msg
+{
+//! Structure of the acknowledgement sent by AUTOACK
+    struct
+    {
+        uint16_t fctrl;                 //!< Frame control (0x0002 to indicate an acknowledgement)
+        uint8_t seq_num;                //!< Sequence number of the acknowledged frame
+    };
+};
+
+_Static_assert(sizeof(union dw1000_ack_msg) == 3, "union dw1000_ack_msg must be 3 bytes");
 
 #pragma pop
 
@@ -2585,6 +2940,189 @@ struct dw1000_reg
     uint8_t reg_file_type;
 };
 
+/**
+ * Clock sync with a reference anchor, the clock filter itself is in
+ * utility/clock_sync.c.
+ */
+struct dw1000_clock_sync
+{
+    uint64_t next_tx_us;                // Next sync frame (reference anchor)
+    uint64_t t_first_us;                // Time of the first sync frame received
+    struct clock_sync kf;
+    double res_sq;                      // Sum of squared residuals since the last report
+    uint16_t ref_addr;
+    uint8_t seq_num;
+};
+
+/**
+ * Wired timebase reset. The sync error is measured against the sync frames
+ * of the reference anchor when CONFIG_DW1000_CLOCK_SYNC is enabled as well.
+ */
+struct dw1000_ext_sync
+{
+    uint64_t next_pulse_us;             // Next SYNC pulse (master)
+    uint64_t local_ts;                  // Local RX timestamp of the last sync frame
+    double err_sum;                     // Sums of the sync error since the last report
+    double err_sq;
+    int64_t err_max;
+    uint32_t resets;                    // Timebase resets seen
+    uint32_t count;
+};
+
+struct dw1000_anchor_pos
+{
+    uint16_t addr;
+    float pos[3];
+};
+
+
+/**
+ * Latest range to each anchor of the anchor map and the last position fix.
+ */
+struct dw1000_multilat
+{
+    uint64_t t_range_us[MULTILAT_MAX_ANCHORS];  // Time of the last range, 0 when there is none
+    float range[MULTILAT_MAX_ANCHORS];          // m
+    uint8_t tof_seq[MULTILAT_MAX_ANCHORS];      // Final message of the last exchange with each anchor
+    uint8_t next;                               // Next anchor to poll
+    bool has_fix;
+    struct multilat_result fix;
+};
+
+#if (CONFIG_DW1000_RANGE_FILTER)
+_Static_assert(RANGE_FILTER_PEERS <= RANGE_FILTER_MAX_PEERS, "too many range filter peers");
+
+struct dw1000_range_filter
+{
+    struct range_filter kf;
+    uint32_t restarts;                  // Track restarts already traced
+    uint64_t cost_us;                   // Time spent in the filter
+};
+#endif
+
+struct dw1000_rate_ctrl
+{
+    uint16_t period_ms;                 // Current poll period, 0 until the first range
+    uint32_t faster;                    // Period halvings
+    uint32_t fix_airtime_us;            // Airtime of the frames of one fix, for the configured PHY
+};
+
+/**
+ * Receive window opened after a frame sent with WAIT4RESP, and the receiver
+ * on time spent in those windows. The on time is estimated from how the
+ * window closed, the DW1000 does not report it.
+ */
+struct dw1000_rx_window
+{
+    volatile bool open;                 // Closed by RXFCG, an RX error, RXPTO, RXRFTO or a late TX
+    uint32_t reply_us;                  // Receiver on time when the reply arrives
+    uint32_t timeout_us;                // Receiver on time when the window times out
+    uint32_t pretoc_us;                 // Receiver on time when no preamble shows up
+    uint32_t delay_us;                  // W4R_TIM of the window
+    uint32_t count;
+    uint32_t timeouts;                  // Frame lost, RXRFTO
+    uint32_t empty;                     // Nothing on air, RXPTO
+    uint32_t errors;                    // Reply received in error, RX_ERR
+    uint32_t late;                      // Frame sent late and dropped, the receiver never turned on
+    uint64_t on_us;                     // Estimated receiver on time of all windows
+    uint64_t saved_us;                  // Receiver on time saved by W4R_TIM
+};
+
+enum dw1000_dx_op
+{
+    DW1000_DX_NONE = 0,
+    DW1000_DX_TX,                       // TXDLYS
+    DW1000_DX_RX,                       // RXDLYE
+};
+
+/**
+ * Delayed starts at DX_TIME, and those found late by HPDWARN.
+ */
+struct dw1000_dx_stats
+{
+    volatile uint8_t pending;           // enum dw1000_dx_op of the last delayed start
+    uint32_t tx;
+    uint32_t tx_late;                   // Dropped and failed as a reply timeout
+    uint32_t rx;
+    uint32_t rx_late;                   // Receiver turned on at once instead
+};
+
+/**
+ * Frames accepted and rejected by frame filtering, from the 12-bit DIG_DIAG
+ * event counters EVC_FCG and EVC_FFR.
+ */
+struct dw1000_ff_stats
+{
+    bool enabled;
+    uint16_t evc_fcg;                   // Counter values at the last poll
+    uint16_t evc_ffr;
+    uint32_t accepted;
+    uint32_t rejected;
+};
+
+#if (CONFIG_DW1000_TX_QUEUE)
+/**
+ * Frames waiting in the regions of the TX buffer. The main loop loads frames
+ * and starts them, the interrupt handler retires the frame on air on TXFRS,
+ * or dw1000_txq_recover() does if that interrupt goes missing.
+ */
+struct dw1000_tx_queue
+{
+    uint16_t flen[TXQ_SLOTS];           // Frame length including the FCS
+    uint8_t loaded;                     // Frames loaded, the next one goes into slot loaded % TXQ_SLOTS
+    volatile uint8_t sent;              // Frames sent, the next one starts from slot sent % TXQ_SLOTS
+    volatile bool on_air;               // The frame in slot sent % TXQ_SLOTS was started
+    uint32_t overlapped;                // Frames loaded while the one before was on air
+    uint32_t recovered;                 // Frames retired after their TXFRS interrupt went missing
+};
+#endif
+
+#if (CONFIG_DW1000_DATA_LINK)
+struct dw1000_link_slot
+{
+    bool valid;                         // Receive side: frame waiting for delivery
+    bool acked;                         // Send side: frame acknowledged
+    bool queued;                        // Send side: frame loaded into the TX queue and not started yet
+    uint16_t len;                       // Payload length
+    uint8_t retries;
+    uint64_t tx_us;                     // Last try
+    union dw1000_data_msg msg;
+};
+
+/**
+ * Sliding window of the data link, indexed by sequence number modulo
+ * LINK_WINDOW on both sides.
+ */
+struct dw1000_link
+{
+    struct dw1000_link_slot tx[LINK_WINDOW];
+    struct dw1000_link_slot rx[LINK_WINDOW];
+    struct dw1000_link_slot *queued[TXQ_SLOTS];  // Frame in each slot of the TX queue
+    struct mac_frame_match rx_match;    // Data frames for my_addr
+    uint8_t tx_seq;                     // Next new sequence number
+    uint8_t tx_base;                    // Oldest unacknowledged sequence number
+    uint8_t rx_next;                    // Next sequence number to deliver
+    bool rx_synced;
+    uint32_t rx_offset;                 // Stream offset of the next delivered byte
+    uint32_t frames;                    // Frames sent, retransmissions included
+    uint32_t retransmits;
+    uint32_t timeouts;                  // Frames without acknowledgement
+    uint32_t duplicates;                // Frames received again after a lost acknowledgement
+    uint32_t bad_bytes;                 // Delivered bytes that do not match the bench pattern
+    uint64_t bytes;                     // Payload acknowledged or delivered
+};
+#endif
+
+struct dw1000_twr_stats
+{
+    uint64_t t_start_us;                // Time of the first exchange
+    uint32_t fixes;                     // Completed ranging exchanges
+    uint32_t attempts;                  // Ranging cycles started (tag)
+    uint32_t discoveries;               // Cycles that went through blink and ranging init (tag)
+    uint32_t tx_frames;
+    uint32_t rx_frames;
+};
+
 struct dw1000_context
 {
     uint8_t tx_buf[64] __attribute__((aligned(4)));
@@ -2598,6 +3136,13 @@ struct dw1000_context
      */
     union DW1000_REG_SYS_CFG sys_cfg;
     union DW1000_REG_RX_FWTO rx_fwto;
+    union DW1000_REG_ACK_RESP_T ack_resp_t;
+    struct dw1000_rx_window rx_window;
+    struct dw1000_dx_stats dx;
+    struct dw1000_ff_stats ff;
+#if (CONFIG_DW1000_DATA_LINK)
+    struct dw1000_link link;
+#endif
     union DW1000_REG_RX_SNIFF rx_sniff;
     union DW1000_SUB_REG_GPIO_MODE gpio_mode;
     union DW1000_REG_AON aon;
@@ -2628,16 +3173,31 @@ struct dw1000_context
     union DW1000_SUB_REG_LDE_CFG2 lde_cfg2;
     union DW1000_SUB_REG_LDE_REPC lde_repc;
     union DW1000_SUB_REG_LDE_RXANTD lde_rxantd;
+    union DW1000_REG_TX_ANTD tx_antd;
     union DW1000_SUB_REG_TC_PGDELAY tc_pgdelay;
     union DW1000_SUB_REG_PMSC_CTRL0 pmsc_ctrl0;
     union DW1000_SUB_REG_EC_CTRL ec_ctrl;
     //
     uint32_t twr_state;
     volatile uint32_t listen_to;
-    uint16_t tx_delay_ms;
+    uint16_t tx_delay_us;
     uint16_t tar_addr;
     uint16_t my_addr;
     uint8_t seq_num;
+    struct cell_radio cell;             // enum dw1000_chan_sel and dw1000_pcode_sel, applied by dw1000_init()
+    struct mac_frame_match twr_match;   // Ranging frames for my_addr, the sequence number and code are added per frame
+    /**
+     * Ranging session
+     */
+    uint64_t next_fix_us;
+    uint16_t period_ms;
+    uint8_t fail_cnt;
+    struct backoff blink_backoff;       // Blink period of an unpaired tag, failed ranging inits back it off
+    bool paired;
+    struct dw1000_twr_stats stats;
+    struct dw1000_clock_sync sync;
+    struct dw1000_ext_sync ext_sync;
+    uint8_t pac_size;                   // Preamble acquisition chunk, in preamble symbols
     bool is_standard_sfd;
     bool is_txprf_16mhz;
     bool lde_run_enable;
@@ -2645,6 +3205,29 @@ struct dw1000_context
     bool catch_poll_txtfs;
     bool catch_resp_txtfs;
     bool catch_final_txtfs;
+    /**
+     * Pre-staged TX frame
+     */
+    volatile bool tx_done;              // Set on TXFRS, the TX buffer can be written again
+    bool tx_staged;                     // TX_FCTRL and TX_BUFFER hold the next frame
+#if (CONFIG_DW1000_TX_QUEUE)
+    struct dw1000_tx_queue txq;
+#endif
+    /**
+     * Range report carried in the response
+     */
+    uint32_t tof_q8;                    // Last time of flight (anchor: computed, tag: reported)
+    uint16_t tof_addr;                  // Peer of the last time of flight
+    uint8_t tof_seq;                    // Sequence number of the final message of that exchange
+#if (CONFIG_DW1000_MULTILAT)
+    struct dw1000_multilat multilat;
+#endif
+#if (CONFIG_DW1000_RANGE_FILTER)
+    struct dw1000_range_filter range_filter;
+#endif
+#if (CONFIG_DW1000_ADAPTIVE_RATE)
+    struct dw1000_rate_ctrl rate;
+#endif
 };
 
 
@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "backoff.h"
+
+/**
+ * @brief Delay to the next attempt.
+ *
+ * @param[in] b          Backoff state.
+ * @param[in] r          Uniform random number.
+ *
+ * @return Delay in us.
+ */
+uint32_t backoff_delay_us(const struct backoff *b, uint32_t r)
+{
+    uint8_t exp = (b->fails > b->max_exp) ? b->max_exp : b->fails;
+    uint32_t period = b->period_us << exp;
+    uint32_t lo     = period / 100 * (100 - b->jitter_pct);
+    uint32_t span   = period / 100 * (2 * b->jitter_pct);
+    return lo + (uint32_t)(((uint64_t)r * span) >> 32);
+}
+
+/**
+ * @brief Record the outcome of an attempt, a success resets the backoff.
+ */
+void backoff_result(struct backoff *b, bool ok)
+{
+    if (ok)
+        b->fails = 0;
+    else if (b->fails < b->max_exp)
+        b->fails++;
+}
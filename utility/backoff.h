@@ -0,0 +1,29 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Randomised binary exponential backoff of a periodic transmission. The
+ * period is drawn from period_us +-jitter_pct, and doubles after each failed
+ * attempt up to 2^max_exp times.
+ */
+struct backoff
+{
+    uint32_t period_us;
+    uint8_t jitter_pct;
+    uint8_t max_exp;
+    uint8_t fails;                      // Consecutive failed attempts
+};
+
+uint32_t backoff_delay_us(const struct backoff *b, uint32_t r);
+void backoff_result(struct backoff *b, bool ok);
+
+#endif  // ~ BACKOFF_H
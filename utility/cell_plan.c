@@ -0,0 +1,79 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "cell_plan.h"
+
+#include <stdbool.h>
+
+/**
+ * @brief Assign a channel and preamble code to each cell of a cell map.
+ *
+ * Cells closer than reuse_dist_m are neighbours. The cells are taken in
+ * order of decreasing number of neighbours, and each gets the candidate that
+ * costs least against its planned neighbours: a shared channel and code
+ * collides, a shared channel with another code only contends for airtime.
+ * Ties go to the first candidate, so cells out of range of each other reuse
+ * the same channel and code.
+ *
+ * @param[in]  map           Cell centres.
+ * @param[in]  cells         Cells in the map, up to CELL_PLAN_MAX.
+ * @param[in]  reuse_dist_m  Distance below which two cells hear each other.
+ * @param[in]  cand          Channels and codes to choose from, the preferred
+ *                           one first.
+ * @param[in]  n_cand        Number of candidates.
+ * @param[out] plan          Channel and preamble code of each cell.
+ *
+ * @return Pairs of neighbours left on the same channel and code, -1 for an
+ *         empty or oversized map or no candidate.
+ */
+int cell_plan(const struct cell_pos *map, int cells, float reuse_dist_m,
+    const struct cell_radio *cand, int n_cand, struct cell_radio *plan)
+{
+    if ((cells < 1) || (cells > CELL_PLAN_MAX) || (n_cand < 1))
+        return -1;
+
+    bool nbr[CELL_PLAN_MAX][CELL_PLAN_MAX] = {0};
+    int degree[CELL_PLAN_MAX] = {0};
+    for (int i = 0; i < cells; i++) {
+        for (int j = i + 1; j < cells; j++) {
+            float dx = map[i].pos[0] - map[j].pos[0];
+            float dy = map[i].pos[1] - map[j].pos[1];
+            if (dx * dx + dy * dy < reuse_dist_m * reuse_dist_m) {
+                nbr[i][j] = nbr[j][i] = true;
+                degree[i]++;
+                degree[j]++;
+            }
+        }
+    }
+
+    bool planned[CELL_PLAN_MAX] = {0};
+    int shared = 0;
+    for (int k = 0; k < cells; k++) {
+        int i = -1;
+        for (int j = 0; j < cells; j++)
+            if (!planned[j] && ((i < 0) || (degree[j] > degree[i])))
+                i = j;
+
+        int best = 0, best_cost = INT32_MAX;
+        for (int c = 0; c < n_cand; c++) {
+            int cost = 0;
+            for (int j = 0; j < cells; j++) {
+                if (!planned[j] || !nbr[i][j] || (plan[j].chan != cand[c].chan))
+                    continue;
+                cost += (plan[j].pcode == cand[c].pcode) ? 100 : 1;
+            }
+            if (cost < best_cost) {
+                best      = c;
+                best_cost = cost;
+            }
+        }
+        plan[i]    = cand[best];
+        planned[i] = true;
+        shared    += best_cost / 100;
+    }
+
+    return shared;
+}
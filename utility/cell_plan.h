@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef CELL_PLAN_H
+#define CELL_PLAN_H
+
+#include <stdint.h>
+
+#define CELL_PLAN_MAX           (16)    // Cells in a cell map
+
+/**
+ * Channel and preamble code of a ranging cell.
+ */
+struct cell_radio
+{
+    uint8_t chan;
+    uint8_t pcode;
+};
+
+/**
+ * Centre (x, y) of a ranging cell, in metres.
+ */
+struct cell_pos
+{
+    float pos[2];
+};
+
+int cell_plan(const struct cell_pos *map, int cells, float reuse_dist_m,
+    const struct cell_radio *cand, int n_cand, struct cell_radio *plan);
+
+#endif  // ~ CELL_PLAN_H
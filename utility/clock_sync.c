@@ -0,0 +1,93 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "clock_sync.h"
+#include "tdoa.h"
+
+#include <math.h>
+
+/**
+ * @brief Feed one sync frame into the filter.
+ *
+ * @param[in] s          Filter state.
+ * @param[in] local_ts   Local RX timestamp of the sync frame.
+ * @param[in] ref_ts     Reference TX timestamp of the sync frame plus the
+ *                       time of flight from the reference.
+ *
+ * @return Residual of the frame against the prediction (ticks), 0 for the
+ *         first frame.
+ */
+double clock_sync_update(struct clock_sync *s, uint64_t local_ts, uint64_t ref_ts)
+{
+    if (!s->count++) {
+        s->local_ts = local_ts;
+        s->offset   = (double)tdoa_stamp_diff(ref_ts, local_ts);
+        s->drift    = 0;
+        s->p00      = s->r;
+        s->p01      = 0;
+        s->p11      = s->drift0 * s->drift0;
+        s->nis      = 0;
+        s->in_lock  = 0;
+        s->outliers = 0;
+        return 0;
+    }
+
+    // Predict
+    double dt = (double)tdoa_stamp_diff(local_ts, s->local_ts) / CLOCK_SYNC_TICK_HZ;
+    double offset = s->offset + s->drift * dt;
+    double p00 = s->p00 + dt * (2.0 * s->p01 + dt * s->p11) + s->q * dt * dt * dt / 3.0;
+    double p01 = s->p01 + dt * s->p11 + s->q * dt * dt / 2.0;
+    double p11 = s->p11 + s->q * dt;
+
+    // Update, the residual is taken modulo 2^40 around the prediction
+    int64_t pred = llround(offset);
+    double y  = (double)tdoa_stamp_diff(ref_ts - local_ts, (uint64_t)pred) - (offset - (double)pred);
+    double sv = p00 + s->r;
+    s->nis = y * y / sv;
+    if (s->locked && (s->nis > s->lock_nis)) {
+        if (++s->outliers >= s->unlock_count) {
+            // The reference clock jumped or the model no longer holds
+            s->locked = false;
+            s->count  = 0;
+            return y;
+        }
+        // Weigh the outlier as if it sat on the bound, a spike pulls little
+        // while a real change of drift is still followed
+        sv = y * y / s->lock_nis;
+    } else {
+        s->outliers = 0;
+    }
+
+    double k0 = p00 / sv;
+    double k1 = p01 / sv;
+    s->offset   = offset + k0 * y;
+    s->drift    = s->drift + k1 * y;
+    s->p00      = (1.0 - k0) * p00;
+    s->p01      = (1.0 - k0) * p01;
+    s->p11      = p11 - k1 * p01;
+    s->local_ts = local_ts;
+
+    s->in_lock = (s->nis <= s->lock_nis) ? s->in_lock + 1 : 0;
+    if (s->in_lock >= s->lock_count)
+        s->locked = true;
+    return y;
+}
+
+/**
+ * @brief Convert a local timestamp into the clock of the reference anchor.
+ *
+ * @retval 0  Converted.
+ * @retval -1 The filter is not locked yet.
+ */
+int clock_sync_to_ref(const struct clock_sync *s, uint64_t local_ts, uint64_t *ref_ts)
+{
+    if (!s->locked)
+        return -1;
+
+    double dt = (double)tdoa_stamp_diff(local_ts, s->local_ts) / CLOCK_SYNC_TICK_HZ;
+    *ref_ts = (local_ts + (uint64_t)llround(s->offset + s->drift * dt)) & TDOA_STAMP_MASK;
+    return 0;
+}
@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CLOCK_SYNC_TICK_HZ      (63.8976e9)     // DW1000 timestamp unit
+
+/**
+ * Clock of a reference anchor tracked with a two state Kalman filter:
+ * offset = reference - local (ticks) and its drift (ticks/s). The noise
+ * parameters and the lock criterion are set by the owner, the rest starts
+ * zeroed.
+ *
+ * A sync frame is judged on its normalized innovation y^2 / S, chi-square
+ * with one degree of freedom while the model holds. Once locked, a frame
+ * above lock_nis is weighted down to the bound, and a run of unlock_count
+ * of them drops the lock and starts the filter over.
+ */
+struct clock_sync
+{
+    double r;                           // Timestamp noise variance (ticks^2)
+    double q;                           // Drift random walk density (ticks^2/s^3)
+    double drift0;                      // Initial drift uncertainty (ticks/s)
+    double lock_nis;                    // Chi-square bound on y^2 / S of a sync frame in lock
+    uint16_t lock_count;                // Consecutive sync frames within lock_nis to lock
+    uint16_t unlock_count;              // Consecutive outliers to drop the lock
+    uint64_t local_ts;                  // Local RX timestamp of the last sync frame
+    double offset;                      // Offset at local_ts
+    double drift;
+    double p00, p01, p11;               // Covariance
+    double nis;                         // y^2 / S of the last sync frame
+    uint32_t count;                     // Sync frames taken since the (re)start
+    uint16_t in_lock;                   // Consecutive sync frames within lock_nis
+    uint16_t outliers;                  // Consecutive sync frames above lock_nis while locked
+    bool locked;
+};
+
+double clock_sync_update(struct clock_sync *s, uint64_t local_ts, uint64_t ref_ts);
+int clock_sync_to_ref(const struct clock_sync *s, uint64_t local_ts, uint64_t *ref_ts);
+
+#endif  // ~ CLOCK_SYNC_H
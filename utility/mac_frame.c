@@ -0,0 +1,260 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "mac_frame.h"
+
+static const uint8_t m_addr_len[4] = {0, 0, 2, 8};
+
+static uint64_t mac_frame_get(const uint8_t *p, uint8_t len)
+{
+    uint64_t v = 0;
+    for (int i = len - 1; i >= 0; i--)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+static void mac_frame_put(uint8_t *p, uint64_t v, uint8_t len)
+{
+    for (int i = 0; i < len; i++, v >>= 8)
+        p[i] = (uint8_t)v;
+}
+
+/**
+ * @brief Offsets of the header fields for a frame control field.
+ *
+ * A multipurpose frame with the one octet frame control, such as a blink,
+ * carries no PAN ID. Up to frame version 1 (802.15.4-2006) the destination
+ * PAN ID comes with the destination address, and the source PAN ID with the
+ * source address unless PAN ID compression is set and both addresses are
+ * present. Frame version 2 follows table 7-2 of 802.15.4-2015 instead.
+ *
+ * @retval 0  Layout decoded.
+ * @retval -1 Reserved frame type, addressing mode or frame version, security
+ *            enabled (the auxiliary security header is not supported), or a
+ *            version 2 frame with a suppressed sequence number or IEs.
+ */
+static int mac_frame_layout(struct mac_frame *f, uint16_t fctrl)
+{
+    uint8_t dam, sam, ofs;
+    bool has_pan, pan_comp = false, fver_2015 = false;
+
+    if (((fctrl & 0x7) == IEEE_802_15_4_FTYPE_MULTIPURPOSE) && !(fctrl & 0x08)) {
+        fctrl  &= 0xFF;
+        dam     = (fctrl >> 4) & 0x3;
+        sam     = (fctrl >> 6) & 0x3;
+        ofs     = 1;
+        has_pan = false;
+    } else {
+        union ieee_802_15_4_mac_fctrl fc = {.value = fctrl};
+        if ((fc.ftype > IEEE_802_15_4_FTYPE_MAC_CMD) || fc.se || (fc.fver == IEEE_802_15_4_FVER_RSVD))
+            return -1;
+        fver_2015 = (fc.fver == IEEE_802_15_4_FVER_2015);
+        if (fver_2015 && (fc.sn_supp || fc.ie))
+            return -1;
+        dam      = fc.dam;
+        sam      = fc.sam;
+        ofs      = 2;
+        has_pan  = true;
+        pan_comp = fc.pan_id;
+    }
+    if ((dam == IEEE_802_15_4_DAM_RSVD) || (sam == IEEE_802_15_4_SAM_RSVD))
+        return -1;
+
+    f->fctrl.value = fctrl;
+    f->seq_ofs     = ofs++;
+    f->dst_len     = m_addr_len[dam];
+    f->src_len     = m_addr_len[sam];
+    f->dst_pan_ofs = f->dst_ofs = f->src_pan_ofs = f->src_ofs = 0;
+
+    bool dst_pan = false, src_pan = false;
+    if (has_pan && !fver_2015) {
+        dst_pan = f->dst_len;
+        src_pan = f->src_len && !(pan_comp && f->dst_len);
+    } else if (has_pan) {
+        // 802.15.4-2015 table 7-2
+        if (!f->dst_len && !f->src_len) {
+            dst_pan = pan_comp;
+        } else if (!f->src_len) {
+            dst_pan = !pan_comp;
+        } else if (!f->dst_len) {
+            src_pan = !pan_comp;
+        } else if ((f->dst_len == 8) && (f->src_len == 8)) {
+            dst_pan = !pan_comp;
+        } else {
+            dst_pan = true;
+            src_pan = !pan_comp;
+        }
+    }
+
+    if (dst_pan) {
+        f->dst_pan_ofs = ofs;
+        ofs += 2;
+    }
+    if (f->dst_len) {
+        f->dst_ofs = ofs;
+        ofs += f->dst_len;
+    }
+    if (src_pan) {
+        f->src_pan_ofs = ofs;
+        ofs += 2;
+    }
+    if (f->src_len) {
+        f->src_ofs = ofs;
+        ofs += f->src_len;
+    }
+    f->payload_ofs = ofs;
+
+    return 0;
+}
+
+/**
+ * @brief Decode the header of a received frame in place.
+ *
+ * @param[out] f         View of the frame.
+ * @param[in]  buf       The frame.
+ * @param[in]  len       Frame length without the FCS.
+ *
+ * @retval 0  The header is valid and lies within the frame.
+ * @retval -1 Unsupported frame control or truncated header.
+ */
+int mac_frame_parse(struct mac_frame *f, void *buf, uint16_t len)
+{
+    const uint8_t *p = buf;
+    if ((f == NULL) || (buf == NULL) || (len < 2))
+        return -1;
+
+    if (mac_frame_layout(f, (uint16_t)(p[0] | (p[1] << 8))) || (f->payload_ofs > len))
+        return -1;
+
+    f->buf  = buf;
+    f->size = len;
+    f->len  = len;
+
+    return 0;
+}
+
+/**
+ * @brief Start a frame in place in buf: the frame control and sequence number
+ * are written and the addresses are cleared. The caller then fills in the
+ * addresses and the payload, and sets the payload length.
+ *
+ * @param[out] f         View of the frame.
+ * @param[in]  buf       Buffer the frame is built in.
+ * @param[in]  size      Size of buf.
+ * @param[in]  fctrl     Frame control, only the low octet for a multipurpose
+ *                       frame with the one octet frame control.
+ * @param[in]  seq_num   Sequence number.
+ */
+int mac_frame_build(struct mac_frame *f, void *buf, uint16_t size, uint16_t fctrl, uint8_t seq_num)
+{
+    if ((f == NULL) || (buf == NULL) || mac_frame_layout(f, fctrl) || (f->payload_ofs > size))
+        return -1;
+
+    f->buf  = buf;
+    f->size = size;
+    f->len  = f->payload_ofs;
+    memset(f->buf, 0, f->payload_ofs);
+    mac_frame_put(f->buf, f->fctrl.value, f->seq_ofs);
+    f->buf[f->seq_ofs] = seq_num;
+
+    return 0;
+}
+
+int mac_frame_set_payload_len(struct mac_frame *f, uint16_t len)
+{
+    if (f->payload_ofs + len > f->size)
+        return -1;
+
+    f->len = f->payload_ofs + len;
+    return 0;
+}
+
+void mac_frame_set_dst(struct mac_frame *f, uint16_t pan_id, uint64_t addr)
+{
+    if (f->dst_pan_ofs)
+        mac_frame_put(&f->buf[f->dst_pan_ofs], pan_id, 2);
+    if (f->dst_len)
+        mac_frame_put(&f->buf[f->dst_ofs], addr, f->dst_len);
+}
+
+/**
+ * @brief Write the source address. The PAN ID is only written when the
+ * frame carries a source PAN ID, with PAN ID compression it is the
+ * destination PAN ID.
+ */
+void mac_frame_set_src(struct mac_frame *f, uint16_t pan_id, uint64_t addr)
+{
+    if (f->src_pan_ofs)
+        mac_frame_put(&f->buf[f->src_pan_ofs], pan_id, 2);
+    if (f->src_len)
+        mac_frame_put(&f->buf[f->src_ofs], addr, f->src_len);
+}
+
+uint64_t mac_frame_dst(const struct mac_frame *f)
+{
+    return f->dst_len ? mac_frame_get(&f->buf[f->dst_ofs], f->dst_len) : 0;
+}
+
+uint64_t mac_frame_src(const struct mac_frame *f)
+{
+    return f->src_len ? mac_frame_get(&f->buf[f->src_ofs], f->src_len) : 0;
+}
+
+uint16_t mac_frame_dst_pan(const struct mac_frame *f)
+{
+    return f->dst_pan_ofs ? (uint16_t)mac_frame_get(&f->buf[f->dst_pan_ofs], 2) : 0;
+}
+
+uint16_t mac_frame_src_pan(const struct mac_frame *f)
+{
+    if (f->src_pan_ofs)
+        return (uint16_t)mac_frame_get(&f->buf[f->src_pan_ofs], 2);
+    return mac_frame_dst_pan(f);
+}
+
+/**
+ * @brief Template that accepts frames with exactly this frame control, and
+ * with this destination PAN ID and address when the frame carries them. The
+ * sequence number and payload octets can be added with mac_frame_match_seq()
+ * and mac_frame_match_byte().
+ */
+int mac_frame_match_init(struct mac_frame_match *m, uint16_t fctrl, uint16_t pan_id, uint64_t dst_addr)
+{
+    struct mac_frame f;
+    uint8_t hdr[MAC_FRAME_HDR_MAX];
+    if ((m == NULL) || mac_frame_build(&f, hdr, sizeof(hdr), fctrl, 0))
+        return -1;
+    mac_frame_set_dst(&f, pan_id, dst_addr);
+
+    memset(m, 0, sizeof(*m));
+    m->seq_ofs     = f.seq_ofs;
+    m->payload_ofs = f.payload_ofs;
+    for (uint8_t i = 0; i < f.seq_ofs; i++)
+        mac_frame_match_byte(m, i, hdr[i], 0xFF);
+    if (f.dst_pan_ofs) {
+        for (uint8_t i = 0; i < 2; i++)
+            mac_frame_match_byte(m, f.dst_pan_ofs + i, hdr[f.dst_pan_ofs + i], 0xFF);
+    }
+    for (uint8_t i = 0; i < f.dst_len; i++)
+        mac_frame_match_byte(m, f.dst_ofs + i, hdr[f.dst_ofs + i], 0xFF);
+
+    return 0;
+}
+
+/**
+ * @brief Compare the bits of mask in the octet at ofs as well, octets past
+ * MAC_FRAME_MATCH_BYTES are ignored.
+ */
+void mac_frame_match_byte(struct mac_frame_match *m, uint8_t ofs, uint8_t value, uint8_t mask)
+{
+    if (ofs >= MAC_FRAME_MATCH_BYTES)
+        return;
+
+    uint8_t *v = (uint8_t *)m->value;
+    uint8_t *k = (uint8_t *)m->mask;
+    v[ofs] = value & mask;
+    k[ofs] = mask;
+}
@@ -0,0 +1,164 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef MAC_FRAME_H
+#define MAC_FRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define MAC_FRAME_HDR_MAX       (23)    // Frame control, sequence number, two PAN IDs and two extended addresses
+#define MAC_FRAME_MATCH_BYTES   (16)    // Header bytes covered by a masked compare
+
+/**
+ * This frame type field is a 3-bit field that indicates the type of frame.
+ * Below lists the eight possible frame types and their assignment in IEEE
+ * 802.15.4-2011.
+ */
+enum ieee_802_15_4_frame_type
+{
+    IEEE_802_15_4_FTYPE_BEACON = 0,
+    IEEE_802_15_4_FTYPE_DATA = 1,
+    IEEE_802_15_4_FTYPE_ACK,
+    IEEE_802_15_4_FTYPE_MAC_CMD,
+    IEEE_802_15_4_FTYPE_RSVD,
+    IEEE_802_15_4_FTYPE_MULTIPURPOSE,   // A blink uses its one octet frame control
+};
+
+/**
+ * The destination addressing mode field (2-bits) specifies whether the frame
+ * contains a destination address and if so the size of the address field.
+ */
+enum ieee_802_15_4_dst_addr_mode
+{
+    IEEE_802_15_4_DAM_NO_ADDR = 0,
+    IEEE_802_15_4_DAM_RSVD = 1,
+    IEEE_802_15_4_DAM_SHORT_ADDR,
+    IEEE_802_15_4_DAM_EXT_ADDR,
+};
+
+/**
+ * The source addressing mode field (2-bits) specifies whether the frame
+ * contains a source address and if so the size of the address field.
+ */
+enum ieee_802_15_4_src_addr_mode
+{
+    IEEE_802_15_4_SAM_NO_ADDR = 0,
+    IEEE_802_15_4_SAM_RSVD = 1,
+    IEEE_802_15_4_SAM_SHORT_ADDR,
+    IEEE_802_15_4_SAM_EXT_ADDR,
+};
+
+/**
+ * The frame version field (2-bits) selects the edition of the standard whose
+ * header rules apply, PAN ID compression above all.
+ */
+enum ieee_802_15_4_frame_version
+{
+    IEEE_802_15_4_FVER_2003 = 0,
+    IEEE_802_15_4_FVER_2006,
+    IEEE_802_15_4_FVER_2015,
+    IEEE_802_15_4_FVER_RSVD,
+};
+
+/**
+ * The frame control field in the MAC header
+ */
+union ieee_802_15_4_mac_fctrl
+{
+    struct
+    {
+        uint16_t ftype   : 3;           // Bit[2:0] Frame Type.
+        uint16_t se      : 1;           // Bit[3] Security Enabled.
+        uint16_t fpend   : 1;           // Bit[4] Frame Pending.
+        uint16_t ack_req : 1;           // Bit[5] ACK Request .
+        uint16_t pan_id  : 1;           // Bit[6] PAN ID Compress.
+        uint16_t rsvd    : 1;           // Bit[7] Reserved.
+        uint16_t sn_supp : 1;           // Bit[8] Sequence Number Suppression, frame version 2.
+        uint16_t ie      : 1;           // Bit[9] IE Present, frame version 2.
+        uint16_t dam     : 2;           // Bit[11:10] Dest. Address Mode.
+        uint16_t fver    : 2;           // Bit[13:12] Frame Version.
+        uint16_t sam     : 2;           // Bit[15:14] Source Address Mode.
+    };
+    uint16_t value;
+};
+
+/**
+ * View of a MAC frame in place in a buffer. The frame control field is decoded
+ * into the offsets of the header fields, which are then read and written
+ * directly in the buffer.
+ */
+struct mac_frame
+{
+    uint8_t *buf;
+    uint16_t size;                      // Bytes available in buf
+    uint16_t len;                       // Frame length without the FCS
+    union ieee_802_15_4_mac_fctrl fctrl;
+    uint8_t seq_ofs;                    // 1 after the one octet frame control of a multipurpose frame, else 2
+    uint8_t dst_pan_ofs;                // Offsets of the header fields, 0 when the field is absent
+    uint8_t dst_ofs;
+    uint8_t src_pan_ofs;
+    uint8_t src_ofs;
+    uint8_t dst_len;                    // Address length: 0, 2 or 8
+    uint8_t src_len;
+    uint8_t payload_ofs;                // Length of the MAC header
+};
+
+/**
+ * Expected content of the first MAC_FRAME_MATCH_BYTES of a frame and the bits
+ * that are compared.
+ */
+struct mac_frame_match
+{
+    uint64_t value[2];
+    uint64_t mask[2];
+    uint8_t seq_ofs;
+    uint8_t payload_ofs;
+};
+
+int mac_frame_parse(struct mac_frame *f, void *buf, uint16_t len);
+int mac_frame_build(struct mac_frame *f, void *buf, uint16_t size, uint16_t fctrl, uint8_t seq_num);
+int mac_frame_set_payload_len(struct mac_frame *f, uint16_t len);
+void mac_frame_set_dst(struct mac_frame *f, uint16_t pan_id, uint64_t addr);
+void mac_frame_set_src(struct mac_frame *f, uint16_t pan_id, uint64_t addr);
+uint64_t mac_frame_dst(const struct mac_frame *f);
+uint64_t mac_frame_src(const struct mac_frame *f);
+uint16_t mac_frame_dst_pan(const struct mac_frame *f);
+uint16_t mac_frame_src_pan(const struct mac_frame *f);
+
+int mac_frame_match_init(struct mac_frame_match *m, uint16_t fctrl, uint16_t pan_id, uint64_t dst_addr);
+void mac_frame_match_byte(struct mac_frame_match *m, uint8_t ofs, uint8_t value, uint8_t mask);
+
+static inline uint8_t *mac_frame_payload(const struct mac_frame *f)
+{
+    return f->buf + f->payload_ofs;
+}
+
+static inline uint8_t mac_frame_seq(const struct mac_frame *f)
+{
+    return f->buf[f->seq_ofs];
+}
+
+static inline void mac_frame_match_seq(struct mac_frame_match *m, uint8_t seq_num)
+{
+    mac_frame_match_byte(m, m->seq_ofs, seq_num, 0xFF);
+}
+
+/**
+ * @brief Compare the header of the frame in buf with the template in one go.
+ *
+ * @note buf must hold at least MAC_FRAME_MATCH_BYTES, bytes past the end of a
+ *       shorter frame are read but have to be masked out.
+ */
+static inline bool mac_frame_match(const struct mac_frame_match *m, const void *buf)
+{
+    uint64_t w[2];
+    memcpy(w, buf, sizeof(w));
+    return !(((w[0] ^ m->value[0]) & m->mask[0]) | ((w[1] ^ m->value[1]) & m->mask[1]));
+}
+
+#endif  // ~ MAC_FRAME_H
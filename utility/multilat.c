@@ -0,0 +1,207 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "multilat.h"
+
+#include <math.h>
+#include <string.h>
+
+/**
+ * @brief Solve the symmetric positive definite system a * x = b of size dim
+ * (2 or 3) in place with a Cholesky decomposition.
+ *
+ * @retval 0  Solved, x is left in b.
+ * @retval -1 The system is singular or badly conditioned.
+ */
+static int multilat_cholesky(float a[3][3], float b[3], int dim)
+{
+    float max_diag = 0.0f;
+    for (int i = 0; i < dim; i++)
+        max_diag = fmaxf(max_diag, a[i][i]);
+
+    for (int j = 0; j < dim; j++) {
+        float d = a[j][j];
+        for (int k = 0; k < j; k++)
+            d -= a[j][k] * a[j][k];
+        if (d <= max_diag * 1e-6f)
+            return -1;
+        a[j][j] = sqrtf(d);
+        for (int i = j + 1; i < dim; i++) {
+            float s = a[i][j];
+            for (int k = 0; k < j; k++)
+                s -= a[i][k] * a[j][k];
+            a[i][j] = s / a[j][j];
+        }
+    }
+
+    // Forward then backward substitution with the lower triangle
+    for (int i = 0; i < dim; i++) {
+        for (int k = 0; k < i; k++)
+            b[i] -= a[i][k] * b[k];
+        b[i] /= a[i][i];
+    }
+    for (int i = dim - 1; i >= 0; i--) {
+        for (int k = i + 1; k < dim; k++)
+            b[i] -= a[k][i] * b[k];
+        b[i] /= a[i][i];
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Initial position from the linearised problem: subtracting the
+ * sphere equation of the first anchor from the others leaves a linear
+ * system in the unknown coordinates.
+ */
+static int multilat_linear(const struct multilat_meas *meas, int n, int dim, float *pos)
+{
+    const float *a0 = meas[0].pos;
+    float ata[3][3] = {0};
+    float atb[3] = {0};
+
+    for (int i = 1; i < n; i++) {
+        const float *ai = meas[i].pos;
+        float row[3];
+        float rhs = meas[0].range * meas[0].range - meas[i].range * meas[i].range;
+        for (int k = 0; k < 3; k++) {
+            row[k] = 2.0f * (ai[k] - a0[k]);
+            rhs += ai[k] * ai[k] - a0[k] * a0[k];
+        }
+        // z is known in 2D, move its term to the right hand side
+        if (dim == 2)
+            rhs -= row[2] * pos[2];
+
+        for (int r = 0; r < dim; r++) {
+            for (int c = 0; c < dim; c++)
+                ata[r][c] += row[r] * row[c];
+            atb[r] += row[r] * rhs;
+        }
+    }
+
+    if (multilat_cholesky(ata, atb, dim))
+        return -1;
+    for (int k = 0; k < dim; k++)
+        pos[k] = atb[k];
+
+    return 0;
+}
+
+static float multilat_cost(const struct multilat_meas *meas, int n, const float *pos)
+{
+    float cost = 0.0f;
+    for (int i = 0; i < n; i++) {
+        float dx = pos[0] - meas[i].pos[0];
+        float dy = pos[1] - meas[i].pos[1];
+        float dz = pos[2] - meas[i].pos[2];
+        float e  = sqrtf(dx * dx + dy * dy + dz * dz) - meas[i].range;
+        cost += e * e;
+    }
+    return cost;
+}
+
+/**
+ * @brief Position from ranges to known anchors, refined with Gauss-Newton.
+ *
+ * A 3D solution needs at least four anchors that are not coplanar. With three
+ * anchors, or when the anchors are (nearly) coplanar, the solver falls back to
+ * 2D and holds z at @p z_2d. Three anchors that are not collinear are the
+ * minimum.
+ *
+ * @param[in]  meas      Anchor positions and ranges, in metres.
+ * @param[in]  n         Number of ranges.
+ * @param[in]  solve_3d  Solve for z as well when the geometry allows it.
+ * @param[in]  z_2d      Height of the tag when solving in 2D.
+ * @param[in]  guess     Starting point, for example the previous fix, or NULL
+ *                       to start from the linearised solution.
+ * @param[out] res       Position and quality of the fix.
+ *
+ * @retval 0  Solved.
+ * @retval -1 Too few ranges or degenerate geometry.
+ */
+int multilat_solve(const struct multilat_meas *meas, int n, bool solve_3d, float z_2d,
+    const float *guess, struct multilat_result *res)
+{
+    if ((meas == NULL) || (res == NULL) || (n < 3) || (n > MULTILAT_MAX_ANCHORS))
+        return -1;
+
+    int dim = (solve_3d && (n >= 4)) ? 3 : 2;
+    float pos[3] = {0.0f, 0.0f, z_2d};
+
+    if (multilat_linear(meas, n, dim, pos)) {
+        if (dim == 2)
+            return -1;
+        dim    = 2;
+        pos[2] = z_2d;
+        if (multilat_linear(meas, n, dim, pos))
+            return -1;
+    }
+    if (guess != NULL) {
+        pos[0] = guess[0];
+        pos[1] = guess[1];
+        if (dim == 3)
+            pos[2] = guess[2];
+    }
+
+    float cost = multilat_cost(meas, n, pos);
+    int iter;
+    for (iter = 0; iter < MULTILAT_MAX_ITER; iter++) {
+        float jtj[3][3] = {0};
+        float jte[3] = {0};
+
+        for (int i = 0; i < n; i++) {
+            float d[3];
+            for (int k = 0; k < 3; k++)
+                d[k] = pos[k] - meas[i].pos[k];
+            float dist = sqrtf(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+            if (dist < 1e-3f)
+                dist = 1e-3f;
+            float e = dist - meas[i].range;
+            for (int r = 0; r < dim; r++) {
+                float jr = d[r] / dist;
+                for (int c = 0; c < dim; c++)
+                    jtj[r][c] += jr * d[c] / dist;
+                jte[r] -= jr * e;
+            }
+        }
+
+        if (multilat_cholesky(jtj, jte, dim))
+            break;
+
+        // Halve the step until it does not increase the cost
+        float step = 1.0f;
+        float next[3];
+        float next_cost;
+        int halvings = 0;
+        do {
+            memcpy(next, pos, sizeof(next));
+            for (int k = 0; k < dim; k++)
+                next[k] += step * jte[k];
+            next_cost = multilat_cost(meas, n, next);
+            step *= 0.5f;
+        } while ((next_cost > cost) && (++halvings < 4));
+
+        float norm = 0.0f;
+        for (int k = 0; k < dim; k++)
+            norm += (next[k] - pos[k]) * (next[k] - pos[k]);
+        if (next_cost <= cost) {
+            memcpy(pos, next, sizeof(pos));
+            cost = next_cost;
+        }
+        if ((next_cost > cost) || (norm < MULTILAT_STEP_TOL * MULTILAT_STEP_TOL)) {
+            iter++;
+            break;
+        }
+    }
+
+    memcpy(res->pos, pos, sizeof(res->pos));
+    res->rms        = sqrtf(cost / (float)n);
+    res->iterations = (uint8_t)iter;
+    res->anchors    = (uint8_t)n;
+    res->is_3d      = (dim == 3);
+
+    return 0;
+}
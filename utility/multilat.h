@@ -0,0 +1,39 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef MULTILAT_H
+#define MULTILAT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define MULTILAT_MAX_ANCHORS    (8)
+#define MULTILAT_MAX_ITER       (10)
+#define MULTILAT_STEP_TOL       (1e-4f)     // Stop once the Gauss-Newton step is below 0.1 mm
+
+/**
+ * One range measurement: the position of the anchor and the measured
+ * distance to it, both in metres.
+ */
+struct multilat_meas
+{
+    float pos[3];
+    float range;
+};
+
+struct multilat_result
+{
+    float pos[3];
+    float rms;                          // RMS range residual (m)
+    uint8_t iterations;
+    uint8_t anchors;                    // Ranges used
+    bool is_3d;                         // False when z was held at the given height
+};
+
+int multilat_solve(const struct multilat_meas *meas, int n, bool solve_3d, float z_2d,
+    const float *guess, struct multilat_result *res);
+
+#endif  // ~ MULTILAT_H
@@ -0,0 +1,101 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "range_filter.h"
+
+#include <stddef.h>
+
+/**
+ * @brief Filter one range of a peer.
+ *
+ * A peer without a track takes over the least recently updated one.
+ *
+ * @param[in]  f             Filter state.
+ * @param[in]  addr          Peer address.
+ * @param[in]  t_us          Time of the range, above 0 and never going back.
+ * @param[in]  range_mm      Measured range.
+ * @param[out] filtered_mm   Filtered range, the prediction when rejected.
+ *
+ * @retval 0  Range accepted.
+ * @retval 1  Range rejected.
+ */
+int range_filter_update(struct range_filter *f, uint16_t addr, uint64_t t_us, float range_mm, float *filtered_mm)
+{
+    // Find the peer, or take over the least recently updated track
+    struct range_track *trk = &f->track[0];
+    for (int i = 0; i < f->peers; i++) {
+        if (f->track[i].t_us && (f->track[i].addr == addr)) {
+            trk = &f->track[i];
+            break;
+        }
+        if (f->track[i].t_us < trk->t_us)
+            trk = &f->track[i];
+    }
+
+    f->ranges++;
+    if (!trk->t_us || (trk->addr != addr)) {
+        trk->addr = addr;
+        trk->nis  = 0.0f;
+        goto restart;
+    }
+
+    // Predict
+    float dt    = (float)(t_us - trk->t_us) * 1e-6f;
+    float range = trk->range + trk->rate * dt;
+    float p00   = trk->p00 + dt * (2.0f * trk->p01 + dt * trk->p11) + f->q * dt * dt * dt / 3.0f;
+    float p01   = trk->p01 + dt * trk->p11 + f->q * dt * dt / 2.0f;
+    float p11   = trk->p11 + f->q * dt;
+
+    // Gate
+    float y = range_mm - range;
+    float s = p00 + f->r;
+    trk->nis = y * y / s;
+    if (trk->nis > f->gate * f->gate) {
+        f->rejected++;
+        if (++trk->rejects < f->max_rejects) {
+            *filtered_mm = range;
+            return 1;
+        }
+        // The peer has most likely moved faster than the filter allows
+        f->restarts++;
+        goto restart;
+    }
+
+    // Update
+    float k0 = p00 / s;
+    float k1 = p01 / s;
+    trk->range   = range + k0 * y;
+    trk->rate    = trk->rate + k1 * y;
+    trk->p00     = (1.0f - k0) * p00;
+    trk->p01     = (1.0f - k0) * p01;
+    trk->p11     = p11 - k1 * p01;
+    trk->t_us    = t_us;
+    trk->rejects = 0;
+    *filtered_mm = trk->range;
+    return 0;
+
+restart:
+    trk->range   = range_mm;
+    trk->rate    = 0.0f;
+    trk->p00     = f->r;
+    trk->p01     = 0.0f;
+    trk->p11     = f->rate0;
+    trk->t_us    = t_us;
+    trk->rejects = 0;
+    *filtered_mm = range_mm;
+    return 0;
+}
+
+/**
+ * @brief Track of a peer, NULL when it has none.
+ */
+const struct range_track *range_filter_find(const struct range_filter *f, uint16_t addr)
+{
+    for (int i = 0; i < f->peers; i++)
+        if (f->track[i].t_us && (f->track[i].addr == addr))
+            return &f->track[i];
+    return NULL;
+}
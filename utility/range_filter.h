@@ -0,0 +1,55 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef RANGE_FILTER_H
+#define RANGE_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define RANGE_FILTER_MAX_PEERS  (8)     // Tracks in a filter
+
+/**
+ * Range (mm) and range rate (mm/s) of one peer.
+ */
+struct range_track
+{
+    uint64_t t_us;                      // Time of the last accepted range, 0 when the track is free
+    float range;                        // mm
+    float rate;                         // mm/s
+    float p00, p01, p11;                // Covariance
+    float nis;                          // Normalised innovation squared of the last range
+    uint16_t addr;
+    uint8_t rejects;                    // Consecutive ranges outside the gate
+};
+
+/**
+ * Constant velocity Kalman filter per peer. The noise parameters, the gate
+ * and the number of tracks are set by the owner, the rest starts zeroed.
+ *
+ * A range is judged on its normalised innovation y^2 / S, chi-square with
+ * one degree of freedom while the model holds. A range outside the gate is
+ * rejected and leaves the track untouched, a run of max_rejects of them
+ * restarts the track from the last range.
+ */
+struct range_filter
+{
+    float r;                            // Range noise variance (mm^2)
+    float q;                            // Acceleration noise density (mm^2/s^3)
+    float rate0;                        // Initial range rate variance (mm^2/s^2)
+    float gate;                         // Innovation gate in standard deviations
+    uint8_t max_rejects;                // Consecutive rejections after which the track restarts
+    uint8_t peers;                      // Tracks in use, up to RANGE_FILTER_MAX_PEERS
+    struct range_track track[RANGE_FILTER_MAX_PEERS];
+    uint32_t ranges;
+    uint32_t rejected;
+    uint32_t restarts;                  // Tracks restarted after max_rejects
+};
+
+int range_filter_update(struct range_filter *f, uint16_t addr, uint64_t t_us, float range_mm, float *filtered_mm);
+const struct range_track *range_filter_find(const struct range_filter *f, uint16_t addr);
+
+#endif  // ~ RANGE_FILTER_H
@@ -0,0 +1,62 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef SIM_RAND_H
+#define SIM_RAND_H
+
+#include <stdint.h>
+
+/**
+ * Reproducible pseudo-random numbers for simulations and benchmarks, an
+ * xorshift32 generator. Not for anything on air, get_rand_32() is.
+ */
+struct sim_rand
+{
+    uint32_t state;
+};
+
+static inline void sim_rand_seed(struct sim_rand *r, uint32_t seed)
+{
+    r->state = seed ? seed : 1;         // xorshift is stuck at 0
+}
+
+static inline uint32_t sim_rand_u32(struct sim_rand *r)
+{
+    uint32_t x = r->state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return r->state = x;
+}
+
+/**
+ * @brief Uniform in [0, 1).
+ */
+static inline double sim_rand_uniform(struct sim_rand *r)
+{
+    return (double)(sim_rand_u32(r) >> 8) * (1.0 / 16777216.0);
+}
+
+/**
+ * @brief Uniform in [lo, hi).
+ */
+static inline double sim_rand_range(struct sim_rand *r, double lo, double hi)
+{
+    return lo + (hi - lo) * sim_rand_uniform(r);
+}
+
+/**
+ * @brief Approximately standard normal, the sum of 12 uniforms less 6.
+ */
+static inline double sim_rand_normal(struct sim_rand *r)
+{
+    double sum = -6.0;
+    for (int i = 0; i < 12; i++)
+        sum += sim_rand_uniform(r);
+    return sum;
+}
+
+#endif  // ~ SIM_RAND_H
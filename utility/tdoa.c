@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "tdoa.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TDOA_FCTRL_BLINK        (0xC5)  // One octet frame control of a blink with a 64-bit address
+
+/**
+ * @brief Start a record from a received frame if it is a blink. The
+ * timestamps, the anchor and the power levels are left for the caller.
+ *
+ * @param[out] rec       Record to fill.
+ * @param[in]  frame     Received frame.
+ * @param[in]  len       Length of the frame as received, FCS included.
+ *
+ * @return 0 on a blink, -1 otherwise.
+ */
+int tdoa_record_from_blink(struct tdoa_record *rec, const uint8_t *frame, uint16_t len)
+{
+    if ((len != TDOA_BLINK_LEN) || (frame[0] != TDOA_FCTRL_BLINK))
+        return -1;
+
+    memset(rec, 0, sizeof(*rec));
+    rec->seq_num = frame[1];
+    for (int i = 9; i >= 2; i--)
+        rec->tag_eui = (rec->tag_eui << 8) | frame[i];
+    return 0;
+}
+
+/**
+ * @brief Format a record as one comma separated line:
+ * tdoa,<tag eui>,<seq>,<anchor id>,<rx stamp>,<fp power>,<rx power>,<ref stamp>
+ *
+ * @return Length of the line, or -1 if it does not fit in size.
+ */
+int tdoa_format(char *buf, size_t size, const struct tdoa_record *rec)
+{
+    int len = snprintf(buf, size, "tdoa,%016" PRIx64 ",%u,%04x,%010" PRIx64 ",%d,%d,%010" PRIx64,
+        rec->tag_eui, rec->seq_num, rec->anchor_id, rec->rx_stamp, rec->fp_power, rec->rx_power, rec->ref_stamp);
+    return ((len < 0) || ((size_t)len >= size)) ? -1 : len;
+}
+
+/**
+ * @brief Parse a line written by tdoa_format().
+ *
+ * @return 0 on success, -1 if the line is not a record.
+ */
+int tdoa_parse(struct tdoa_record *rec, const char *line)
+{
+    unsigned int seq_num, anchor_id;
+    int fp_power, rx_power, end = 0;
+
+    if (sscanf(line, "tdoa,%16" SCNx64 ",%u,%4x,%10" SCNx64 ",%d,%d,%10" SCNx64 "%n",
+            &rec->tag_eui, &seq_num, &anchor_id, &rec->rx_stamp, &fp_power, &rx_power, &rec->ref_stamp, &end) != 7)
+        return -1;
+    if (((line[end] != '\0') && (line[end] != '\n')) || (seq_num > UINT8_MAX) ||
+        (fp_power < INT16_MIN) || (fp_power > INT16_MAX) || (rx_power < INT16_MIN) || (rx_power > INT16_MAX))
+        return -1;
+
+    rec->seq_num   = (uint8_t)seq_num;
+    rec->anchor_id = (uint16_t)anchor_id;
+    rec->fp_power  = (int16_t)fp_power;
+    rec->rx_power  = (int16_t)rx_power;
+    return 0;
+}
+
+/**
+ * @brief a - b for two 40-bit timestamps, across a wrap of the counter.
+ *
+ * @return The difference in ticks, within +-2^39.
+ */
+int64_t tdoa_stamp_diff(uint64_t a, uint64_t b)
+{
+    uint64_t d = (a - b) & TDOA_STAMP_MASK;
+    return (d & (1ULL << 39)) ? (int64_t)d - (int64_t)(1ULL << 40) : (int64_t)d;
+}
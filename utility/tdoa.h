@@ -0,0 +1,36 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TDOA_H
+#define TDOA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TDOA_STAMP_MASK         (0xFFFFFFFFFFULL)   // DW1000 timestamps are 40 bits
+#define TDOA_BLINK_LEN          (12)    // Frame control, sequence number, EUI and FCS
+#define TDOA_LINE_MAX           (72)    // A formatted record and its terminator
+
+/**
+ * @brief TDoA record of one received blink, forwarded upstream by the anchor.
+ */
+struct tdoa_record
+{
+    uint64_t tag_eui;                   //!< Long address of the tag
+    uint64_t rx_stamp;                  //!< 40-bit RX timestamp of the blink
+    uint16_t anchor_id;                 //!< Address of the receiving anchor
+    int16_t fp_power;                   //!< First path power level (0.01 dBm)
+    int16_t rx_power;                   //!< Receive power level (0.01 dBm)
+    uint8_t seq_num;                    //!< Sequence number of the blink
+    uint64_t ref_stamp;                 //!< rx_stamp in the clock of the reference anchor, 0 until locked
+};
+
+int tdoa_record_from_blink(struct tdoa_record *rec, const uint8_t *frame, uint16_t len);
+int tdoa_format(char *buf, size_t size, const struct tdoa_record *rec);
+int tdoa_parse(struct tdoa_record *rec, const char *line);
+int64_t tdoa_stamp_diff(uint64_t a, uint64_t b);
+
+#endif  // ~ TDOA_H
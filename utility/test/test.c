@@ -0,0 +1,48 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+
+#include <string.h>
+
+struct test_case
+{
+    const char *name;
+    int (*run)(void);
+};
+
+static const struct test_case m_tests[] = {
+    {"backoff", test_backoff},
+    {"cell_plan", test_cell_plan},
+    {"clock_sync", test_clock_sync},
+    {"mac_frame", test_mac_frame},
+    {"multilat", test_multilat},
+    {"range_filter", test_range_filter},
+    {"tdoa", test_tdoa},
+    {"twr", test_twr},
+};
+
+int main(int argc, char **argv)
+{
+    int ran = 0, failed = 0;
+
+    for (size_t i = 0; i < sizeof(m_tests) / sizeof(m_tests[0]); i++) {
+        if ((argc > 1) && strcmp(argv[1], m_tests[i].name))
+            continue;
+        printf("== %s\n", m_tests[i].name);
+        ran++;
+        if (m_tests[i].run()) {
+            printf("== %s failed\n", m_tests[i].name);
+            failed++;
+        }
+    }
+
+    if (!ran) {
+        printf("no test named %s\n", argv[1]);
+        return 1;
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+/**
+ * Fail the test, returning -1 from it, unless cond holds.
+ */
+#define TEST_CHECK(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s: ", __FILE__, __LINE__, #cond); \
+            printf(__VA_ARGS__); \
+            printf("\n"); \
+            return -1; \
+        } \
+    } while (0)
+
+int test_backoff(void);
+int test_cell_plan(void);
+int test_clock_sync(void);
+int test_mac_frame(void);
+int test_multilat(void);
+int test_range_filter(void);
+int test_tdoa(void);
+int test_twr(void);
+
+#endif  // ~ TEST_H
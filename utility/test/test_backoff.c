@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "backoff.h"
+#include "sim_rand.h"
+
+#include <stdint.h>
+
+// The blink scheduler of dw1000.h: SESSION_DISCOVERY_PERIOD_MS, BLINK_JITTER_PERCENT, BLINK_BACKOFF_MAX_EXP
+#define BLINK_PERIOD_US     (1000000)
+#define BLINK_JITTER_PCT    (50)
+#define BLINK_MAX_EXP       (3)
+#define EXCHANGE_US         (20200)     // A blink and the RX_FWTO_SW_REPLY_US window for the ranging init
+#define BLINKS              (200)       // Blinks per tag
+#define MAX_TAGS            (32)
+
+/**
+ * @brief Blink n unpaired tags that power up within 10 ms of each other.
+ *
+ * A blink collides with any other blink that starts within the exchange it
+ * opens. A tag whose blink did not collide is answered and its backoff is
+ * reset; it keeps blinking so the tag count stays the same.
+ *
+ * @param[in]  n         Number of tags.
+ * @param[in]  jitter    Use the blink scheduler rather than a fixed period.
+ * @param[out] period_ms Mean blink period per tag.
+ *
+ * @return Share of blinks that collided, in percent.
+ */
+static double backoff_sim(int n, bool jitter, double *period_ms)
+{
+    static uint64_t next[MAX_TAGS];
+    static struct backoff tag[MAX_TAGS];
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+
+    for (int i = 0; i < n; i++) {
+        next[i] = sim_rand_u32(&rnd) % 10000;
+        tag[i]  = (struct backoff){.period_us = BLINK_PERIOD_US, .jitter_pct = BLINK_JITTER_PCT, .max_exp = BLINK_MAX_EXP};
+    }
+
+    int blinks = 0, collided = 0, pending = -1;
+    bool pending_hit = false;
+    uint64_t t = 0, pending_t = 0;
+    while (blinks <= n * BLINKS) {
+        int i = -1;
+        if (blinks < n * BLINKS) {
+            i = 0;
+            for (int j = 1; j < n; j++)
+                if (next[j] < next[i])
+                    i = j;
+            t = next[i];
+            next[i] = UINT64_MAX;
+        }
+        blinks++;
+        // The outcome of a blink is known once the next one has started
+        bool hit = (pending >= 0) && (i >= 0) && (t - pending_t < EXCHANGE_US);
+        if (pending >= 0) {
+            pending_hit |= hit;
+            collided += pending_hit;
+            if (jitter) {
+                backoff_result(&tag[pending], !pending_hit);
+                next[pending] = pending_t + backoff_delay_us(&tag[pending], sim_rand_u32(&rnd));
+            } else {
+                next[pending] = pending_t + BLINK_PERIOD_US;
+            }
+        }
+        pending     = i;
+        pending_t   = t;
+        pending_hit = hit;
+    }
+
+    *period_ms = (double)t / 1000.0 / BLINKS;
+    return 100.0 * collided / (n * BLINKS);
+}
+
+int test_backoff(void)
+{
+    struct backoff b = {.period_us = BLINK_PERIOD_US, .jitter_pct = BLINK_JITTER_PCT, .max_exp = BLINK_MAX_EXP};
+    TEST_CHECK(backoff_delay_us(&b, 0) == BLINK_PERIOD_US / 2, "shortest delay");
+    TEST_CHECK(backoff_delay_us(&b, UINT32_MAX) < BLINK_PERIOD_US * 3 / 2, "longest delay");
+    for (int i = 0; i < BLINK_MAX_EXP + 2; i++)
+        backoff_result(&b, false);
+    TEST_CHECK(b.fails == BLINK_MAX_EXP, "fails %u", b.fails);
+    TEST_CHECK(backoff_delay_us(&b, 0) == (BLINK_PERIOD_US << BLINK_MAX_EXP) / 2, "backed off delay");
+    backoff_result(&b, true);
+    TEST_CHECK(b.fails == 0, "reset");
+
+    printf("exchange %u us, period %u ms +-%u%%, backoff up to %ux\n",
+        EXCHANGE_US, BLINK_PERIOD_US / 1000, BLINK_JITTER_PCT, 1u << BLINK_MAX_EXP);
+    const int tag_cnt[] = {2, 4, 8, 16, 32};
+    for (size_t k = 0; k < sizeof(tag_cnt) / sizeof(tag_cnt[0]); k++) {
+        int n = tag_cnt[k];
+        double fixed_ms, jittered_ms;
+        double fixed    = backoff_sim(n, false, &fixed_ms);
+        double jittered = backoff_sim(n, true, &jittered_ms);
+        printf(" %2d tags: fixed %5.1f%% collided, jittered %5.1f%% collided, %.0f ms mean period\n",
+            n, fixed, jittered, jittered_ms);
+        TEST_CHECK(jittered < fixed, "%d tags", n);
+        TEST_CHECK(jittered_ms >= BLINK_PERIOD_US / 1000 * (100 - BLINK_JITTER_PCT) / 100, "%d tags", n);
+    }
+    TEST_CHECK(backoff_sim(2, true, &(double){0}) < 5.0, "two tags keep colliding");
+
+    return 0;
+}
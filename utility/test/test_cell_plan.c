@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "cell_plan.h"
+#include "sim_rand.h"
+
+#include <stdbool.h>
+
+#define REUSE_DIST_M        (30.0f)     // CELL_REUSE_DIST_M of dw1000.h
+#define RANDOM_MAPS         (2000)
+
+// The default CELL_MAP of dw1000.h
+static const struct cell_pos m_cell_map[] = {
+    {{ 0.0f,  0.0f}},
+    {{20.0f,  0.0f}},
+    {{40.0f,  0.0f}},
+    {{ 0.0f, 20.0f}},
+    {{20.0f, 20.0f}},
+    {{40.0f, 20.0f}},
+};
+#define CELLS ((int)(sizeof(m_cell_map) / sizeof(m_cell_map[0])))
+
+// The candidates dw1000_set_cell() offers at the default channel 5, code 9 and 64 MHz PRF
+static const struct cell_radio m_cand_64[] = {
+    {5, 9},
+    {1, 9}, {1, 10}, {1, 11}, {1, 12},
+    {2, 9}, {2, 10}, {2, 11}, {2, 12},
+    {3, 9}, {3, 10}, {3, 11}, {3, 12},
+    {5, 10}, {5, 11}, {5, 12},
+};
+
+// And at channel 5, code 3 and 16 MHz PRF
+static const struct cell_radio m_cand_16[] = {
+    {5, 3},
+    {1, 1}, {1, 2},
+    {2, 3}, {2, 4},
+    {3, 5}, {3, 6},
+    {5, 4},
+};
+
+static bool cell_nbr(const struct cell_pos *map, int i, int j)
+{
+    float dx = map[i].pos[0] - map[j].pos[0];
+    float dy = map[i].pos[1] - map[j].pos[1];
+    return dx * dx + dy * dy < REUSE_DIST_M * REUSE_DIST_M;
+}
+
+static bool cell_same(const struct cell_radio *a, const struct cell_radio *b)
+{
+    return (a->chan == b->chan) && (a->pcode == b->pcode);
+}
+
+/**
+ * @brief Count the neighbour pairs on the same channel and code, and the
+ * other pairs that reuse one.
+ */
+static int cell_conflicts(const struct cell_pos *map, int cells, const struct cell_radio *plan, int *reused)
+{
+    int conflicts = 0;
+    *reused = 0;
+    for (int i = 0; i < cells; i++) {
+        for (int j = i + 1; j < cells; j++) {
+            if (!cell_same(&plan[i], &plan[j]))
+                continue;
+            if (cell_nbr(map, i, j))
+                conflicts++;
+            else
+                (*reused)++;
+        }
+    }
+    return conflicts;
+}
+
+int test_cell_plan(void)
+{
+    struct cell_radio plan[CELL_PLAN_MAX];
+    int reused;
+
+    // The default map: 20 m apart, diagonal neighbours included, no conflict and the far cells reuse
+    int shared = cell_plan(m_cell_map, CELLS, REUSE_DIST_M, m_cand_64, sizeof(m_cand_64) / sizeof(m_cand_64[0]), plan);
+    int conflicts = cell_conflicts(m_cell_map, CELLS, plan, &reused);
+    for (int i = 0; i < CELLS; i++)
+        printf(" cell %d: channel %u, preamble code %u\n", i, plan[i].chan, plan[i].pcode);
+    printf("CELL_MAP: %d conflicts, %d pairs reuse a channel and code\n", conflicts, reused);
+    TEST_CHECK(shared == 0, "%d shared", shared);
+    TEST_CHECK(conflicts == 0, "%d conflicts", conflicts);
+    // Cells 1 and 4 hear all others and are planned first; 0 and 2, and 3 and 5, are 40 m apart
+    TEST_CHECK(cell_same(&plan[1], &m_cand_64[0]), "cell 1 not on the preferred channel and code");
+    TEST_CHECK((reused == 2) && cell_same(&plan[0], &plan[2]) && cell_same(&plan[3], &plan[5]), "%d pairs reused", reused);
+
+    // All cells in range of each other: the 8 candidates at 16 MHz PRF run out at the 9th cell
+    struct cell_pos clique[CELL_PLAN_MAX];
+    for (int n = 1; n <= CELL_PLAN_MAX; n++) {
+        for (int i = 0; i < n; i++)
+            clique[i] = (struct cell_pos){{(float)i, 0.0f}};
+        shared = cell_plan(clique, n, REUSE_DIST_M, m_cand_16, sizeof(m_cand_16) / sizeof(m_cand_16[0]), plan);
+        conflicts = cell_conflicts(clique, n, plan, &reused);
+        int expected = (n > 8) ? n - 8 : 0;
+        TEST_CHECK((shared == expected) && (conflicts == expected), "%d cells: %d shared, %d conflicts", n, shared, conflicts);
+    }
+
+    // Random maps: the count returned is the count in the plan
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+    struct cell_pos map[CELL_PLAN_MAX];
+    int total = 0, with_conflicts = 0;
+    for (int k = 0; k < RANDOM_MAPS; k++) {
+        int n = 1 + (int)(sim_rand_u32(&rnd) % CELL_PLAN_MAX);
+        for (int i = 0; i < n; i++)
+            map[i] = (struct cell_pos){{(float)sim_rand_range(&rnd, 0, 60), (float)sim_rand_range(&rnd, 0, 60)}};
+        shared = cell_plan(map, n, REUSE_DIST_M, m_cand_16, sizeof(m_cand_16) / sizeof(m_cand_16[0]), plan);
+        conflicts = cell_conflicts(map, n, plan, &reused);
+        TEST_CHECK(shared == conflicts, "map %d: %d shared, %d conflicts", k, shared, conflicts);
+        total += conflicts;
+        with_conflicts += conflicts > 0;
+    }
+    printf("%d random maps of up to %d cells in 60 x 60 m at 16 MHz PRF: %d with conflicts, %d conflicts\n",
+        RANDOM_MAPS, CELL_PLAN_MAX, with_conflicts, total);
+
+    TEST_CHECK(cell_plan(m_cell_map, 0, REUSE_DIST_M, m_cand_64, 1, plan) == -1, "empty map");
+    TEST_CHECK(cell_plan(clique, CELL_PLAN_MAX + 1, REUSE_DIST_M, m_cand_64, 1, plan) == -1, "oversized map");
+    TEST_CHECK(cell_plan(m_cell_map, CELLS, REUSE_DIST_M, m_cand_64, 0, plan) == -1, "no candidate");
+    return 0;
+}
@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "clock_sync.h"
+#include "tdoa.h"
+#include "sim_rand.h"
+
+#include <math.h>
+
+// The clock filter of dw1000.h: SYNC_KF_R, SYNC_KF_Q, SYNC_KF_DRIFT0, SYNC_LOCK_NIS, SYNC_LOCK_COUNT,
+// SYNC_UNLOCK_COUNT
+#define KF_R                (160.0)
+#define KF_Q                (4.0e3)
+#define KF_DRIFT0           (1.3e6)
+#define LOCK_NIS            (16.0)
+#define LOCK_COUNT          (10)
+#define UNLOCK_COUNT        (5)
+#define STAMP_SIGMA         (12.6)          // RX timestamp noise (ticks), sqrt(KF_R)
+#define DRIFT_WALK          (63.0)          // Drift random walk (ticks/s per sqrt(s)), sqrt(KF_Q)
+#define REF_TOF             (1066.0)        // 5 m between the anchors (ticks)
+#define RUN_S               (60.0)          // Long enough for both 40-bit clocks to wrap
+#define SPIKE_TICKS         (2000.0)        // A sync frame taken over a reflection, about 9 m longer
+#define JUMP_TICKS          (1.0e6)         // The reference anchor restarted its clock
+#define EVENT_S             (30.0)          // Time of the spike or the jump
+
+/**
+ * @brief A follower anchor tracks the clock of the reference from its sync
+ * frames.
+ *
+ * Both clocks start at random 40-bit values. The follower crystal is off by
+ * up to +-20 ppm against the reference and wanders by DRIFT_WALK, and its RX
+ * timestamps carry STAMP_SIGMA of noise. Halfway between sync frames a blink
+ * is converted into the reference clock and compared to the true reference
+ * time.
+ *
+ * At spike_s one sync frame arrives SPIKE_TICKS late, and from jump_s on
+ * the reference clock is JUMP_TICKS ahead; pass a negative time for
+ * neither.
+ *
+ * @param[in]  period_ms Sync frame period.
+ * @param[in]  seed      Seed of the clocks and the noise.
+ * @param[in]  spike_s   Time of the late sync frame.
+ * @param[in]  jump_s    Time of the reference clock jump.
+ * @param[out] lock_s    Time from the first sync frame to the last lock, -1
+ *                       without a lock in RUN_S.
+ * @param[out] unlock_s  Time of the last lock loss, -1 without one.
+ * @param[out] res_rms   RMS residual of the sync frames once locked (ticks).
+ * @param[out] nis_mean  Mean y^2 / S of the sync frames once locked.
+ * @param[out] err_rms   RMS error of the converted blinks (ticks).
+ */
+static int clock_sync_sim(int period_ms, uint32_t seed, double spike_s, double jump_s,
+    double *lock_s, double *unlock_s, double *res_rms, double *nis_mean, double *err_rms)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, seed);
+
+    struct clock_sync s = {.r = KF_R, .q = KF_Q, .drift0 = KF_DRIFT0, .lock_nis = LOCK_NIS,
+        .lock_count = LOCK_COUNT, .unlock_count = UNLOCK_COUNT};
+    double period = period_ms / 1000.0;
+    double ref    = (double)(((uint64_t)sim_rand_u32(&rnd) << 8) & TDOA_STAMP_MASK);
+    double local  = (double)(((uint64_t)sim_rand_u32(&rnd) << 8) & TDOA_STAMP_MASK);
+    double ppm    = sim_rand_range(&rnd, -20, 20);
+    double rate   = CLOCK_SYNC_TICK_HZ * (1.0 + ppm * 1e-6);     // Follower ticks per reference second
+
+    double res_sq = 0, nis_sum = 0, err_sq = 0;
+    int res_n = 0, err_n = 0;
+    *lock_s = *unlock_s = -1;
+    for (int n = 0; n * period < RUN_S; n++) {
+        double t = n * period;
+        if ((jump_s >= 0) && (t >= jump_s) && (t < jump_s + period))
+            ref = fmod(ref + JUMP_TICKS, (double)(TDOA_STAMP_MASK + 1));
+
+        // The sync frame leaves at ref, and arrives REF_TOF later
+        double late = ((spike_s >= 0) && (t >= spike_s) && (t < spike_s + period)) ? SPIKE_TICKS : 0;
+        uint64_t ref_ts   = (uint64_t)llround(ref) & TDOA_STAMP_MASK;
+        uint64_t local_ts = (uint64_t)llround(local + (REF_TOF + late) * rate / CLOCK_SYNC_TICK_HZ +
+            STAMP_SIGMA * sim_rand_normal(&rnd)) & TDOA_STAMP_MASK;
+        bool locked = s.locked;
+        double y = clock_sync_update(&s, local_ts, (ref_ts + (uint64_t)REF_TOF) & TDOA_STAMP_MASK);
+        if (!locked && s.locked) {
+            *lock_s = t;
+        } else if (locked && !s.locked) {
+            *unlock_s = t;
+        } else if (locked && !late) {
+            res_sq += y * y;
+            nis_sum += s.nis;
+            res_n++;
+        }
+
+        // A blink halfway to the next sync frame
+        double half = period / 2;
+        if (s.locked) {
+            uint64_t blink_local = (uint64_t)llround(local + half * rate) & TDOA_STAMP_MASK;
+            uint64_t blink_ref   = (uint64_t)llround(ref + half * CLOCK_SYNC_TICK_HZ) & TDOA_STAMP_MASK;
+            uint64_t conv;
+            TEST_CHECK(!clock_sync_to_ref(&s, blink_local, &conv), "not converted");
+            double err = (double)tdoa_stamp_diff(conv, blink_ref);
+            err_sq += err * err;
+            err_n++;
+        } else {
+            uint64_t conv;
+            TEST_CHECK(clock_sync_to_ref(&s, 0, &conv), "converted before the lock");
+        }
+
+        ref   = fmod(ref + period * CLOCK_SYNC_TICK_HZ, (double)(TDOA_STAMP_MASK + 1));
+        local = fmod(local + period * rate, (double)(TDOA_STAMP_MASK + 1));
+        rate += DRIFT_WALK * sqrt(period) * sim_rand_normal(&rnd);
+    }
+
+    *res_rms  = res_n ? sqrt(res_sq / res_n) : 0;
+    *nis_mean = res_n ? nis_sum / res_n : 0;
+    *err_rms  = err_n ? sqrt(err_sq / err_n) : 0;
+    return 0;
+}
+
+int test_clock_sync(void)
+{
+    const int period_ms[] = {50, 100, 250, 500, 1000};
+    const int runs = 20;
+    double blink_rms[sizeof(period_ms) / sizeof(period_ms[0])];
+    double lock_s, unlock_s, res_rms, nis_mean, err_rms;
+
+    printf("stamp noise %.1f ticks, drift walk %.0f ticks/s/sqrt(s), lock after %d frames within NIS %.1f\n",
+        STAMP_SIGMA, DRIFT_WALK, LOCK_COUNT, LOCK_NIS);
+    for (size_t p = 0; p < sizeof(period_ms) / sizeof(period_ms[0]); p++) {
+        double lock_max = 0, lock_sum = 0, res_sq = 0, nis_sum = 0, err_sq = 0;
+        int locked = 0, unlocked = 0;
+        for (int i = 0; i < runs; i++) {
+            if (clock_sync_sim(period_ms[p], 1 + i, -1, -1, &lock_s, &unlock_s, &res_rms, &nis_mean, &err_rms))
+                return -1;
+            unlocked += unlock_s >= 0;
+            if (lock_s < 0)
+                continue;
+            locked++;
+            lock_max = fmax(lock_max, lock_s);
+            lock_sum += lock_s;
+            res_sq += res_rms * res_rms;
+            nis_sum += nis_mean;
+            err_sq += err_rms * err_rms;
+        }
+        res_rms  = locked ? sqrt(res_sq / locked) : 0;
+        nis_mean = locked ? nis_sum / locked : 0;
+        err_rms  = locked ? sqrt(err_sq / locked) : 0;
+        blink_rms[p] = err_rms;
+        printf(" %4d ms: %2d of %d runs locked in %.2f s mean, %.2f s max, residual %.1f ticks rms, NIS %.2f, blink error %.1f ticks (%.2f ns) rms\n",
+            period_ms[p], locked, runs, locked ? lock_sum / locked : 0, lock_max, res_rms, nis_mean, err_rms, err_rms * 1e9 / CLOCK_SYNC_TICK_HZ);
+        // The residual grows with the drift walk between sync frames, and S with it
+        TEST_CHECK(locked == runs, "%d ms: %d runs without a lock", period_ms[p], runs - locked);
+        TEST_CHECK(!unlocked, "%d ms: %d runs lost the lock", period_ms[p], unlocked);
+        TEST_CHECK(lock_max <= 2 * LOCK_COUNT * period_ms[p] / 1000.0, "%d ms: lock in %.2f s", period_ms[p], lock_max);
+        TEST_CHECK(nis_mean < 1.5, "%d ms: NIS %.2f", period_ms[p], nis_mean);
+        TEST_CHECK(err_rms < res_rms, "%d ms: blink error %.1f ticks", period_ms[p], err_rms);
+    }
+
+    // A sync frame over a reflection is weighted down and leaves the lock alone
+    for (size_t p = 0; p < sizeof(period_ms) / sizeof(period_ms[0]); p++) {
+        double err_max = 0;
+        for (int i = 0; i < runs; i++) {
+            if (clock_sync_sim(period_ms[p], 1 + i, EVENT_S, -1, &lock_s, &unlock_s, &res_rms, &nis_mean, &err_rms))
+                return -1;
+            TEST_CHECK(unlock_s < 0, "%d ms: spike dropped the lock", period_ms[p]);
+            err_max = fmax(err_max, err_rms);
+        }
+        printf(" %4d ms: %.0f ticks spike, blink error %.1f ticks rms at most\n", period_ms[p], SPIKE_TICKS, err_max);
+        TEST_CHECK(err_max < 2 * blink_rms[p], "%d ms: blink error %.1f ticks", period_ms[p], err_max);
+    }
+
+    // A jump of the reference clock drops the lock after UNLOCK_COUNT frames and locks again
+    for (size_t p = 0; p < sizeof(period_ms) / sizeof(period_ms[0]); p++) {
+        double relock_max = 0;
+        for (int i = 0; i < runs; i++) {
+            if (clock_sync_sim(period_ms[p], 1 + i, -1, EVENT_S, &lock_s, &unlock_s, &res_rms, &nis_mean, &err_rms))
+                return -1;
+            TEST_CHECK((unlock_s >= EVENT_S) && (unlock_s < EVENT_S + UNLOCK_COUNT * period_ms[p] / 1000.0),
+                "%d ms: lock lost at %.2f s", period_ms[p], unlock_s);
+            TEST_CHECK(lock_s > unlock_s, "%d ms: no lock after the jump", period_ms[p]);
+            relock_max = fmax(relock_max, lock_s - unlock_s);
+        }
+        printf(" %4d ms: %.0f ticks jump, locked again in %.2f s at most\n", period_ms[p], JUMP_TICKS, relock_max);
+        TEST_CHECK(relock_max <= 2 * LOCK_COUNT * period_ms[p] / 1000.0, "%d ms: lock again in %.2f s", period_ms[p], relock_max);
+    }
+
+    return 0;
+}
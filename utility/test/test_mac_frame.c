@@ -0,0 +1,233 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "mac_frame.h"
+#include "sim_rand.h"
+
+#include <time.h>
+
+#define FRAMES              (20000)
+#define TIMING_LOOPS        (1000000)
+#define FCTRL_BLINK         (0xC5)      // One octet frame control of a blink
+#define FCTRL_RANGE_16      (0x8841)    // Ranging frames of dw1000.h, short addresses with PAN ID compression
+
+/**
+ * @brief Build headers with every frame type, addressing mode, PAN ID
+ * compression and frame version, parse them back and match them against
+ * their template, then again with one header bit flipped.
+ */
+static int mac_frame_round_trip(struct sim_rand *rnd)
+{
+    static uint8_t buf[MAC_FRAME_HDR_MAX + 8 + MAC_FRAME_MATCH_BYTES];
+    int built = 0, rejected = 0;
+
+    for (int i = 0; i < FRAMES; i++) {
+        uint32_t r = sim_rand_u32(rnd);
+        uint16_t fctrl = (r & 0x3) | (((r >> 2) & 1) << 6) | (((r >> 3) & 0x3) << 10) | ((((r >> 5) & 0x3) % 3) << 12) | (((r >> 7) & 0x3) << 14);
+        if ((r >> 8) % 8 == 0)
+            fctrl = FCTRL_BLINK;
+        uint8_t seq_num = (uint8_t)(r >> 12);
+        uint64_t dst = ((uint64_t)sim_rand_u32(rnd) << 32) | sim_rand_u32(rnd);
+        uint64_t src = ((uint64_t)sim_rand_u32(rnd) << 32) | sim_rand_u32(rnd);
+        r = sim_rand_u32(rnd);
+        uint16_t pan_id = (uint16_t)(r >> 16);
+        uint8_t plen = (uint8_t)(r % 8);
+
+        struct mac_frame f, g;
+        memset(buf, 0xA5, sizeof(buf));
+        if (mac_frame_build(&f, buf, sizeof(buf) - MAC_FRAME_MATCH_BYTES, fctrl, seq_num)) {
+            rejected++;
+            continue;
+        }
+        built++;
+        mac_frame_set_dst(&f, pan_id, dst);
+        mac_frame_set_src(&f, pan_id + 1, src);
+        memset(mac_frame_payload(&f), plen, plen);
+        TEST_CHECK(!mac_frame_set_payload_len(&f, plen), "fctrl %04x", fctrl);
+        TEST_CHECK(!mac_frame_parse(&g, buf, f.len), "fctrl %04x", fctrl);
+
+        uint64_t dst_mask = (g.dst_len == 8) ? UINT64_MAX : 0xFFFF;
+        uint64_t src_mask = (g.src_len == 8) ? UINT64_MAX : 0xFFFF;
+        bool comp = g.src_len && !g.src_pan_ofs && g.dst_pan_ofs;
+        TEST_CHECK(g.fctrl.value == f.fctrl.value, "fctrl %04x", fctrl);
+        TEST_CHECK(mac_frame_seq(&g) == seq_num, "fctrl %04x", fctrl);
+        TEST_CHECK(g.payload_ofs == f.payload_ofs, "fctrl %04x", fctrl);
+        TEST_CHECK(!g.dst_len || (mac_frame_dst(&g) == (dst & dst_mask)), "fctrl %04x", fctrl);
+        TEST_CHECK(!g.src_len || (mac_frame_src(&g) == (src & src_mask)), "fctrl %04x", fctrl);
+        TEST_CHECK(!g.dst_pan_ofs || (mac_frame_dst_pan(&g) == pan_id), "fctrl %04x", fctrl);
+        TEST_CHECK(!g.src_pan_ofs || (mac_frame_src_pan(&g) == (uint16_t)(pan_id + 1)), "fctrl %04x", fctrl);
+        TEST_CHECK(!comp || (mac_frame_src_pan(&g) == pan_id), "fctrl %04x", fctrl);
+        TEST_CHECK(!memcmp(mac_frame_payload(&g), mac_frame_payload(&f), plen), "fctrl %04x", fctrl);
+
+        struct mac_frame_match m;
+        TEST_CHECK(!mac_frame_match_init(&m, fctrl, pan_id, dst), "fctrl %04x", fctrl);
+        mac_frame_match_seq(&m, seq_num);
+        TEST_CHECK(mac_frame_match(&m, buf), "fctrl %04x", fctrl);
+        uint8_t bit = (uint8_t)(sim_rand_u32(rnd) % (8 * MAC_FRAME_MATCH_BYTES));
+        buf[bit / 8] ^= 1 << (bit % 8);
+        bool covered = ((const uint8_t *)m.mask)[bit / 8] & (1 << (bit % 8));
+        TEST_CHECK(mac_frame_match(&m, buf) != covered, "fctrl %04x, bit %u", fctrl, bit);
+    }
+
+    printf("%d headers built, %d rejected\n", built, rejected);
+    TEST_CHECK(built > FRAMES / 2, "%d built", built);
+    return 0;
+}
+
+/**
+ * @brief PAN ID presence of every addressing mode and PAN ID compression in
+ * a version 2 frame against table 7-2 of 802.15.4-2015, and the same frame
+ * control as version 1 against the 2006 rule.
+ */
+static int mac_frame_pan_id_table(void)
+{
+    static const struct {uint8_t dam, sam, comp, dst_pan, src_pan;} table[] = {
+        {0, 0, 0, 0, 0},
+        {0, 0, 1, 1, 0},
+        {2, 0, 0, 1, 0},
+        {3, 0, 0, 1, 0},
+        {2, 0, 1, 0, 0},
+        {3, 0, 1, 0, 0},
+        {0, 2, 0, 0, 1},
+        {0, 3, 0, 0, 1},
+        {0, 2, 1, 0, 0},
+        {0, 3, 1, 0, 0},
+        {3, 3, 0, 1, 0},
+        {3, 3, 1, 0, 0},
+        {2, 2, 0, 1, 1},
+        {2, 3, 0, 1, 1},
+        {3, 2, 0, 1, 1},
+        {2, 3, 1, 1, 0},
+        {3, 2, 1, 1, 0},
+        {2, 2, 1, 1, 0},
+    };
+    static const uint8_t addr_len[4] = {0, 0, 2, 8};
+    uint8_t buf[MAC_FRAME_HDR_MAX];
+    memset(buf, 0, sizeof(buf));
+
+    for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+        for (uint16_t fver = 1; fver <= 2; fver++) {
+            uint16_t fctrl = IEEE_802_15_4_FTYPE_DATA | (table[i].comp << 6) | (table[i].dam << 10) | (fver << 12) | (table[i].sam << 14);
+            buf[0] = (uint8_t)fctrl;
+            buf[1] = (uint8_t)(fctrl >> 8);
+
+            bool dst_pan = table[i].dst_pan, src_pan = table[i].src_pan;
+            if (fver == 1) {
+                dst_pan = table[i].dam;
+                src_pan = table[i].sam && !(table[i].comp && table[i].dam);
+            }
+            struct mac_frame f;
+            TEST_CHECK(!mac_frame_parse(&f, buf, sizeof(buf)), "fctrl %04x", fctrl);
+            TEST_CHECK(!f.dst_pan_ofs == !dst_pan, "fctrl %04x: destination PAN ID", fctrl);
+            TEST_CHECK(!f.src_pan_ofs == !src_pan, "fctrl %04x: source PAN ID", fctrl);
+            TEST_CHECK(f.payload_ofs == 3 + 2 * dst_pan + addr_len[table[i].dam] + 2 * src_pan + addr_len[table[i].sam],
+                "fctrl %04x: header %u", fctrl, f.payload_ofs);
+        }
+    }
+
+    // Version 2 features beyond the header layout, and the reserved version
+    const uint16_t bad[] = {0xA041 | (1 << 8), 0xA041 | (1 << 9), 0xB041};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        struct mac_frame f;
+        buf[0] = (uint8_t)bad[i];
+        buf[1] = (uint8_t)(bad[i] >> 8);
+        TEST_CHECK(mac_frame_parse(&f, buf, sizeof(buf)), "fctrl %04x parsed", bad[i]);
+    }
+
+    printf("%d PAN ID compression cases, frame versions 1 and 2\n", (int)(sizeof(table) / sizeof(table[0])));
+    return 0;
+}
+
+/**
+ * @brief Parse random bytes, a decoded header must lie within the frame.
+ */
+static int mac_frame_random_parse(struct sim_rand *rnd)
+{
+    static uint8_t buf[MAC_FRAME_HDR_MAX + 8];
+    int parsed = 0, fver_2015 = 0;
+
+    for (int i = 0; i < FRAMES; i++) {
+        for (size_t k = 0; k < sizeof(buf); k++)
+            buf[k] = (uint8_t)(sim_rand_u32(rnd) >> 24);
+        uint16_t len = (uint16_t)(sim_rand_u32(rnd) % (sizeof(buf) + 1));
+
+        struct mac_frame f;
+        if (mac_frame_parse(&f, buf, len))
+            continue;
+        parsed++;
+        TEST_CHECK(f.payload_ofs <= len, "fctrl %04x, len %u", f.fctrl.value, len);
+        TEST_CHECK(f.dst_ofs + f.dst_len <= len, "fctrl %04x, len %u", f.fctrl.value, len);
+        TEST_CHECK(f.src_ofs + f.src_len <= len, "fctrl %04x, len %u", f.fctrl.value, len);
+        TEST_CHECK(!f.dst_pan_ofs || (f.dst_pan_ofs + 2 <= len), "fctrl %04x, len %u", f.fctrl.value, len);
+        TEST_CHECK(!f.src_pan_ofs || (f.src_pan_ofs + 2 <= len), "fctrl %04x, len %u", f.fctrl.value, len);
+        if (f.seq_ofs == 2) {
+            TEST_CHECK(f.fctrl.fver != IEEE_802_15_4_FVER_RSVD, "fctrl %04x", f.fctrl.value);
+            fver_2015 += f.fctrl.fver == IEEE_802_15_4_FVER_2015;
+        }
+    }
+
+    printf("%d of %d random frames parsed, %d of version 2\n", parsed, FRAMES, fver_2015);
+    TEST_CHECK(fver_2015 > 0, "no version 2 frame parsed");
+    return 0;
+}
+
+/**
+ * @brief Host time of the codec on the ranging frame header: parse, build with
+ * both addresses, and the masked match.
+ */
+static int mac_frame_timing(void)
+{
+    static uint8_t buf[MAC_FRAME_HDR_MAX + MAC_FRAME_MATCH_BYTES];
+    struct mac_frame f;
+    struct mac_frame_match m;
+    TEST_CHECK(!mac_frame_build(&f, buf, sizeof(buf) - MAC_FRAME_MATCH_BYTES, FCTRL_RANGE_16, 0), "build");
+    mac_frame_set_dst(&f, 0xDECA, 0x0001);
+    mac_frame_set_src(&f, 0xDECA, 0x00AA);
+    TEST_CHECK(!mac_frame_set_payload_len(&f, 4), "payload");
+    TEST_CHECK(!mac_frame_match_init(&m, FCTRL_RANGE_16, 0xDECA, 0x0001), "match");
+
+    volatile int sink = 0;
+    clock_t t0 = clock();
+    for (int i = 0; i < TIMING_LOOPS; i++)
+        sink += mac_frame_parse(&f, buf, f.len);
+    clock_t t_parse = clock() - t0;
+
+    t0 = clock();
+    for (int i = 0; i < TIMING_LOOPS; i++) {
+        sink += mac_frame_build(&f, buf, sizeof(buf) - MAC_FRAME_MATCH_BYTES, FCTRL_RANGE_16, (uint8_t)i);
+        mac_frame_set_dst(&f, 0xDECA, 0x0001);
+        mac_frame_set_src(&f, 0xDECA, 0x00AA);
+        sink += mac_frame_set_payload_len(&f, 4);
+    }
+    clock_t t_build = clock() - t0;
+
+    t0 = clock();
+    for (int i = 0; i < TIMING_LOOPS; i++) {
+        mac_frame_match_seq(&m, (uint8_t)i);
+        sink += mac_frame_match(&m, buf);
+    }
+    clock_t t_match = clock() - t0;
+
+    printf("fctrl %04x on the host: parse %.1f ns, build %.1f ns, match %.1f ns\n", FCTRL_RANGE_16,
+        1e9 * t_parse / CLOCKS_PER_SEC / TIMING_LOOPS, 1e9 * t_build / CLOCKS_PER_SEC / TIMING_LOOPS,
+        1e9 * t_match / CLOCKS_PER_SEC / TIMING_LOOPS);
+    return 0;
+}
+
+int test_mac_frame(void)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+
+    if (mac_frame_round_trip(&rnd))
+        return -1;
+    if (mac_frame_pan_id_table())
+        return -1;
+    if (mac_frame_random_parse(&rnd))
+        return -1;
+    return mac_frame_timing();
+}
@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "multilat.h"
+#include "sim_rand.h"
+
+#include <math.h>
+#include <time.h>
+
+#define SETS                (2000)
+#define RANGE_SIGMA_M       (0.05)
+#define TAG_Z_M             (1.0f)
+
+// The default MULTILAT_ANCHOR_MAP of dw1000.h
+static const float m_anchors[][3] = {
+    {0.0f, 0.0f, 2.5f},
+    {6.0f, 0.0f, 2.0f},
+    {6.0f, 4.0f, 2.5f},
+    {0.0f, 4.0f, 1.2f},
+};
+#define ANCHORS ((int)(sizeof(m_anchors) / sizeof(m_anchors[0])))
+
+/**
+ * @brief Solve range sets of tags placed at random inside the bounding box
+ * of the anchors, with RANGE_SIGMA_M of noise on each range.
+ *
+ * @param[in]  n         Anchors used, the first n of the map.
+ * @param[in]  solve_3d  Solve for z as well, otherwise z is TAG_Z_M.
+ * @param[out] rmse      Position error (m).
+ *
+ * @return Sets the solver failed on.
+ */
+static int multilat_sim(int n, bool solve_3d, double *rmse)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; k++) {
+        lo[k] = hi[k] = m_anchors[0][k];
+        for (int i = 1; i < ANCHORS; i++) {
+            lo[k] = fminf(lo[k], m_anchors[i][k]);
+            hi[k] = fmaxf(hi[k], m_anchors[i][k]);
+        }
+    }
+
+    double err_sq = 0;
+    int fails = 0, iterations = 0;
+    clock_t t_solve = 0;
+    for (int s = 0; s < SETS; s++) {
+        float tag[3];
+        for (int k = 0; k < 3; k++)
+            tag[k] = (float)sim_rand_range(&rnd, lo[k], hi[k]);
+        if (!solve_3d)
+            tag[2] = TAG_Z_M;
+
+        struct multilat_meas meas[MULTILAT_MAX_ANCHORS];
+        for (int i = 0; i < n; i++) {
+            float d2 = 0;
+            for (int k = 0; k < 3; k++) {
+                meas[i].pos[k] = m_anchors[i][k];
+                d2 += (tag[k] - meas[i].pos[k]) * (tag[k] - meas[i].pos[k]);
+            }
+            meas[i].range = sqrtf(d2) + (float)(RANGE_SIGMA_M * sim_rand_normal(&rnd));
+        }
+
+        struct multilat_result res;
+        clock_t t0 = clock();
+        int rc = multilat_solve(meas, n, solve_3d, TAG_Z_M, NULL, &res);
+        t_solve += clock() - t0;
+        if (rc) {
+            fails++;
+            continue;
+        }
+        iterations += res.iterations;
+        for (int k = 0; k < (res.is_3d ? 3 : 2); k++)
+            err_sq += (double)((res.pos[k] - tag[k]) * (res.pos[k] - tag[k]));
+    }
+
+    int solved = SETS - fails;
+    *rmse = solved ? sqrt(err_sq / solved) : INFINITY;
+    printf(" %d anchors %s: %d of %d sets failed, rmse %.3f m, %.1f iterations, %.2f us per solve\n",
+        n, solve_3d ? "3D" : "2D", fails, SETS, *rmse, solved ? (double)iterations / solved : 0.0,
+        (double)t_solve * 1e6 / CLOCKS_PER_SEC / SETS);
+    return fails;
+}
+
+int test_multilat(void)
+{
+    double rmse;
+
+    printf("range noise %.0f mm rms\n", RANGE_SIGMA_M * 1000);
+    TEST_CHECK(!multilat_sim(3, false, &rmse) && (rmse < 0.15), "3 anchors 2D");
+    TEST_CHECK(!multilat_sim(ANCHORS, false, &rmse) && (rmse < 0.1), "%d anchors 2D", ANCHORS);
+    // Three anchors fall back to 2D at TAG_Z_M, the true height of the tag then biases x and y
+    TEST_CHECK(!multilat_sim(3, true, &rmse) && (rmse < 0.3), "3 anchors 3D");
+    TEST_CHECK(!multilat_sim(ANCHORS, true, &rmse) && (rmse < 0.3), "%d anchors 3D", ANCHORS);
+
+    return 0;
+}
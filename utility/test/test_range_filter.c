@@ -0,0 +1,235 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "range_filter.h"
+#include "sim_rand.h"
+
+#include <math.h>
+#include <time.h>
+
+// The range filter of dw1000.h: RANGE_FILTER_R, RANGE_FILTER_Q, RANGE_FILTER_RATE0, RANGE_FILTER_GATE,
+// RANGE_FILTER_MAX_REJECTS, RANGE_FILTER_PEERS
+#define KF_R                (2500.0f)
+#define KF_Q                (2.5e4f)
+#define KF_RATE0            (1.0e6f)
+#define GATE                (3.0f)
+#define MAX_REJECTS         (3)
+#define PEERS               (8)
+#define RANGE_SIGMA         (50.0)          // Range noise (mm), sqrt(KF_R)
+#define PERIOD_US           (100000)        // 10 ranges a second
+#define RANGES              (600)           // Ranges per run
+#define SETTLE              (20)            // Ranges before the errors count
+#define OUTLIER_PCT         (5)             // Ranges taken over a reflection
+#define OUTLIER_MM          (1000.0)        // Least extra path of a reflection, 20 sigma
+
+static void range_filter_init(struct range_filter *f)
+{
+    *f = (struct range_filter){.r = KF_R, .q = KF_Q, .rate0 = KF_RATE0, .gate = GATE,
+        .max_rejects = MAX_REJECTS, .peers = PEERS};
+}
+
+/**
+ * @brief A peer moves with a random walk of its range rate at the density
+ * of KF_Q, and is ranged every PERIOD_US with RANGE_SIGMA of noise.
+ * OUTLIER_PCT of the ranges come over a reflection, OUTLIER_MM to three
+ * times that longer.
+ *
+ * @param[in]  seed      Seed of the motion and the noise.
+ * @param[in]  outliers  Add the reflections.
+ * @param[out] err_rms   RMS error of the filtered range after SETTLE (mm).
+ * @param[out] rate_rms  RMS error of the range rate after SETTLE (mm/s).
+ * @param[out] nis_mean  Mean y^2 / S of the accepted ranges after SETTLE.
+ * @param[out] missed    Reflections accepted.
+ * @param[out] dropped   Direct ranges rejected.
+ * @param[out] restarts  Track restarts.
+ */
+static int range_filter_sim(uint32_t seed, bool outliers, double *err_rms, double *rate_rms,
+    double *nis_mean, int *missed, int *dropped, int *restarts)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, seed);
+
+    struct range_filter f;
+    range_filter_init(&f);
+    double range = sim_rand_range(&rnd, 2000, 20000);
+    double rate  = sim_rand_range(&rnd, -1000, 1000);
+    double dt    = PERIOD_US * 1e-6;
+
+    double err_sq = 0, rate_sq = 0, nis_sum = 0;
+    int n = 0, accepted = 0;
+    *missed = *dropped = 0;
+    for (int i = 0; i < RANGES; i++) {
+        bool nlos = outliers && (i > 0) && (sim_rand_range(&rnd, 0, 100) < OUTLIER_PCT);
+        double meas = range + RANGE_SIGMA * sim_rand_normal(&rnd);
+        if (nlos)
+            meas += sim_rand_range(&rnd, OUTLIER_MM, 3 * OUTLIER_MM);
+
+        float filtered;
+        int rejected = range_filter_update(&f, 0x1234, 1 + (uint64_t)i * PERIOD_US, (float)meas, &filtered);
+        const struct range_track *trk = range_filter_find(&f, 0x1234);
+        TEST_CHECK(trk != NULL, "no track");
+        if (i >= SETTLE) {
+            *missed  += nlos && !rejected;
+            *dropped += !nlos && rejected;
+            double err = filtered - range;
+            err_sq  += err * err;
+            rate_sq += (trk->rate - rate) * (trk->rate - rate);
+            n++;
+            if (!rejected) {
+                nis_sum += trk->nis;
+                accepted++;
+            }
+        }
+
+        // Constant velocity between ranges, white acceleration noise of density KF_Q
+        range += rate * dt + sqrt(KF_Q * dt * dt * dt / 12.0) * sim_rand_normal(&rnd);
+        rate  += sqrt(KF_Q * dt) * sim_rand_normal(&rnd);
+    }
+
+    *err_rms  = sqrt(err_sq / n);
+    *rate_rms = sqrt(rate_sq / n);
+    *nis_mean = accepted ? nis_sum / accepted : 0;
+    *restarts = (int)f.restarts;
+    return 0;
+}
+
+/**
+ * @brief A range step as from a track handed to another peer: the step is
+ * rejected MAX_REJECTS - 1 times, then the track restarts on it and
+ * converges again.
+ */
+static int range_filter_step(void)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 7);
+
+    struct range_filter f;
+    range_filter_init(&f);
+    float filtered;
+    uint64_t t_us = 1;
+    for (int i = 0; i < 50; i++, t_us += PERIOD_US)
+        range_filter_update(&f, 1, t_us, (float)(5000 + RANGE_SIGMA * sim_rand_normal(&rnd)), &filtered);
+    TEST_CHECK(!f.restarts, "%lu restarts", (unsigned long)f.restarts);
+
+    for (int i = 0; i < MAX_REJECTS; i++, t_us += PERIOD_US) {
+        int rejected = range_filter_update(&f, 1, t_us, (float)(8000 + RANGE_SIGMA * sim_rand_normal(&rnd)), &filtered);
+        if (i < MAX_REJECTS - 1) {
+            TEST_CHECK(rejected, "step accepted after %d ranges", i);
+            TEST_CHECK(fabsf(filtered - 5000) < 3 * RANGE_SIGMA, "prediction %.0f mm", filtered);
+        } else {
+            TEST_CHECK(!rejected && (f.restarts == 1), "no restart after %d ranges", MAX_REJECTS);
+        }
+    }
+
+    double err_sq = 0;
+    for (int i = 0; i < 50; i++, t_us += PERIOD_US) {
+        int rejected = range_filter_update(&f, 1, t_us, (float)(8000 + RANGE_SIGMA * sim_rand_normal(&rnd)), &filtered);
+        TEST_CHECK(!rejected, "range %d after the restart rejected", i);
+        if (i >= SETTLE)
+            err_sq += (filtered - 8000) * (filtered - 8000);
+    }
+    double err_rms = sqrt(err_sq / (50 - SETTLE));
+    printf(" 3000 mm step: rejected %d times, restarted, %.1f mm rms after %d ranges\n", MAX_REJECTS - 1, err_rms, SETTLE);
+    TEST_CHECK(err_rms < RANGE_SIGMA, "error %.1f mm after the restart", err_rms);
+    return 0;
+}
+
+/**
+ * @brief More peers than tracks: the least recently updated one is handed
+ * over, the others keep their state.
+ */
+static int range_filter_peers(void)
+{
+    struct range_filter f;
+    range_filter_init(&f);
+    float filtered;
+    uint64_t t_us = 1;
+    for (int k = 0; k < PEERS; k++, t_us += PERIOD_US)
+        range_filter_update(&f, (uint16_t)(0x100 + k), t_us, 1000.0f * (k + 1), &filtered);
+    for (int k = 0; k < PEERS; k++)
+        TEST_CHECK(range_filter_find(&f, (uint16_t)(0x100 + k)) != NULL, "peer %x not tracked", 0x100 + k);
+
+    // Peer 0x100 is the oldest, refresh it so that 0x101 goes instead
+    range_filter_update(&f, 0x100, t_us, 1000.0f, &filtered);
+    t_us += PERIOD_US;
+    range_filter_update(&f, 0x200, t_us, 500.0f, &filtered);
+    TEST_CHECK(range_filter_find(&f, 0x101) == NULL, "peer 101 still tracked");
+    TEST_CHECK(range_filter_find(&f, 0x100) != NULL, "peer 100 handed over");
+    const struct range_track *trk = range_filter_find(&f, 0x200);
+    TEST_CHECK((trk != NULL) && (trk->range == 500.0f) && (trk->rate == 0.0f), "new peer 200");
+    trk = range_filter_find(&f, 0x107);
+    TEST_CHECK((trk != NULL) && (trk->range == 8000.0f), "peer 107 changed");
+    return 0;
+}
+
+int test_range_filter(void)
+{
+    const int runs = 50;
+    double err_rms, rate_rms, nis_mean;
+    int missed, dropped, restarts;
+
+    printf("range noise %.0f mm, ranges every %d ms, gate %.1f sigma, %d%% reflections %.0f to %.0f mm long\n",
+        RANGE_SIGMA, PERIOD_US / 1000, GATE, OUTLIER_PCT, OUTLIER_MM, 3 * OUTLIER_MM);
+    for (int outliers = 0; outliers < 2; outliers++) {
+        double err_sq = 0, rate_sq = 0, nis_sum = 0, err_max = 0;
+        int missed_sum = 0, dropped_sum = 0, restart_sum = 0, clean = 0;
+        for (int i = 0; i < runs; i++) {
+            if (range_filter_sim(1 + i, outliers, &err_rms, &rate_rms, &nis_mean, &missed, &dropped, &restarts))
+                return -1;
+            /**
+             * MAX_REJECTS reflections in a row restart the track on the
+             * last one, and the next direct ranges restart it again. A
+             * sharp turn of the range rate also runs out of the gate for
+             * MAX_REJECTS ranges. Such a run only counts its restarts.
+             */
+            missed_sum  += missed;
+            dropped_sum += dropped;
+            restart_sum += restarts;
+            if (restarts)
+                continue;
+            clean++;
+            err_sq  += err_rms * err_rms;
+            rate_sq += rate_rms * rate_rms;
+            nis_sum += nis_mean;
+            err_max  = fmax(err_max, err_rms);
+        }
+        err_rms  = sqrt(err_sq / clean);
+        rate_rms = sqrt(rate_sq / clean);
+        nis_mean = nis_sum / clean;
+        int ranges = runs * (RANGES - SETTLE);
+        printf(" %s: %d of %d runs without a restart, error %.1f mm rms (%.1f mm worst run), rate %.0f mm/s rms, NIS %.2f\n",
+            outliers ? "reflections" : "direct     ", clean, runs, err_rms, err_max, rate_rms, nis_mean);
+        printf("              %d restarts, %d reflections accepted, %d of %d direct ranges rejected\n",
+            restart_sum, missed_sum, dropped_sum, ranges);
+        // The filter averages the noise down, and a reflection no further off than that
+        TEST_CHECK(err_rms < 0.7 * RANGE_SIGMA, "error %.1f mm", err_rms);
+        TEST_CHECK(err_max < RANGE_SIGMA, "error %.1f mm in a run", err_max);
+        TEST_CHECK((nis_mean > 0.8) && (nis_mean < 1.2), "NIS %.2f", nis_mean);
+        // A 3 sigma gate drops 0.27% of the direct ranges
+        TEST_CHECK(dropped_sum < ranges / 100, "%d direct ranges rejected", dropped_sum);
+        // A reflection only gets in as the range a track restarts on
+        TEST_CHECK(missed_sum <= restart_sum, "%d reflections accepted", missed_sum);
+        TEST_CHECK(clean >= runs * 9 / 10, "%d runs restarted", runs - clean);
+    }
+
+    if (range_filter_step() || range_filter_peers())
+        return -1;
+
+    // Cost of one update with all the tracks in use
+    struct range_filter f;
+    range_filter_init(&f);
+    float filtered, sum = 0;
+    const int updates = 1000000;
+    clock_t t0 = clock();
+    for (int i = 0; i < updates; i++) {
+        range_filter_update(&f, (uint16_t)(i % PEERS), 1 + (uint64_t)i * (PERIOD_US / PEERS), 5000.0f + (float)(i & 63), &filtered);
+        sum += filtered;
+    }
+    double ns = (double)(clock() - t0) * 1e9 / CLOCKS_PER_SEC / updates;
+    printf(" %.1f ns per update, %d tracks (%.0f)\n", ns, PEERS, (double)sum / updates);
+    return 0;
+}
@@ -0,0 +1,215 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "tdoa.h"
+#include "clock_sync.h"
+#include "sim_rand.h"
+
+#include <math.h>
+#include <stdbool.h>
+
+#define TICK_HZ             (63.8976e9)     // DW1000 sampling clock, the timestamp unit
+#define SPEED_OF_LIGHT      (299792458.0)
+#define TAGS                (6)
+#define BLINKS              (300)           // Blinks per tag, enough for the sequence number to wrap
+#define BLINK_PERIOD_S      (0.1)
+#define STAMP_SIGMA         (6.0)           // RX timestamp noise (ticks), about 3 cm
+#define REF_START           (TDOA_STAMP_MASK - (uint64_t)(5.0 * TICK_HZ))  // The reference wraps 5 s in
+#define SYNC_PERIOD_S       (0.1)           // SYNC_PERIOD_MS of dw1000.h
+#define SYNC_WARMUP_S       (2.0)           // Sync frames before the first blink, for the lock
+
+// The clock filter of dw1000.h, with the timestamp noise of this simulation
+#define KF_R                (STAMP_SIGMA * STAMP_SIGMA)
+#define KF_Q                (4.0e3)
+#define KF_DRIFT0           (1.3e6)
+#define LOCK_NIS            (16.0)
+#define LOCK_COUNT          (10)
+#define UNLOCK_COUNT        (5)
+
+// The default MULTILAT_ANCHOR_MAP of dw1000.h, the first one is the reference
+static const struct {uint16_t id; double pos[3];} m_anchors[] = {
+    {0x0001, {0.0, 0.0, 2.5}},
+    {0x0002, {6.0, 0.0, 2.0}},
+    {0x0003, {6.0, 4.0, 2.5}},
+    {0x0004, {0.0, 4.0, 1.2}},
+};
+#define ANCHORS ((int)(sizeof(m_anchors) / sizeof(m_anchors[0])))
+
+static double anchor_dist(int a, int b)
+{
+    double d = 0;
+    for (int i = 0; i < 3; i++)
+        d += (m_anchors[a].pos[i] - m_anchors[b].pos[i]) * (m_anchors[a].pos[i] - m_anchors[b].pos[i]);
+    return sqrt(d);
+}
+
+/**
+ * @brief Free running anchor clock at time t (s), noise free.
+ */
+static uint64_t anchor_clock(uint64_t start, double ppm, double t)
+{
+    return (start + (uint64_t)llround(t * TICK_HZ * (1.0 + ppm * 1e-6))) & TDOA_STAMP_MASK;
+}
+
+/**
+ * @brief A blink as it is on air, FCS included.
+ */
+static void sim_blink(uint8_t frame[TDOA_BLINK_LEN], uint64_t eui, uint8_t seq_num)
+{
+    frame[0] = 0xC5;
+    frame[1] = seq_num;
+    for (int i = 0; i < 8; i++)
+        frame[2 + i] = (uint8_t)(eui >> (8 * i));
+    frame[10] = frame[11] = 0;
+}
+
+static int anchor_index(uint16_t id)
+{
+    for (int i = 0; i < ANCHORS; i++)
+        if (m_anchors[i].id == id)
+            return i;
+    return -1;
+}
+
+/**
+ * @brief Tags blink in turn from random places in the anchor area, every
+ * anchor hears every blink and emits a record line.
+ *
+ * Each anchor counts in its own free running clock, with its own start and
+ * crystal offset, and its RX timestamps carry STAMP_SIGMA of noise. The
+ * reference anchor sends a sync frame every SYNC_PERIOD_S, the others track
+ * its clock with clock_sync and map the RX timestamp of a blink through it;
+ * the reference stamp of the reference anchor is its RX timestamp. The
+ * collector parses the lines of a blink back, matches them on tag and
+ * sequence number and checks that the reference stamp differences give the
+ * range differences.
+ *
+ * @param[out] rmse      Range difference error (m).
+ */
+static int tdoa_sim(double *rmse)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+
+    uint64_t start[ANCHORS];
+    double ppm[ANCHORS];
+    struct clock_sync sync[ANCHORS];
+    for (int a = 0; a < ANCHORS; a++) {
+        start[a] = (a ? ((uint64_t)sim_rand_u32(&rnd) << 8) : REF_START) & TDOA_STAMP_MASK;
+        ppm[a]   = sim_rand_range(&rnd, -20, 20);
+        sync[a]  = (struct clock_sync){.r = KF_R, .q = KF_Q, .drift0 = KF_DRIFT0, .lock_nis = LOCK_NIS,
+            .lock_count = LOCK_COUNT, .unlock_count = UNLOCK_COUNT};
+    }
+
+    double t = SYNC_WARMUP_S, t_sync = 0, err_sq = 0, err_max = 0;
+    int records = 0, diffs = 0;
+    uint64_t last_ref = REF_START;
+    bool wrapped = false;
+    for (int b = 0; b < BLINKS; b++) {
+        for (int k = 0; k < TAGS; k++) {
+            uint64_t eui = 0x0011223344550000ULL | (uint64_t)k;
+            uint8_t seq_num = (uint8_t)(b + 17 * k);
+            double tag[3] = {sim_rand_range(&rnd, 0, 6), sim_rand_range(&rnd, 0, 4), 1.0};
+            t += BLINK_PERIOD_S / TAGS;
+
+            // The sync frames sent up to the blink, the reference TX timestamp plus the time of flight
+            for (; t_sync <= t; t_sync += SYNC_PERIOD_S) {
+                uint64_t ref_ts = anchor_clock(start[0], ppm[0], t_sync);
+                for (int a = 1; a < ANCHORS; a++) {
+                    double tof = anchor_dist(0, a) / SPEED_OF_LIGHT;
+                    uint64_t local_ts = (anchor_clock(start[a], ppm[a], t_sync + tof) + (uint64_t)llround(STAMP_SIGMA * sim_rand_normal(&rnd))) & TDOA_STAMP_MASK;
+                    clock_sync_update(&sync[a], local_ts, (ref_ts + (uint64_t)llround(tof * TICK_HZ)) & TDOA_STAMP_MASK);
+                }
+            }
+
+            uint8_t frame[TDOA_BLINK_LEN];
+            sim_blink(frame, eui, seq_num);
+
+            char lines[ANCHORS][TDOA_LINE_MAX];
+            double dist[ANCHORS];
+            for (int a = 0; a < ANCHORS; a++) {
+                dist[a] = 0;
+                for (int i = 0; i < 3; i++)
+                    dist[a] += (tag[i] - m_anchors[a].pos[i]) * (tag[i] - m_anchors[a].pos[i]);
+                dist[a] = sqrt(dist[a]);
+                double t_rx = t + dist[a] / SPEED_OF_LIGHT;
+
+                struct tdoa_record rec;
+                TEST_CHECK(!tdoa_record_from_blink(&rec, frame, sizeof(frame)), "blink rejected");
+                rec.rx_stamp  = (anchor_clock(start[a], ppm[a], t_rx) + (uint64_t)llround(STAMP_SIGMA * sim_rand_normal(&rnd))) & TDOA_STAMP_MASK;
+                rec.anchor_id = m_anchors[a].id;
+                rec.fp_power  = (int16_t)lround(-6000 - 2000 * log10(dist[a]));
+                rec.rx_power  = rec.fp_power + 300;
+                if (a)
+                    TEST_CHECK(!clock_sync_to_ref(&sync[a], rec.rx_stamp, &rec.ref_stamp), "anchor %04x not locked", rec.anchor_id);
+                else
+                    rec.ref_stamp = rec.rx_stamp;
+                wrapped |= rec.ref_stamp < last_ref;
+                last_ref = rec.ref_stamp;
+                TEST_CHECK(tdoa_format(lines[a], sizeof(lines[a]), &rec) > 0, "line too long");
+
+                struct tdoa_record back;
+                TEST_CHECK(!tdoa_parse(&back, lines[a]), "%s", lines[a]);
+                TEST_CHECK((back.tag_eui == rec.tag_eui) && (back.seq_num == rec.seq_num) &&
+                    (back.anchor_id == rec.anchor_id) && (back.rx_stamp == rec.rx_stamp) &&
+                    (back.fp_power == rec.fp_power) && (back.rx_power == rec.rx_power) &&
+                    (back.ref_stamp == rec.ref_stamp), "%s", lines[a]);
+            }
+
+            // The collector only has the lines
+            struct tdoa_record recs[ANCHORS];
+            for (int a = 0; a < ANCHORS; a++) {
+                TEST_CHECK(!tdoa_parse(&recs[a], lines[a]), "%s", lines[a]);
+                TEST_CHECK((recs[a].tag_eui == eui) && (recs[a].seq_num == seq_num), "%s", lines[a]);
+                records++;
+            }
+            int ref = anchor_index(recs[0].anchor_id);
+            TEST_CHECK(ref == 0, "reference %04x", recs[0].anchor_id);
+            for (int a = 1; a < ANCHORS; a++) {
+                int i = anchor_index(recs[a].anchor_id);
+                TEST_CHECK(i == a, "anchor %04x", recs[a].anchor_id);
+                double dd  = (double)tdoa_stamp_diff(recs[a].ref_stamp, recs[0].ref_stamp) * SPEED_OF_LIGHT / TICK_HZ;
+                double err = dd - (dist[i] - dist[ref]);
+                err_sq += err * err;
+                err_max = fmax(err_max, fabs(err));
+                diffs++;
+            }
+        }
+    }
+
+    *rmse = sqrt(err_sq / diffs);
+    printf(" %d tags, %d anchors: %d records, %d range differences, rmse %.3f m, max %.3f m\n",
+        TAGS, ANCHORS, records, diffs, *rmse, err_max);
+    TEST_CHECK(records == TAGS * BLINKS * ANCHORS, "%d records", records);
+    TEST_CHECK(wrapped, "the reference stamps did not wrap");
+    TEST_CHECK(err_max < 8 * STAMP_SIGMA * SPEED_OF_LIGHT / TICK_HZ, "max error %.3f m", err_max);
+    return 0;
+}
+
+int test_tdoa(void)
+{
+    uint8_t frame[TDOA_BLINK_LEN];
+    struct tdoa_record rec;
+    sim_blink(frame, 0x0102030405060708ULL, 9);
+    TEST_CHECK(!tdoa_record_from_blink(&rec, frame, sizeof(frame)), "blink");
+    TEST_CHECK((rec.tag_eui == 0x0102030405060708ULL) && (rec.seq_num == 9), "blink fields");
+    TEST_CHECK(tdoa_record_from_blink(&rec, frame, sizeof(frame) - 1), "short blink");
+    frame[0] = 0x41;
+    TEST_CHECK(tdoa_record_from_blink(&rec, frame, sizeof(frame)), "not a blink");
+    TEST_CHECK(tdoa_parse(&rec, "tdoa,0102030405060708,9,0001,0000000001,-6000"), "truncated line");
+    TEST_CHECK(tdoa_parse(&rec, "tdoa,0102030405060708,300,0001,0000000001,-6000,-5700,0000000001"), "sequence number");
+    TEST_CHECK(tdoa_stamp_diff(0x0000000010ULL, 0xFFFFFFFFF0ULL) == 0x20, "wrap");
+    TEST_CHECK(tdoa_stamp_diff(0xFFFFFFFFF0ULL, 0x0000000010ULL) == -0x20, "wrap back");
+
+    double rmse;
+    printf("blinks every %.0f ms, sync frames every %.0f ms, stamp noise %.0f ticks\n",
+        BLINK_PERIOD_S * 1000, SYNC_PERIOD_S * 1000, STAMP_SIGMA);
+    if (tdoa_sim(&rmse))
+        return -1;
+    TEST_CHECK(rmse < 2 * STAMP_SIGMA * SPEED_OF_LIGHT / TICK_HZ, "rmse %.3f m", rmse);
+    return 0;
+}
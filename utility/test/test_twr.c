@@ -0,0 +1,244 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "test.h"
+#include "twr.h"
+#include "sim_rand.h"
+
+#include <math.h>
+#include <time.h>
+
+#define TICK_HZ             (63.8976e9)     // DW1000 sampling clock, the timestamp unit
+#define SPEED_OF_LIGHT      (299792458.0)
+#define M_PER_TICK          (SPEED_OF_LIGHT / TICK_HZ)
+#define STAMP_MASK          (0xFFFFFFFFFFULL)   // 40-bit DW1000 timestamps
+#define DS_RANGE_RUNS       (100000)
+
+/**
+ * @brief DRX_CAR_INT as the receiver would read it, built from the user
+ * manual rather than from twr.c.
+ *
+ * The integrator holds the offset of the local receiver's carrier above the
+ * remote transmitter's, in steps of 998.4 MHz / 2 / 1024 / 2^17 (8192 in
+ * place of 1024 at 110 kb/s), as a 21-bit two's complement number.
+ *
+ * @param[out] reg       The three register bytes.
+ * @param[in]  f_rx      Carrier of the local receiver (Hz).
+ * @param[in]  f_tx      Carrier of the remote transmitter (Hz).
+ * @param[in]  br_110k   Received at 110 kb/s.
+ *
+ * @return False if the offset is beyond the 21 bits, as 80 ppm on channel 5
+ *         at 110 kb/s is.
+ */
+static bool sim_car_int(uint8_t reg[3], double f_rx, double f_tx, bool br_110k)
+{
+    double step_hz = 998.4e6 / 2 / (br_110k ? 8192 : 1024) / 131072;
+    long steps = lround((f_rx - f_tx) / step_hz);
+    if ((steps < -0x100000) || (steps > 0xFFFFF))
+        return false;
+    uint32_t value = (uint32_t)steps & 0x1FFFFF;
+    reg[0] = (uint8_t)value;
+    reg[1] = (uint8_t)(value >> 8);
+    reg[2] = (uint8_t)(value >> 16);
+    return true;
+}
+
+/**
+ * @brief SS-TWR over 10 m with a 2 ms reply, crystal offsets of up to
+ * +-40 ppm on either side, on channels 1, 2, 3 and 5.
+ *
+ * Each side counts in its own clock: the responder measures the reply, the
+ * initiator the round trip. The initiator then corrects the reply with the
+ * clock offset it reads from the carrier of the response.
+ */
+static int twr_ss_sim(void)
+{
+    const double ppm[] = {-40, -20, -10, -2, 0, 2, 10, 20, 40};
+    const struct {uint8_t chan; double fc;} chans[] = {{1, 3494.4e6}, {2, 3993.6e6}, {3, 4492.8e6}, {5, 6489.6e6}};
+    const double dist = 10.0;
+    const double tof = dist / M_PER_TICK;
+    const double reply = 2e-3 * TICK_HZ;
+
+    for (size_t c = 0; c < sizeof(chans) / sizeof(chans[0]); c++) {
+        for (int br_110k = 0; br_110k < 2; br_110k++) {
+            double err_raw = 0, err_cor = 0;
+            int beyond = 0;
+            for (size_t i = 0; i < sizeof(ppm) / sizeof(ppm[0]); i++) {
+                for (size_t j = 0; j < sizeof(ppm) / sizeof(ppm[0]); j++) {
+                    double e_resp = ppm[i] * 1e-6;
+                    double e_init = ppm[j] * 1e-6;
+                    uint32_t t_reply = (uint32_t)llround(reply * (1.0 + e_resp));
+                    uint32_t t_round = (uint32_t)llround((2.0 * tof + reply) * (1.0 + e_init));
+
+                    uint8_t reg[3];
+                    if (!sim_car_int(reg, chans[c].fc * (1.0 + e_init), chans[c].fc * (1.0 + e_resp), br_110k)) {
+                        beyond++;
+                        continue;
+                    }
+                    float ratio = twr_clock_offset_ratio(twr_car_int(reg), br_110k, chans[c].chan);
+                    TEST_CHECK(fabs(ratio - (e_resp - e_init)) < 0.05e-6, "ratio %g for %g ppm", ratio, (e_resp - e_init) * 1e6);
+
+                    err_raw = fmax(err_raw, fabs(twr_ss_tof(t_round, t_reply, 0.0f) - tof));
+                    err_cor = fmax(err_cor, fabs(twr_ss_tof(t_round, t_reply, ratio) - tof));
+                }
+            }
+            printf(" channel %u%s: max err %.1f cm raw, %.2f cm corrected, %d offsets beyond DRX_CAR_INT\n",
+                chans[c].chan, br_110k ? " 110k" : "", err_raw * M_PER_TICK * 100, err_cor * M_PER_TICK * 100, beyond);
+            TEST_CHECK(err_cor * M_PER_TICK < 0.01, "channel %u", chans[c].chan);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief DS-TWR over 0 to 100 m with replies of 1 ms to 200 ms on either
+ * side and crystal offsets of up to +-40 ppm, each side counting in its own
+ * clock.
+ *
+ * The asymmetric formula cancels the offsets down to tof times the mean
+ * offset, the integer result must stay within that and the Q8 rounding.
+ */
+static int twr_ds_sim(void)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 1);
+
+    double err_max = 0;
+    for (int i = 0; i < 20000; i++) {
+        double tof     = sim_rand_range(&rnd, 0, 100.0 / M_PER_TICK);
+        double reply_a = sim_rand_range(&rnd, 1e-3, 200e-3) * TICK_HZ;
+        double reply_b = sim_rand_range(&rnd, 1e-3, 200e-3) * TICK_HZ;
+        double e_a     = sim_rand_range(&rnd, -40e-6, 40e-6);
+        double e_b     = sim_rand_range(&rnd, -40e-6, 40e-6);
+        uint64_t t_round_1 = (uint64_t)llround((2.0 * tof + reply_b) * (1.0 + e_a));
+        uint64_t t_reply_1 = (uint64_t)llround(reply_b * (1.0 + e_b));
+        uint64_t t_round_2 = (uint64_t)llround((2.0 * tof + reply_a) * (1.0 + e_b));
+        uint64_t t_reply_2 = (uint64_t)llround(reply_a * (1.0 + e_a));
+
+        double err = twr_ds_tof_q8(t_round_1, t_reply_1, t_round_2, t_reply_2) / 256.0 - tof;
+        TEST_CHECK(fabs(err) < 1.0 + tof * 40e-6, "tof %.1f, err %.3f ticks", tof, err);
+        err_max = fmax(err_max, fabs(err));
+    }
+
+    printf("ds-twr: 0 to 100 m, reply 1 to 200 ms, +-40 ppm: max err %.2f cm\n", err_max * M_PER_TICK * 100);
+    return 0;
+}
+
+/**
+ * @brief The DS-TWR time of flight in double precision, as the reference for
+ * twr_ds_tof_q8().
+ *
+ * round_1 * round_2 - reply_1 * reply_2 is formed as
+ * round_1 * (round_2 - reply_2) + reply_2 * (round_1 - reply_1), so the two
+ * products of up to 80 bits do not cancel each other in a 53-bit mantissa.
+ *
+ * @return Time of flight in Q8 units, negative as computed.
+ */
+static double twr_ds_tof_q8_ref(uint64_t t_round_1, uint64_t t_reply_1, uint64_t t_round_2, uint64_t t_reply_2)
+{
+    double num = (double)t_round_1 * ((double)t_round_2 - (double)t_reply_2) +
+        (double)t_reply_2 * ((double)t_round_1 - (double)t_reply_1);
+    double den = (double)t_round_1 + (double)t_round_2 + (double)t_reply_1 + (double)t_reply_2;
+    return 256.0 * num / den;
+}
+
+/**
+ * @brief twr_ds_tof_q8() against the double reference over the whole 40-bit
+ * timestamp range.
+ *
+ * Both clocks start anywhere in their 40 bits and the replies take up to
+ * half the timestamp range, about 8.6 s, so the intervals are taken across
+ * the wrap as the driver takes them. The integer result must be the
+ * reference rounded to nearest, and 0 where it is negative.
+ */
+static int twr_ds_range_sim(void)
+{
+    struct sim_rand rnd;
+    sim_rand_seed(&rnd, 2);
+
+    const int n = DS_RANGE_RUNS;
+    static uint64_t iv[DS_RANGE_RUNS][4];
+    int wraps = 0, negative = 0;
+    double dev_max = 0;
+    for (int i = 0; i < n; i++) {
+        uint64_t a0 = (((uint64_t)sim_rand_u32(&rnd) << 8) | (sim_rand_u32(&rnd) & 0xFF)) & STAMP_MASK;
+        uint64_t b0 = (((uint64_t)sim_rand_u32(&rnd) << 8) | (sim_rand_u32(&rnd) & 0xFF)) & STAMP_MASK;
+        double e_a     = sim_rand_range(&rnd, -40e-6, 40e-6);
+        double e_b     = sim_rand_range(&rnd, -40e-6, 40e-6);
+        double tof     = sim_rand_range(&rnd, 0, 1000.0 / M_PER_TICK);
+        double reply_b = sim_rand_range(&rnd, 0, 0.5) * STAMP_MASK;
+        double reply_a = sim_rand_range(&rnd, 0, 0.5) * STAMP_MASK;
+
+        // Poll TX, response RX and final TX on A; poll RX, response TX and final RX on B
+        uint64_t a_poll_tx  = a0;
+        uint64_t b_poll_rx  = b0;
+        uint64_t b_resp_tx  = (b0 + (uint64_t)llround(reply_b * (1.0 + e_b))) & STAMP_MASK;
+        uint64_t a_resp_rx  = (a0 + (uint64_t)llround((2.0 * tof + reply_b) * (1.0 + e_a))) & STAMP_MASK;
+        uint64_t a_final_tx = (a_resp_rx + (uint64_t)llround(reply_a * (1.0 + e_a))) & STAMP_MASK;
+        uint64_t b_final_rx = (b_resp_tx + (uint64_t)llround((2.0 * tof + reply_a) * (1.0 + e_b))) & STAMP_MASK;
+        wraps += (a_resp_rx < a_poll_tx) || (a_final_tx < a_resp_rx) || (b_resp_tx < b_poll_rx) || (b_final_rx < b_resp_tx);
+
+        iv[i][0] = (a_resp_rx - a_poll_tx) & STAMP_MASK;
+        iv[i][1] = (b_resp_tx - b_poll_rx) & STAMP_MASK;
+        iv[i][2] = (b_final_rx - b_resp_tx) & STAMP_MASK;
+        iv[i][3] = (a_final_tx - a_resp_rx) & STAMP_MASK;
+
+        double ref = twr_ds_tof_q8_ref(iv[i][0], iv[i][1], iv[i][2], iv[i][3]);
+        uint32_t q8 = twr_ds_tof_q8(iv[i][0], iv[i][1], iv[i][2], iv[i][3]);
+        if (ref < 0) {
+            negative++;
+            TEST_CHECK(q8 == 0, "negative tof %.2f as %u", ref, q8);
+            continue;
+        }
+        double dev = fabs(q8 - ref);
+        TEST_CHECK(dev <= 0.5 + 1e-6, "q8 %u, reference %.4f", q8, ref);
+        dev_max = fmax(dev_max, dev);
+    }
+
+    // Edge cases: the widest intervals, and a time of flight past the 32-bit Q8 result
+    TEST_CHECK(twr_ds_tof_q8(STAMP_MASK, STAMP_MASK - 2, STAMP_MASK, STAMP_MASK - 2) ==
+        (uint32_t)llround(twr_ds_tof_q8_ref(STAMP_MASK, STAMP_MASK - 2, STAMP_MASK, STAMP_MASK - 2)), "widest intervals");
+    TEST_CHECK(twr_ds_tof_q8(STAMP_MASK, 0, STAMP_MASK, 0) == UINT32_MAX, "saturation");
+    TEST_CHECK(twr_ds_tof_q8(10, 12, 10, 12) == 0, "negative tof");
+    TEST_CHECK(twr_ds_tof_q8(0, 0, 0, 0) == 0, "no intervals");
+
+    // Host cost of the 128-bit arithmetic against the double formula
+    volatile uint32_t sink_q8 = 0;
+    volatile double sink_ref = 0;
+    clock_t t0 = clock();
+    for (int i = 0; i < n; i++)
+        sink_q8 += twr_ds_tof_q8(iv[i][0], iv[i][1], iv[i][2], iv[i][3]);
+    clock_t t_q8 = clock() - t0;
+    t0 = clock();
+    for (int i = 0; i < n; i++)
+        sink_ref += twr_ds_tof_q8_ref(iv[i][0], iv[i][1], iv[i][2], iv[i][3]);
+    clock_t t_ref = clock() - t0;
+
+    printf("ds-twr: 40-bit range, replies up to %.1f s: %d exchanges, %d across the wrap, %d negative, max dev %.3f Q8\n",
+        0.5 * STAMP_MASK / TICK_HZ, n, wraps, negative, dev_max);
+    printf("ds-twr: %.1f ns per twr_ds_tof_q8(), %.1f ns per double reference on the host\n",
+        1e9 * t_q8 / CLOCKS_PER_SEC / n, 1e9 * t_ref / CLOCKS_PER_SEC / n);
+    TEST_CHECK(wraps > n / 4, "%d exchanges across the wrap", wraps);
+    return 0;
+}
+
+int test_twr(void)
+{
+    uint8_t reg[3] = {0xFF, 0xFF, 0x1F};
+    TEST_CHECK(twr_car_int(reg) == -1, "sign extension");
+    reg[2] = 0xFF;
+    TEST_CHECK(twr_car_int(reg) == -1, "bits above 20");
+    reg[0] = 0x00, reg[1] = 0x00, reg[2] = 0x10;
+    TEST_CHECK(twr_car_int(reg) == -0x100000, "most negative");
+
+    printf("ss-twr: 10 m, reply 2000 us, +-40 ppm\n");
+    if (twr_ss_sim())
+        return -1;
+    if (twr_ds_sim())
+        return -1;
+    return twr_ds_range_sim();
+}
@@ -0,0 +1,152 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "twr.h"
+
+/**
+ * @brief Sign-extend the 21-bit carrier recovery integrator.
+ *
+ * @param[in] reg        The three bytes of DRX_CAR_INT as read.
+ */
+int32_t twr_car_int(const uint8_t reg[3])
+{
+    uint32_t value = reg[0] | (reg[1] << 8) | ((reg[2] & 0x1F) << 16);
+    if (value & 0x100000)
+        value |= 0xFFE00000;
+    return (int32_t)value;
+}
+
+/**
+ * @brief Clock offset of the remote transmitter relative to the local clock,
+ * derived from the carrier recovery integrator. The ratio is positive when
+ * the remote clock runs faster.
+ *
+ * DRX_CAR_INT is positive when the local receiver's carrier is above the
+ * remote transmitter's, hence the sign.
+ *
+ * @param[in] car_int    Content of DRX_CAR_INT, see twr_car_int().
+ * @param[in] br_110k    The frame was received at 110 kb/s.
+ * @param[in] chan       Channel number.
+ */
+float twr_clock_offset_ratio(int32_t car_int, bool br_110k, uint8_t chan)
+{
+    return (float)car_int * (-TWR_CAR_INT_HZ(br_110k) / TWR_CHAN_FREQ_HZ(chan));
+}
+
+/**
+ * @brief Single-sided TWR time of flight with clock offset correction.
+ *
+ * tof = (t_round - t_reply * (1 - ratio)) / 2
+ *
+ * t_reply is measured with the clock of the responder, the correction turns it
+ * into units of the local clock before it is subtracted. The large terms are
+ * subtracted as integers, only the correction needs floating point.
+ *
+ * @param[in] t_round    Response RX timestamp minus poll TX timestamp.
+ * @param[in] t_reply    Response TX timestamp minus poll RX timestamp.
+ * @param[in] ratio      Clock offset of the responder, see twr_clock_offset_ratio().
+ *
+ * @return Time of flight in units of the 63.8976 GHz sampling clock.
+ */
+float twr_ss_tof(uint32_t t_round, uint32_t t_reply, float ratio)
+{
+    return ((float)(int32_t)(t_round - t_reply) + (float)t_reply * ratio) / 2.0f;
+}
+
+/**
+ * @brief Full 128-bit product of two 64-bit values.
+ */
+struct twr_u128 twr_u128_mul(uint64_t a, uint64_t b)
+{
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t p0 = a_lo * b_lo;
+    uint64_t p1 = a_lo * b_hi;
+    uint64_t p2 = a_hi * b_lo;
+    uint64_t p3 = a_hi * b_hi;
+    uint64_t mid = (p0 >> 32) + (uint32_t)p1 + (uint32_t)p2;
+
+    struct twr_u128 r = {
+        .hi = p3 + (p1 >> 32) + (p2 >> 32) + (mid >> 32),
+        .lo = (mid << 32) | (uint32_t)p0,
+    };
+    return r;
+}
+
+/**
+ * @brief True if a is below b.
+ */
+bool twr_u128_lt(struct twr_u128 a, struct twr_u128 b)
+{
+    return (a.hi < b.hi) || ((a.hi == b.hi) && (a.lo < b.lo));
+}
+
+static struct twr_u128 twr_u128_sub(struct twr_u128 a, struct twr_u128 b)
+{
+    struct twr_u128 r = {
+        .hi = a.hi - b.hi - (a.lo < b.lo),
+        .lo = a.lo - b.lo,
+    };
+    return r;
+}
+
+/**
+ * @brief Divide a 128-bit value by a divisor below 2^63. The quotient must
+ * fit in 64 bits.
+ */
+static uint64_t twr_u128_div(struct twr_u128 n, uint64_t d)
+{
+    if (n.hi == 0)
+        return n.lo / d;
+
+    uint64_t q = 0, rem = 0;
+    for (int i = 127; i >= 0; i--) {
+        rem = (rem << 1) | (((i >= 64) ? (n.hi >> (i - 64)) : (n.lo >> i)) & 1);
+        if (rem >= d) {
+            rem -= d;
+            if (i < 64)
+                q |= 1ULL << i;
+        }
+    }
+    return q;
+}
+
+/**
+ * @brief Asymmetric DS-TWR time of flight in integer arithmetic.
+ *
+ * tof = (t_round_1 * t_round_2 - t_reply_1 * t_reply_2) /
+ *       (t_round_1 + t_round_2 + t_reply_1 + t_reply_2)
+ *
+ * The intervals are up to 40 bits wide, so the products are formed in 128
+ * bits and no input scaling is needed for any reply time. The numerator is
+ * shifted by 8 bits before the rounded division to keep a fractional part.
+ *
+ * @return Time of flight in Q8 units of the 63.8976 GHz sampling clock, or 0
+ *         if the products give a negative time of flight or all intervals
+ *         are 0.
+ */
+uint32_t twr_ds_tof_q8(uint64_t t_round_1, uint64_t t_reply_1, uint64_t t_round_2, uint64_t t_reply_2)
+{
+    struct twr_u128 round = twr_u128_mul(t_round_1, t_round_2);
+    struct twr_u128 reply = twr_u128_mul(t_reply_1, t_reply_2);
+    if (twr_u128_lt(round, reply))
+        return 0;
+
+    uint64_t den = t_round_1 + t_round_2 + t_reply_1 + t_reply_2;
+    if (!den)
+        return 0;
+    struct twr_u128 num = twr_u128_sub(round, reply);
+    num.hi = (num.hi << 8) | (num.lo >> 56);
+    num.lo = (num.lo << 8);
+
+    // Round to nearest
+    uint64_t lo = num.lo + (den >> 1);
+    num.hi += (lo < num.lo);
+    num.lo = lo;
+
+    uint64_t tof_q8 = twr_u128_div(num, den);
+    return tof_q8 > UINT32_MAX ? UINT32_MAX : (uint32_t)tof_q8;
+}
@@ -0,0 +1,42 @@
+/**
+ * Copyright (c) 2025 Steve Chang
+ *
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TWR_H
+#define TWR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Two-way ranging arithmetic on DW1000 timestamps, in units of the
+ * 63.8976 GHz sampling clock.
+ */
+
+/**
+ * DRX_CAR_INT counts the carrier frequency offset in steps of
+ * 998.4 MHz / 2 / 1024 / 2^17 Hz, 8192 in place of 1024 at 110 kb/s.
+ */
+#define TWR_CAR_INT_HZ(br_110k)         (998.4e6f / 2.0f / ((br_110k) ? 8192.0f : 1024.0f) / 131072.0f)
+#define TWR_CHAN_FREQ_HZ(chan) \
+    ((chan) == 1 ? 3494.4e6f : \
+     (chan) == 3 ? 4492.8e6f : \
+     ((chan) == 2 || (chan) == 4) ? 3993.6e6f : 6489.6e6f)
+
+int32_t twr_car_int(const uint8_t reg[3]);
+float twr_clock_offset_ratio(int32_t car_int, bool br_110k, uint8_t chan);
+float twr_ss_tof(uint32_t t_round, uint32_t t_reply, float ratio);
+
+struct twr_u128
+{
+    uint64_t hi;
+    uint64_t lo;
+};
+
+struct twr_u128 twr_u128_mul(uint64_t a, uint64_t b);
+bool twr_u128_lt(struct twr_u128 a, struct twr_u128 b);
+uint32_t twr_ds_tof_q8(uint64_t t_round_1, uint64_t t_reply_1, uint64_t t_round_2, uint64_t t_reply_2);
+
+#endif  // ~ TWR_H